@@ -0,0 +1,271 @@
+/*
+ * Stress CompletionWorkerPool and SerialExecutor with an in-memory
+ * completion queue, so the proxy worker model can be checked on any platform.
+ *
+ * Every context bounces a chain of operations between the workers,
+ * a reply thread (like MessageDispatcher) and synchronous replies
+ * posted from inside a running task. A context handled by two threads
+ * at once, or a step seen out of order, is counted as a violation.
+ */
+
+#include "log.h"
+#include "completion_queue.h"
+#include "serial_executor.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOption
+{
+	size_t contextCount = 256;
+	size_t operationCount = 2000;
+	size_t workerCount = 4;
+	size_t replyInterval = 4;
+	size_t workUs = 0;
+};
+
+/// <summary>
+/// A completion queue fed by Post instead of the kernel
+/// </summary>
+class FakeCompletionQueue :public sab::ICompletionQueue
+{
+private:
+	std::deque<sab::CompletionPacket> packetList;
+	std::mutex listMutex;
+	std::condition_variable wakeCondition;
+	bool closed = false;
+public:
+	void Post(const sab::CompletionPacket& packet)
+	{
+		std::lock_guard<std::mutex> lg(listMutex);
+		packetList.push_back(packet);
+		wakeCondition.notify_one();
+	}
+
+	bool Dequeue(sab::CompletionPacket* packet)override
+	{
+		std::unique_lock<std::mutex> lk(listMutex);
+		wakeCondition.wait(lk, [this]()
+			{
+				return closed || !packetList.empty();
+			});
+		if (closed)
+			return false;
+		*packet = packetList.front();
+		packetList.pop_front();
+		return true;
+	}
+
+	void Close()override
+	{
+		std::lock_guard<std::mutex> lg(listMutex);
+		closed = true;
+		wakeCondition.notify_all();
+	}
+};
+
+struct FakeContext
+{
+	sab::SerialExecutor executor;
+	std::atomic<int> active{ 0 };
+	// only touched on executor
+	size_t step = 0;
+};
+
+class Bench
+{
+private:
+	const BenchOption& option;
+	FakeCompletionQueue queue;
+	std::vector<std::unique_ptr<FakeContext>> contexts;
+
+	// replies posted from outside the worker pool
+	std::deque<std::pair<FakeContext*, size_t>> replyList;
+	std::mutex replyMutex;
+	std::condition_variable replyCondition;
+	bool replyStop = false;
+
+	std::mutex doneMutex;
+	std::condition_variable doneCondition;
+	size_t doneCount = 0;
+public:
+	std::atomic<size_t> violations{ 0 };
+	std::atomic<size_t> handled{ 0 };
+
+	Bench(const BenchOption& option)
+		:option(option)
+	{
+		for (size_t i = 0; i < option.contextCount; ++i)
+			contexts.emplace_back(new FakeContext);
+	}
+
+	void Run()
+	{
+		sab::CompletionWorkerPool pool;
+		if (!pool.Start(&queue, option.workerCount, [this](const sab::CompletionPacket& packet)
+			{
+				auto context = reinterpret_cast<FakeContext*>(packet.key);
+				size_t sequence = packet.transferred;
+				context->executor.Execute([this, context, sequence]()
+					{
+						Step(context, sequence);
+					});
+			}))
+		{
+			std::cerr << "cannot start workers!\n";
+			return;
+		}
+		std::thread replyThread([this]()
+			{
+				ReplyThreadProc();
+			});
+
+		for (auto& c : contexts)
+			queue.Post({ reinterpret_cast<uintptr_t>(c.get()), nullptr, 0, sab::CompletionStatus::Success });
+
+		{
+			std::unique_lock<std::mutex> lk(doneMutex);
+			doneCondition.wait(lk, [this]()
+				{
+					return doneCount == contexts.size();
+				});
+		}
+
+		pool.Stop();
+		{
+			std::lock_guard<std::mutex> lg(replyMutex);
+			replyStop = true;
+			replyCondition.notify_all();
+		}
+		replyThread.join();
+	}
+private:
+	void Step(FakeContext* context, size_t sequence)
+	{
+		if (context->active.fetch_add(1) != 0)
+			++violations;
+		if (sequence != context->step)
+			++violations;
+		++context->step;
+		++handled;
+
+		if (option.workUs)
+		{
+			auto until = Clock::now() + std::chrono::microseconds(option.workUs);
+			while (Clock::now() < until);
+		}
+
+		size_t next = context->step;
+		bool finished = next == option.operationCount;
+		context->active.fetch_sub(1);
+
+		if (finished)
+		{
+			std::lock_guard<std::mutex> lg(doneMutex);
+			if (++doneCount == contexts.size())
+				doneCondition.notify_all();
+			return;
+		}
+
+		if (option.replyInterval && next % option.replyInterval == 0)
+		{
+			if ((next / option.replyInterval) % 2)
+			{
+				// answered by another thread, like a dispatcher worker
+				std::lock_guard<std::mutex> lg(replyMutex);
+				replyList.emplace_back(context, next);
+				replyCondition.notify_one();
+			}
+			else
+			{
+				// answered synchronously, like a rejected request
+				context->executor.Execute([this, context, next]()
+					{
+						Step(context, next);
+					});
+			}
+			return;
+		}
+		queue.Post({ reinterpret_cast<uintptr_t>(context), nullptr,
+			static_cast<uint32_t>(next), sab::CompletionStatus::Success });
+	}
+
+	void ReplyThreadProc()
+	{
+		std::unique_lock<std::mutex> lk(replyMutex);
+		while (true)
+		{
+			replyCondition.wait(lk, [this]()
+				{
+					return replyStop || !replyList.empty();
+				});
+			if (replyList.empty())
+				return;
+			auto reply = replyList.front();
+			replyList.pop_front();
+			lk.unlock();
+			reply.first->executor.Execute([this, reply]()
+				{
+					Step(reply.first, reply.second);
+				});
+			lk.lock();
+		}
+	}
+};
+
+static bool ParseCommandLine(int argc, char** argv, BenchOption& option)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		size_t* target = nullptr;
+		if (arg == "-c")
+			target = &option.contextCount;
+		else if (arg == "-n")
+			target = &option.operationCount;
+		else if (arg == "-w")
+			target = &option.workerCount;
+		else if (arg == "-r")
+			target = &option.replyInterval;
+		else if (arg == "-s")
+			target = &option.workUs;
+		else
+			return false;
+		if (i + 1 >= argc)
+			return false;
+		*target = std::strtoul(argv[++i], nullptr, 0);
+	}
+	return option.contextCount > 0 && option.operationCount > 0 && option.workerCount > 0;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOption option;
+	if (!ParseCommandLine(argc, argv, option))
+	{
+		std::cerr << "Usage: " << argv[0] << " [-c contexts] [-n operationsPerContext] [-w workers] [-r replyInterval] [-s workUs]\n";
+		return 1;
+	}
+	sab::Logger::GetInstance().SetLevelOverride(sab::Logger::LogLevel::Error);
+
+	Bench bench(option);
+	auto begin = Clock::now();
+	bench.Run();
+	double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+	std::cout << "completions: " << bench.handled << ", "
+		<< static_cast<size_t>(bench.handled / seconds) << " ops/s, "
+		<< "violations: " << bench.violations << "\n";
+	return bench.violations == 0 ? 0 : 2;
+}
@@ -0,0 +1,309 @@
+/*
+ * Measures request latency through MessageDispatcher against in-memory
+ * upstream agents, so the dispatch path can be profiled on any platform.
+ */
+
+#include "log.h"
+#include "encoding.h"
+#include "message_dispatcher.h"
+#include "protocol/protocol_ssh_agent.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOption
+{
+	size_t clientCount = 3;
+	size_t keysPerClient = 8;
+	size_t requestCount = 10000;
+	size_t threadCount = 4;
+	size_t upstreamDelayUs = 0;
+	size_t workerCount = 1;
+	size_t queueCapacity = sab::MessageDispatcher::DEFAULT_QUEUE_CAPACITY;
+	size_t cacheTtlMs = 0;
+};
+
+/// <summary>
+/// An upstream agent which answers from memory after an optional delay
+/// </summary>
+class FakeAgentClient :public sab::ProtocolClientBase
+{
+private:
+	sab::SshAgentMessageRequestIdentitiesAnswer answer;
+	std::chrono::microseconds delay;
+public:
+	FakeAgentClient(size_t index, size_t keyCount, std::chrono::microseconds delay)
+		:delay(delay)
+	{
+		for (size_t i = 0; i < keyCount; ++i)
+		{
+			sab::SshAgentIdentity identity;
+			identity.blob = "ssh-ed25519-" + std::to_string(index) + "-" + std::to_string(i);
+			identity.blob.resize(51, 'k');
+			identity.comment = "key" + std::to_string(i) + "@client" + std::to_string(index);
+			answer.identities.emplace_back(std::move(identity));
+		}
+	}
+
+	const std::string& KeyBlob(size_t i)const { return answer.identities[i].blob; }
+
+	bool AllowConcurrentRequests()const override { return true; }
+
+	bool SendSshMessage(sab::SshMessageEnvelope* message)override
+	{
+		if (delay.count() > 0)
+			std::this_thread::sleep_for(delay);
+		if (message->length == 0)
+			return false;
+
+		sab::SshAgentMessageBufferReader reader(*message);
+		char type;
+		reader.ReadByte(type);
+		sab::SshAgentMessageBufferWriter writer(*message);
+		if (type == sab::SSH2_AGENTC_REQUEST_IDENTITIES)
+		{
+			writer.Init();
+			answer.ToBuffer(writer);
+			return true;
+		}
+		if (type == sab::SSH2_AGENTC_SIGN_REQUEST)
+		{
+			std::string blob;
+			if (!reader.ReadString(blob))
+				return false;
+			bool owned = std::any_of(answer.identities.begin(), answer.identities.end(),
+				[&](const sab::SshAgentIdentity& identity)
+				{
+					return identity.blob == blob;
+				});
+			writer.Init();
+			if (owned)
+			{
+				writer.WriteByte(sab::SSH2_AGENT_SIGN_RESPONSE);
+				writer.WriteString(std::string(83, 's'));
+			}
+			else
+			{
+				sab::SshAgentMessageGenericFailure{}.ToBuffer(writer);
+			}
+			return true;
+		}
+		writer.Init();
+		sab::SshAgentMessageGenericFailure{}.ToBuffer(writer);
+		return true;
+	}
+};
+
+/// <summary>
+/// A single in-flight request, waits for the dispatcher's reply
+/// </summary>
+class PendingRequest
+{
+private:
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool done = false;
+	bool status = false;
+public:
+	sab::SshMessageEnvelope message;
+
+	PendingRequest()
+	{
+		message.replyCallback = [this](sab::SshMessageEnvelope*, bool result)
+		{
+			std::lock_guard<std::mutex> lg(mutex);
+			status = result;
+			done = true;
+			cv.notify_one();
+		};
+	}
+
+	bool Wait()
+	{
+		std::unique_lock<std::mutex> lk(mutex);
+		cv.wait(lk, [this]() { return done; });
+		done = false;
+		return status;
+	}
+};
+
+static bool ParseCommandLine(int argc, char** argv, BenchOption& option)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		size_t* target = nullptr;
+		if (arg == "-c")
+			target = &option.clientCount;
+		else if (arg == "-k")
+			target = &option.keysPerClient;
+		else if (arg == "-n")
+			target = &option.requestCount;
+		else if (arg == "-t")
+			target = &option.threadCount;
+		else if (arg == "-d")
+			target = &option.upstreamDelayUs;
+		else if (arg == "-w")
+			target = &option.workerCount;
+		else if (arg == "-q")
+			target = &option.queueCapacity;
+		else if (arg == "-x")
+			target = &option.cacheTtlMs;
+		else
+			return false;
+		if (i + 1 >= argc)
+			return false;
+		*target = std::strtoul(argv[++i], nullptr, 0);
+	}
+	return option.clientCount > 0 && option.keysPerClient > 0 && option.threadCount > 0;
+}
+
+static void PrintReport(const char* name, std::vector<Clock::duration>& samples,
+	Clock::duration elapsed, size_t failures)
+{
+	std::sort(samples.begin(), samples.end());
+	auto us = [](Clock::duration d)
+	{
+		return std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(d).count();
+	};
+	auto percentile = [&](double p)
+	{
+		return us(samples[static_cast<size_t>(p * (samples.size() - 1))]);
+	};
+	double seconds = std::chrono::duration<double>(elapsed).count();
+	std::cout << name << ": " << samples.size() << " requests, "
+		<< failures << " failures, "
+		<< static_cast<size_t>(samples.size() / seconds) << " req/s, "
+		<< "p50=" << percentile(0.5) << "us "
+		<< "p99=" << percentile(0.99) << "us "
+		<< "max=" << us(samples.back()) << "us\n";
+}
+
+template<typename BuildRequest>
+static void RunScenario(const char* name, sab::MessageDispatcher& dispatcher,
+	const BenchOption& option, BuildRequest buildRequest)
+{
+	std::vector<std::vector<Clock::duration>> samples(option.threadCount);
+	std::atomic<size_t> failures{ 0 };
+	std::vector<std::thread> threads;
+	size_t perThread = option.requestCount / option.threadCount;
+
+	auto begin = Clock::now();
+	for (size_t t = 0; t < option.threadCount; ++t)
+	{
+		threads.emplace_back([&, t]()
+			{
+				PendingRequest request;
+				auto holdKey = std::make_shared<int>(0);
+				samples[t].reserve(perThread);
+				for (size_t i = 0; i < perThread; ++i)
+				{
+					sab::SshAgentMessageBufferWriter writer(request.message);
+					writer.Init();
+					buildRequest(writer, t * perThread + i);
+					auto start = Clock::now();
+					dispatcher.PostRequest(&request.message, holdKey);
+					bool status = request.Wait();
+					samples[t].push_back(Clock::now() - start);
+					if (!status || request.message.length == 0 ||
+						request.message.data[0] == sab::SSH_AGENT_FAILURE)
+						++failures;
+				}
+			});
+	}
+	for (auto& th : threads)
+		th.join();
+	auto elapsed = Clock::now() - begin;
+
+	std::vector<Clock::duration> merged;
+	for (auto& s : samples)
+		merged.insert(merged.end(), s.begin(), s.end());
+	if (merged.empty())
+		return;
+	PrintReport(name, merged, elapsed, failures);
+}
+
+int main(int argc, char** argv)
+{
+	BenchOption option;
+	if (!ParseCommandLine(argc, argv, option))
+	{
+		std::cerr << "Usage: " << argv[0] << " [-c clients] [-k keysPerClient] [-n requests] [-t threads] [-d upstreamDelayUs] [-w workers] [-q queueCapacity] [-x cacheTtlMs]\n";
+		return 1;
+	}
+	sab::Logger::GetInstance().SetLevelOverride(sab::Logger::LogLevel::Error);
+
+	sab::MessageDispatcher dispatcher;
+	if (!dispatcher.SetWorkerCount(option.workerCount) ||
+		!dispatcher.SetQueueCapacity(option.queueCapacity) ||
+		!dispatcher.SetIdentitiesCacheTtl(std::chrono::milliseconds(option.cacheTtlMs)))
+	{
+		std::cerr << "invalid dispatcher option!\n";
+		return 1;
+	}
+	std::vector<std::shared_ptr<FakeAgentClient>> clients;
+	for (size_t i = 0; i < option.clientCount; ++i)
+	{
+		auto client = std::make_shared<FakeAgentClient>(i, option.keysPerClient,
+			std::chrono::microseconds(option.upstreamDelayUs));
+		client->Name() = L"client" + std::to_wstring(i);
+		dispatcher.AddClient(client);
+		clients.emplace_back(std::move(client));
+	}
+	dispatcher.Start();
+
+	RunScenario("identities", dispatcher, option,
+		[](sab::SshAgentMessageBufferWriter& writer, size_t)
+		{
+			sab::SshAgentMessageRequestIdentities{}.ToBuffer(writer);
+		});
+
+	// sign with keys spread over all upstreams, the last one is the worst case
+	RunScenario("sign", dispatcher, option,
+		[&](sab::SshAgentMessageBufferWriter& writer, size_t i)
+		{
+			const auto& client = clients[i % clients.size()];
+			writer.WriteByte(sab::SSH2_AGENTC_SIGN_REQUEST);
+			writer.WriteString(client->KeyBlob(i % option.keysPerClient));
+			writer.WriteString(std::string(32, 'd'));
+			writer.WriteUInt32(0);
+		});
+
+	auto queue = dispatcher.GetQueueStatistics();
+	std::cout << "queue: capacity=" << queue.capacity
+		<< " maxDepth=" << queue.maxDepth
+		<< " accepted=" << queue.accepted
+		<< " rejected=" << queue.rejected
+		<< " meanWait=" << (queue.accepted ? queue.totalWait.count() / queue.accepted / 1000 : 0) << "us"
+		<< " maxWait=" << queue.maxWait.count() / 1000 << "us\n";
+
+	// what the dispatcher measured itself, per upstream
+	auto latency = dispatcher.GetLatencyStatistics();
+	for (const auto& upstream : latency.upstreams)
+	{
+		for (auto kind : { sab::DispatcherRequestKind::Identities, sab::DispatcherRequestKind::Sign })
+		{
+			const auto& request = upstream.requests[static_cast<size_t>(kind)];
+			std::cout << sab::WideStringToUtf8String(upstream.name) << ' '
+				<< sab::DispatcherRequestKindToString(kind)
+				<< ": succeeded=" << request.succeeded
+				<< " failed=" << request.failed
+				<< " p50=" << request.roundTrip.Percentile(0.5).count() << "us"
+				<< " p99=" << request.roundTrip.Percentile(0.99).count() << "us\n";
+		}
+	}
+
+	dispatcher.Stop();
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Measure what logging costs the calling threads, with the file sink
+ * written synchronously or by the async writer.
+ *
+ * The log file goes to $HOME/.ssh-agent-bridge.log, point HOME at a
+ * scratch directory. Every thread writes a numbered sequence, so the
+ * file can be checked for lost or reordered lines afterwards.
+ */
+
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOption
+{
+	size_t threadCount = 4;
+	size_t recordCount = 100000;
+	size_t async = 0;
+};
+
+static bool ParseCommandLine(int argc, char** argv, BenchOption& option)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		size_t* target = nullptr;
+		if (arg == "-t")
+			target = &option.threadCount;
+		else if (arg == "-n")
+			target = &option.recordCount;
+		else if (arg == "-a")
+			target = &option.async;
+		else
+			return false;
+		if (i + 1 >= argc)
+			return false;
+		*target = std::strtoul(argv[++i], nullptr, 0);
+	}
+	return option.threadCount > 0 && option.recordCount > 0;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOption option;
+	if (!ParseCommandLine(argc, argv, option))
+	{
+		std::cerr << "Usage: " << argv[0] << " [-t threads] [-n recordsPerThread] [-a 0|1]\n";
+		return 1;
+	}
+	auto& logger = sab::Logger::GetInstance();
+	logger.EnableFileLogOutput();
+	logger.SetLevelOverride(sab::Logger::LogLevel::Debug);
+	if (option.async != 0)
+		logger.EnableAsyncOutput();
+
+	std::vector<std::thread> threads;
+	std::vector<double> worstUs(option.threadCount, 0.0);
+	auto begin = Clock::now();
+	for (size_t t = 0; t < option.threadCount; ++t)
+	{
+		threads.emplace_back([&option, &worstUs, t]()
+			{
+				double worst = 0.0;
+				for (size_t i = 0; i < option.recordCount; ++i)
+				{
+					auto start = Clock::now();
+					LogDebug(L"bench thread ", t, L" record ", i);
+					worst = std::max(worst,
+						std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+				}
+				worstUs[t] = worst;
+			});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+	size_t total = option.threadCount * option.recordCount;
+	std::cout << "records: " << total << ", "
+		<< static_cast<size_t>(total / seconds) << " records/s on the calling threads, "
+		<< "worst call: " << static_cast<size_t>(*std::max_element(worstUs.begin(), worstUs.end())) << " us\n";
+	return 0;
+}
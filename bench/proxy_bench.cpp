@@ -0,0 +1,321 @@
+/*
+ * Load test EpollProxyConnectionManager over AF_UNIX socket pairs, so the
+ * proxy framing and pipelining can be exercised on Linux.
+ *
+ * Every client pipelines numbered requests and half-closes after the last
+ * one. Replies are produced by reply threads in random order, a reply
+ * arriving out of request order or with a wrong body is counted as a
+ * violation.
+ *
+ * With -t the connections are traced to $HOME/.ssh-agent-bridge.trace,
+ * to measure what tracing costs and to try trace-decode on.
+ */
+
+#include "log.h"
+#include "trace.h"
+#include "protocol/connection_manager/epoll_proxy.h"
+#include "protocol/protocol_ssh_agent.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOption
+{
+	size_t connectionCount = 32;
+	size_t requestCount = 2000;
+	size_t pipelineDepth = 8;
+	size_t workerCount = 2;
+	size_t replyThreadCount = 2;
+	size_t messageSize = 64;
+	size_t traceRecords = 0;
+};
+
+class Bench
+{
+private:
+	struct PendingReply
+	{
+		sab::SshMessageEnvelope* message;
+		std::shared_ptr<void> holdKey;
+	};
+
+	const BenchOption& option;
+	sab::EpollProxyConnectionManager manager;
+
+	std::vector<PendingReply> replyList;
+	std::mutex replyMutex;
+	std::condition_variable replyCondition;
+	bool replyStop = false;
+
+	std::vector<double> latencyUs;
+	std::mutex latencyMutex;
+public:
+	std::atomic<size_t> violations{ 0 };
+	std::atomic<size_t> completed{ 0 };
+	size_t leakedContexts = 0;
+
+	Bench(const BenchOption& option)
+		:option(option)
+	{
+	}
+
+	bool Run()
+	{
+		manager.SetWorkerCount(option.workerCount);
+		manager.SetEmitMessageCallback([this](sab::SshMessageEnvelope* message, std::shared_ptr<void> holdKey)
+			{
+				std::lock_guard<std::mutex> lg(replyMutex);
+				replyList.push_back({ message, std::move(holdKey) });
+				replyCondition.notify_one();
+			});
+		if (!manager.Initialize() || !manager.Start())
+		{
+			std::cerr << "cannot start connection manager!\n";
+			return false;
+		}
+
+		std::vector<std::thread> replyThreads;
+		for (size_t i = 0; i < option.replyThreadCount; ++i)
+		{
+			replyThreads.emplace_back([this, i]()
+				{
+					ReplyThreadProc(i);
+				});
+		}
+
+		std::vector<std::thread> clients;
+		for (size_t i = 0; i < option.connectionCount; ++i)
+		{
+			int pair[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1
+				|| !manager.DelegateConnection(pair[1]))
+			{
+				std::cerr << "cannot create connection!\n";
+				++violations;
+				continue;
+			}
+			clients.emplace_back([this, fd = pair[0], i]()
+				{
+					ClientProc(fd, static_cast<uint32_t>(i));
+				});
+		}
+		for (auto& t : clients)
+			t.join();
+
+		// closed connections leave the manager once their last operation completes
+		auto deadline = Clock::now() + std::chrono::seconds(1);
+		while (manager.GetActiveCount() > 0 && Clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		leakedContexts = manager.GetActiveCount();
+
+		manager.Stop();
+		{
+			std::lock_guard<std::mutex> lg(replyMutex);
+			replyStop = true;
+			replyCondition.notify_all();
+		}
+		for (auto& t : replyThreads)
+			t.join();
+		return true;
+	}
+
+	double Percentile(double p)
+	{
+		if (latencyUs.empty())
+			return 0;
+		std::sort(latencyUs.begin(), latencyUs.end());
+		return latencyUs[std::min(latencyUs.size() - 1, static_cast<size_t>(p * latencyUs.size()))];
+	}
+private:
+	void FillBody(uint8_t* body, uint32_t connection, uint32_t sequence)
+	{
+		memset(body, static_cast<int>(sequence & 0xff), option.messageSize);
+		// sign requests may be pipelined, others are executed one at a time
+		body[0] = static_cast<uint8_t>(sab::SSH2_AGENTC_SIGN_REQUEST);
+		memcpy(body + 1, &connection, sizeof(connection));
+		memcpy(body + 1 + sizeof(connection), &sequence, sizeof(sequence));
+	}
+
+	static bool WriteAll(int fd, const uint8_t* data, size_t length)
+	{
+		while (length > 0)
+		{
+			ssize_t result = send(fd, data, length, MSG_NOSIGNAL);
+			if (result <= 0)
+				return false;
+			data += result;
+			length -= result;
+		}
+		return true;
+	}
+
+	static bool ReadAll(int fd, uint8_t* data, size_t length)
+	{
+		while (length > 0)
+		{
+			ssize_t result = recv(fd, data, length, 0);
+			if (result <= 0)
+				return false;
+			data += result;
+			length -= result;
+		}
+		return true;
+	}
+
+	void ClientProc(int fd, uint32_t connection)
+	{
+		size_t frameSize = sab::HEADER_SIZE + option.messageSize;
+		std::vector<uint8_t> frame(frameSize), expected(frameSize), reply(frameSize);
+		std::vector<Clock::time_point> sendTime(option.requestCount);
+		std::vector<double> latency;
+		latency.reserve(option.requestCount);
+		uint8_t header[sab::HEADER_SIZE] = {
+			static_cast<uint8_t>(option.messageSize >> 24), static_cast<uint8_t>(option.messageSize >> 16),
+			static_cast<uint8_t>(option.messageSize >> 8), static_cast<uint8_t>(option.messageSize) };
+		memcpy(frame.data(), header, sab::HEADER_SIZE);
+		memcpy(expected.data(), header, sab::HEADER_SIZE);
+
+		size_t sent = 0, received = 0;
+		while (received < option.requestCount)
+		{
+			while (sent < option.requestCount && sent - received < option.pipelineDepth)
+			{
+				FillBody(frame.data() + sab::HEADER_SIZE, connection, static_cast<uint32_t>(sent));
+				sendTime[sent] = Clock::now();
+				if (!WriteAll(fd, frame.data(), frame.size()))
+				{
+					++violations;
+					close(fd);
+					return;
+				}
+				if (++sent == option.requestCount)
+					shutdown(fd, SHUT_WR); // the rest is answered after the half-close
+			}
+
+			if (!ReadAll(fd, reply.data(), reply.size()))
+			{
+				++violations;
+				break;
+			}
+			latency.push_back(std::chrono::duration<double, std::micro>(
+				Clock::now() - sendTime[received]).count());
+			FillBody(expected.data() + sab::HEADER_SIZE, connection, static_cast<uint32_t>(received));
+			if (reply != expected)
+				++violations;
+			++received;
+			++completed;
+		}
+
+		// the manager closes after the last reply
+		uint8_t extra;
+		if (received == option.requestCount && recv(fd, &extra, 1, 0) != 0)
+			++violations;
+		close(fd);
+
+		std::lock_guard<std::mutex> lg(latencyMutex);
+		latencyUs.insert(latencyUs.end(), latency.begin(), latency.end());
+	}
+
+	void ReplyThreadProc(size_t index)
+	{
+		std::mt19937 random(static_cast<uint32_t>(index));
+		std::unique_lock<std::mutex> lk(replyMutex);
+		while (true)
+		{
+			replyCondition.wait(lk, [this]()
+				{
+					return replyStop || !replyList.empty();
+				});
+			if (replyList.empty())
+				return;
+			// answer in random order, the manager restores request order
+			size_t pick = std::uniform_int_distribution<size_t>(0, replyList.size() - 1)(random);
+			PendingReply reply = std::move(replyList[pick]);
+			replyList[pick] = std::move(replyList.back());
+			replyList.pop_back();
+			lk.unlock();
+			// echo the request
+			reply.message->replyCallback(reply.message, true);
+			reply.holdKey.reset();
+			lk.lock();
+		}
+	}
+};
+
+static bool ParseCommandLine(int argc, char** argv, BenchOption& option)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		size_t* target = nullptr;
+		if (arg == "-c")
+			target = &option.connectionCount;
+		else if (arg == "-n")
+			target = &option.requestCount;
+		else if (arg == "-d")
+			target = &option.pipelineDepth;
+		else if (arg == "-w")
+			target = &option.workerCount;
+		else if (arg == "-r")
+			target = &option.replyThreadCount;
+		else if (arg == "-s")
+			target = &option.messageSize;
+		else if (arg == "-t")
+			target = &option.traceRecords;
+		else
+			return false;
+		if (i + 1 >= argc)
+			return false;
+		*target = std::strtoul(argv[++i], nullptr, 0);
+	}
+	return option.connectionCount > 0 && option.requestCount > 0 && option.pipelineDepth > 0
+		&& option.workerCount > 0 && option.replyThreadCount > 0
+		&& option.messageSize >= 1 + 2 * sizeof(uint32_t) && option.messageSize <= sab::MAX_MESSAGE_SIZE;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOption option;
+	if (!ParseCommandLine(argc, argv, option))
+	{
+		std::cerr << "Usage: " << argv[0] << " [-c connections] [-n requestsPerConnection] [-d pipelineDepth]"
+			" [-w workers] [-r replyThreads] [-s messageSize] [-t traceRecords]\n";
+		return 1;
+	}
+	sab::Logger::GetInstance().SetLevelOverride(sab::Logger::LogLevel::Error);
+	if (option.traceRecords != 0
+		&& !sab::TraceRing::GetInstance().Open(sab::TraceRing::GetDefaultPath(), option.traceRecords))
+	{
+		return 1;
+	}
+
+	Bench bench(option);
+	auto begin = Clock::now();
+	if (!bench.Run())
+		return 1;
+	double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+	std::cout << "requests: " << bench.completed << ", "
+		<< static_cast<size_t>(bench.completed / seconds) << " req/s, "
+		<< "p50: " << bench.Percentile(0.5) << " us, "
+		<< "p99: " << bench.Percentile(0.99) << " us, "
+		<< "violations: " << bench.violations << ", "
+		<< "leaked contexts: " << bench.leakedContexts << "\n";
+	return bench.violations == 0 && bench.leakedContexts == 0 ? 0 : 2;
+}
@@ -1,5 +1,6 @@
 
 #include "log.h"
+#include "trace.h"
 #include "util.h"
 #include "application.h"
 #include "service_support.h"
@@ -9,9 +10,11 @@
 #include "protocol/unix/listener.h"
 #include "protocol/hyperv/listener.h"
 #include "protocol/cygwin/listener.h"
+#include "protocol/metrics/listener.h"
 #include "protocol/namedpipe/client.h"
 #include "protocol/pageant/client.h"
 #include "lxperm.h"
+#include "metrics.h"
 #include "cmdline_option.h"
 
 #include <cassert>
@@ -121,6 +124,8 @@ bool sab::Application::Initialize(const IniFile& config)
 	}
 
 	bool clientSetFlag = false;
+	size_t traceRecords = TraceRing::DEFAULT_CAPACITY;
+	std::wstring metricsPath;
 	for (const auto& s : config)
 	{
 		const std::wstring& sectionName = s.first;
@@ -146,11 +151,180 @@ bool sab::Application::Initialize(const IniFile& config)
 				Logger::GetInstance().SetLogOutputLevel(logLevel);
 			}
 
+			auto asyncLog = GetPropertyBoolean(section, L"async-log");
+			if (asyncLog.second && asyncLog.first)
+			{
+				Logger::GetInstance().EnableAsyncOutput();
+			}
+
 			auto mangleKeyComment = GetPropertyBoolean(section, L"mangle-key-comment");
 			if(mangleKeyComment.second)
 			{
 				dispatcher->SetKeyCommentMangling(mangleKeyComment.first);
 			}
+
+			auto dispatcherThreads = GetPropertyString(section, L"dispatcher-threads");
+			if (dispatcherThreads.second && !dispatcherThreads.first.empty())
+			{
+				int count = 0;
+				try
+				{
+					count = std::stoi(dispatcherThreads.first, nullptr, 0);
+				}
+				catch (std::exception)
+				{
+					count = 0;
+				}
+				if (count <= 0 || !dispatcher->SetWorkerCount(static_cast<size_t>(count)))
+				{
+					LogError(L"invalid dispatcher-threads, expect 1 to ", MessageDispatcher::MAX_WORKER_COUNT);
+					return false;
+				}
+			}
+
+			auto proxyThreads = GetPropertyString(section, L"proxy-threads");
+			if (proxyThreads.second && !proxyThreads.first.empty())
+			{
+				int count = 0;
+				try
+				{
+					count = std::stoi(proxyThreads.first, nullptr, 0);
+				}
+				catch (std::exception)
+				{
+					count = 0;
+				}
+				if (count <= 0 || !connectionManager->SetWorkerCount(static_cast<size_t>(count)))
+				{
+					LogError(L"invalid proxy-threads, expect 1 to ", CompletionWorkerPool::MAX_WORKER_COUNT);
+					return false;
+				}
+			}
+
+			auto queueSize = GetPropertyString(section, L"dispatcher-queue-size");
+			if (queueSize.second && !queueSize.first.empty())
+			{
+				int capacity = 0;
+				try
+				{
+					capacity = std::stoi(queueSize.first, nullptr, 0);
+				}
+				catch (std::exception)
+				{
+					capacity = 0;
+				}
+				if (capacity <= 0 || !dispatcher->SetQueueCapacity(static_cast<size_t>(capacity)))
+				{
+					LogError(L"invalid dispatcher-queue-size!");
+					return false;
+				}
+			}
+
+			auto upstreamTimeout = GetPropertyString(section, L"upstream-timeout");
+			if (upstreamTimeout.second && !upstreamTimeout.first.empty())
+			{
+				int timeout = 0;
+				try
+				{
+					timeout = std::stoi(upstreamTimeout.first, nullptr, 0);
+				}
+				catch (std::exception)
+				{
+					timeout = 0;
+				}
+				if (!dispatcher->SetUpstreamTimeout(std::chrono::milliseconds(timeout)))
+				{
+					LogError(L"invalid upstream-timeout!");
+					return false;
+				}
+			}
+
+			auto idleTimeout = GetPropertyString(section, L"idle-timeout");
+			if (idleTimeout.second && !idleTimeout.first.empty())
+			{
+				int timeout = -1;
+				try
+				{
+					timeout = std::stoi(idleTimeout.first, nullptr, 0);
+				}
+				catch (std::exception)
+				{
+					timeout = -1;
+				}
+				if (timeout < 0)
+				{
+					LogError(L"invalid idle-timeout!");
+					return false;
+				}
+				connectionManager->SetIdleTimeout(std::chrono::milliseconds(timeout));
+			}
+
+			// forwarded bytes are opaque, a pinentry wait looks the same as an
+			// abandoned connection, so gpg forwarding has its own timeout
+			auto forwardIdleTimeout = GetPropertyString(section, L"forward-idle-timeout");
+			if (forwardIdleTimeout.second && !forwardIdleTimeout.first.empty())
+			{
+				int timeout = -1;
+				try
+				{
+					timeout = std::stoi(forwardIdleTimeout.first, nullptr, 0);
+				}
+				catch (std::exception)
+				{
+					timeout = -1;
+				}
+				if (timeout < 0)
+				{
+					LogError(L"invalid forward-idle-timeout!");
+					return false;
+				}
+				gpgConnectionManager->SetIdleTimeout(std::chrono::milliseconds(timeout));
+			}
+
+			auto cacheTtl = GetPropertyString(section, L"identities-cache-ttl");
+			if (cacheTtl.second && !cacheTtl.first.empty())
+			{
+				int ttl = -1;
+				try
+				{
+					ttl = std::stoi(cacheTtl.first, nullptr, 0);
+				}
+				catch (std::exception)
+				{
+					ttl = -1;
+				}
+				if (!dispatcher->SetIdentitiesCacheTtl(std::chrono::milliseconds(ttl)))
+				{
+					LogError(L"invalid identities-cache-ttl!");
+					return false;
+				}
+			}
+
+			auto traceRecordsStr = GetPropertyString(section, L"trace-records");
+			if (traceRecordsStr.second && !traceRecordsStr.first.empty())
+			{
+				int count = -1;
+				try
+				{
+					count = std::stoi(traceRecordsStr.first, nullptr, 0);
+				}
+				catch (std::exception)
+				{
+					count = -1;
+				}
+				if (count < 0 || static_cast<size_t>(count) > TraceRing::MAX_CAPACITY)
+				{
+					LogError(L"invalid trace-records, expect 0 to ", TraceRing::MAX_CAPACITY);
+					return false;
+				}
+				traceRecords = static_cast<size_t>(count);
+			}
+
+			auto metricsPathStr = GetPropertyString(section, L"metrics-path");
+			if (metricsPathStr.second)
+			{
+				metricsPath = ReplaceEnvironmentVariables(metricsPathStr.first);
+			}
 		}
 		else
 		{
@@ -179,12 +353,14 @@ bool sab::Application::Initialize(const IniFile& config)
 						// check gpg forward
 						auto targetPath = GetPropertyString(section, L"forward-socket-path");
 						std::shared_ptr<ProtocolListenerBase> ptr;
+						std::shared_ptr<IConnectionManager> manager;
 						if (targetPath.second)
 						{
 							bool forwardEnabled = std::find(forwardEnabledList.begin(), forwardEnabledList.end(), type.first) != forwardEnabledList.end();
 							if (forwardEnabled) {
 								LogDebug(L"Setup for gpg forwarding.");
 								ptr = actionList[i].createListener(section, gpgConnectionManager, dispatcher);
+								manager = gpgConnectionManager;
 								auto targetPathEx = ReplaceEnvironmentVariables(targetPath.first);
 								if (ptr) {
 									gpgConnectionManager->SetTarget(ptr, targetPathEx);
@@ -201,12 +377,32 @@ bool sab::Application::Initialize(const IniFile& config)
 						else {
 							LogDebug(L"Setup for ssh agent proxy.");
 							ptr = actionList[i].createListener(section, connectionManager, dispatcher);
+							manager = connectionManager;
 						}
 						if (ptr == nullptr)
 						{
 							LogError(L"cannot create listener, check your config!");
 							return false;
 						}
+						auto maxConnections = GetPropertyString(section, L"max-connections");
+						if (maxConnections.second && !maxConnections.first.empty())
+						{
+							int limit = -1;
+							try
+							{
+								limit = std::stoi(maxConnections.first, nullptr, 0);
+							}
+							catch (std::exception)
+							{
+								limit = -1;
+							}
+							if (limit < 0)
+							{
+								LogError(L"invalid max-connections in section \"", sectionName, L"\"!");
+								return false;
+							}
+							manager->SetConnectionLimit(ptr, static_cast<size_t>(limit));
+						}
 						listeners.emplace_back(std::move(ptr));
 					}
 					else if (role.first == L"client")
@@ -246,9 +442,37 @@ bool sab::Application::Initialize(const IniFile& config)
 		return false;
 	}
 
+	// the trace is a diagnostic aid, run without it if the file cannot be made
+	if (traceRecords != 0 && !TraceRing::GetInstance().Open(TraceRing::GetDefaultPath(), traceRecords))
+	{
+		LogWarning(L"connection tracing is disabled");
+	}
+
+	if (!metricsPath.empty())
+	{
+		listeners.emplace_back(std::make_shared<MetricsListener>(metricsPath, [this]()
+			{
+				return CollectMetrics();
+			}));
+	}
+
 	return true;
 }
 
+std::string sab::Application::CollectMetrics()
+{
+	MetricsWriter writer;
+	WriteDispatcherMetrics(writer, *dispatcher);
+	writer.Declare("sab_active_connections", "gauge", "Connections held by a connection manager.");
+	writer.Write("sab_active_connections", { { "manager", "proxy" } },
+		static_cast<uint64_t>(connectionManager->GetActiveCount()));
+	writer.Write("sab_active_connections", { { "manager", "gpg_forward" } },
+		static_cast<uint64_t>(gpgConnectionManager->GetActiveCount()));
+	writer.Declare("sab_gpg_forward_bytes_total", "counter", "Bytes forwarded between gpg clients and gpg-agent.");
+	writer.Write("sab_gpg_forward_bytes_total", {}, gpgConnectionManager->GetForwardedBytes());
+	return writer.Text();
+}
+
 int sab::Application::Run()
 {
 	int exitCode = 0;
@@ -295,6 +519,7 @@ int sab::Application::Run()
 	ServiceSupport::GetInstance().ReportStatus(SERVICE_STOP_PENDING, exitCode, 3000);
 
 	dispatcher->Stop();
+	dispatcher->LogLatencyStatistics();
 	for (auto& l : listeners)
 	{
 		l->Cancel();
@@ -306,6 +531,8 @@ int sab::Application::Run()
 	}
 	connectionManager->Stop();
 	gpgConnectionManager->Stop();
+	// abandoned fan-out threads may log after this, they write directly
+	Logger::GetInstance().StopAsyncOutput();
 	return exitCode;
 }
 
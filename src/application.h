@@ -39,6 +39,11 @@ namespace sab
 	private:
 		Application();
 
+		/// <summary>
+		/// runtime statistics in Prometheus text format
+		/// </summary>
+		std::string CollectMetrics();
+
 		bool Initialize(const IniFile& config);
 
 		static void __stdcall ServiceControlHandler(DWORD dwControl);
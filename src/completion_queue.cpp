@@ -0,0 +1,61 @@
+#include "log.h"
+#include "completion_queue.h"
+
+sab::CompletionWorkerPool::CompletionWorkerPool()
+	:queue(nullptr)
+{
+}
+
+bool sab::CompletionWorkerPool::Start(ICompletionQueue* queue, size_t threadCount, Handler handler)
+{
+	if (queue == nullptr || threadCount == 0 || threadCount > MAX_WORKER_COUNT)
+		return false;
+	this->queue = queue;
+	this->handler = std::move(handler);
+	try
+	{
+		for (size_t i = 0; i < threadCount; ++i)
+		{
+			threads.emplace_back([this]()
+				{
+					ThreadProc();
+				});
+		}
+	}
+	catch (...)
+	{
+		Stop();
+		return false;
+	}
+	return true;
+}
+
+void sab::CompletionWorkerPool::Stop()
+{
+	if (queue)
+		queue->Close();
+	for (auto& t : threads)
+	{
+		if (t.joinable())
+			t.join();
+	}
+	threads.clear();
+	queue = nullptr;
+}
+
+sab::CompletionWorkerPool::~CompletionWorkerPool()
+{
+	Stop();
+}
+
+void sab::CompletionWorkerPool::ThreadProc()
+{
+	CompletionPacket packet;
+
+	LogDebug(L"started completion worker");
+	while (queue->Dequeue(&packet))
+	{
+		handler(packet);
+	}
+	LogDebug(L"completion queue closed.");
+}
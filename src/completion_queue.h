@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace sab
+{
+	/// <summary>
+	/// Result of a dequeued i/o operation
+	/// </summary>
+	enum class CompletionStatus
+	{
+		Success = 0,
+		// operation cancelled, the context may be gone already
+		Aborted,
+		// remote closed the connection
+		Disconnected,
+		// any other failure
+		Failed,
+	};
+
+	struct CompletionPacket
+	{
+		/// <summary>
+		/// completion key, the IoContext the operation belongs to
+		/// </summary>
+		uintptr_t key;
+
+		/// <summary>
+		/// the OVERLAPPED (or equivalent) of the operation
+		/// </summary>
+		void* overlapped;
+
+		uint32_t transferred;
+
+		CompletionStatus status;
+	};
+
+	/// <summary>
+	/// A queue of finished i/o operations, shared by several worker threads
+	/// </summary>
+	class ICompletionQueue
+	{
+	public:
+		virtual ~ICompletionQueue() = default;
+
+		/// <summary>
+		/// block until an operation finishes
+		/// </summary>
+		/// <param name="packet">receives the completion</param>
+		/// <returns>false if the queue is closed, the caller should exit</returns>
+		virtual bool Dequeue(CompletionPacket* packet) = 0;
+
+		/// <summary>
+		/// wake all blocked Dequeue calls and make further ones fail
+		/// </summary>
+		virtual void Close() = 0;
+	};
+
+	/// <summary>
+	/// Threads draining one completion queue
+	/// </summary>
+	class CompletionWorkerPool
+	{
+	public:
+		using Handler = std::function<void(const CompletionPacket&)>;
+
+		static constexpr size_t MAX_WORKER_COUNT = 64;
+	private:
+		ICompletionQueue* queue;
+
+		Handler handler;
+
+		std::vector<std::thread> threads;
+	public:
+		CompletionWorkerPool();
+
+		CompletionWorkerPool(const CompletionWorkerPool&) = delete;
+		CompletionWorkerPool& operator=(const CompletionWorkerPool&) = delete;
+
+		/// <summary>
+		/// start workers, each calls handler for every dequeued packet
+		/// </summary>
+		/// <returns>true for success</returns>
+		bool Start(ICompletionQueue* queue, size_t threadCount, Handler handler);
+
+		/// <summary>
+		/// close the queue and join all workers
+		/// </summary>
+		void Stop();
+
+		~CompletionWorkerPool();
+	private:
+		void ThreadProc();
+	};
+}
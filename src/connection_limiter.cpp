@@ -0,0 +1,68 @@
+#include "log.h"
+#include "connection_limiter.h"
+
+sab::ConnectionLimiter::ConnectionLimiter()
+	:cancelFlag(false)
+{
+}
+
+void sab::ConnectionLimiter::SetLimit(const void* listener, size_t limit)
+{
+	std::lock_guard<std::mutex> lg(entryMutex);
+	entries[listener].limit = limit;
+	releaseCondition.notify_all();
+}
+
+bool sab::ConnectionLimiter::Acquire(const void* listener, const std::function<bool()>& isCancelled)
+{
+	static constexpr auto POLL_INTERVAL = std::chrono::milliseconds(100);
+
+	std::unique_lock<std::mutex> lk(entryMutex);
+	Entry& entry = entries[listener];
+	if (entry.limit == 0 || entry.active < entry.limit)
+	{
+		++entry.active;
+		return true;
+	}
+
+	LogWarning(L"listener ", listener, L" reached ", entry.limit, L" connections, waiting for a free slot");
+	auto deadline = std::chrono::steady_clock::now() + MAX_ACQUIRE_WAIT;
+	while (entry.limit != 0 && entry.active >= entry.limit)
+	{
+		if (cancelFlag || (isCancelled && isCancelled()))
+			return false;
+		if (std::chrono::steady_clock::now() >= deadline)
+		{
+			LogWarning(L"listener ", listener, L" has no free slot, rejecting connection");
+			return false;
+		}
+		releaseCondition.wait_for(lk, POLL_INTERVAL);
+	}
+	++entry.active;
+	return true;
+}
+
+void sab::ConnectionLimiter::Release(const void* listener)
+{
+	std::lock_guard<std::mutex> lg(entryMutex);
+	auto iter = entries.find(listener);
+	if (iter != entries.end() && iter->second.active > 0)
+	{
+		--iter->second.active;
+		releaseCondition.notify_all();
+	}
+}
+
+void sab::ConnectionLimiter::Cancel()
+{
+	std::lock_guard<std::mutex> lg(entryMutex);
+	cancelFlag = true;
+	releaseCondition.notify_all();
+}
+
+size_t sab::ConnectionLimiter::GetActiveCount(const void* listener)
+{
+	std::lock_guard<std::mutex> lg(entryMutex);
+	auto iter = entries.find(listener);
+	return iter == entries.end() ? 0 : iter->second.active;
+}
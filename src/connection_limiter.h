@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+namespace sab
+{
+	/// <summary>
+	/// Counts active connections per listener and makes the accepting
+	/// thread wait while its listener is at the limit, so new clients
+	/// stay in the listen backlog instead of consuming resources.
+	/// </summary>
+	class ConnectionLimiter
+	{
+	public:
+		/// <summary>
+		/// max time an accepted connection waits for a free slot
+		/// </summary>
+		static constexpr std::chrono::milliseconds MAX_ACQUIRE_WAIT = std::chrono::seconds(10);
+	private:
+		struct Entry
+		{
+			// 0 for unlimited
+			size_t limit = 0;
+			size_t active = 0;
+		};
+
+		std::unordered_map<const void*, Entry> entries;
+
+		std::mutex entryMutex;
+		std::condition_variable releaseCondition;
+
+		bool cancelFlag;
+	public:
+		ConnectionLimiter();
+
+		ConnectionLimiter(const ConnectionLimiter&) = delete;
+		ConnectionLimiter& operator=(const ConnectionLimiter&) = delete;
+
+		/// <summary>
+		/// set max concurrent connections of a listener
+		/// </summary>
+		/// <param name="listener">listener identity</param>
+		/// <param name="limit">0 for unlimited</param>
+		void SetLimit(const void* listener, size_t limit);
+
+		/// <summary>
+		/// take a slot, wait for one if the listener is at the limit
+		/// </summary>
+		/// <param name="listener">listener identity</param>
+		/// <param name="isCancelled">polled while waiting, stop waiting if returns true</param>
+		/// <returns>false if no slot was free in MAX_ACQUIRE_WAIT or waiting is cancelled</returns>
+		bool Acquire(const void* listener, const std::function<bool()>& isCancelled);
+
+		/// <summary>
+		/// return a slot taken by Acquire
+		/// </summary>
+		void Release(const void* listener);
+
+		/// <summary>
+		/// fail all current and future waits
+		/// </summary>
+		void Cancel();
+
+		size_t GetActiveCount(const void* listener);
+	};
+}
@@ -0,0 +1,69 @@
+#include "encoding.h"
+
+#include <cstdint>
+
+static constexpr uint32_t REPLACEMENT_CHARACTER = 0xFFFD;
+
+static void AppendUtf8(std::string& out, uint32_t codePoint)
+{
+	if (codePoint < 0x80)
+	{
+		out.push_back(static_cast<char>(codePoint));
+	}
+	else if (codePoint < 0x800)
+	{
+		out.push_back(static_cast<char>(0xC0 | (codePoint >> 6)));
+		out.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+	}
+	else if (codePoint < 0x10000)
+	{
+		out.push_back(static_cast<char>(0xE0 | (codePoint >> 12)));
+		out.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+	}
+	else
+	{
+		out.push_back(static_cast<char>(0xF0 | (codePoint >> 18)));
+		out.push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+	}
+}
+
+std::string sab::WideStringToUtf8String(const std::wstring& str)
+{
+	std::string ret;
+	ret.reserve(str.size());
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		uint32_t codePoint = static_cast<uint32_t>(str[i]);
+		if (sizeof(wchar_t) == 2)
+		{
+			codePoint &= 0xFFFF;
+			if (codePoint >= 0xD800 && codePoint <= 0xDBFF)
+			{
+				// high surrogate, must be followed by a low surrogate
+				uint32_t low = i + 1 < str.size() ? (static_cast<uint32_t>(str[i + 1]) & 0xFFFF) : 0;
+				if (low >= 0xDC00 && low <= 0xDFFF)
+				{
+					codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+					++i;
+				}
+				else
+				{
+					codePoint = REPLACEMENT_CHARACTER;
+				}
+			}
+			else if (codePoint >= 0xDC00 && codePoint <= 0xDFFF)
+			{
+				codePoint = REPLACEMENT_CHARACTER;
+			}
+		}
+		else if (codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF))
+		{
+			codePoint = REPLACEMENT_CHARACTER;
+		}
+		AppendUtf8(ret, codePoint);
+	}
+	return ret;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+namespace sab
+{
+	/// <summary>
+	/// Convert a wide string to UTF-8.
+	/// wchar_t is treated as UTF-16 on Windows and UTF-32 elsewhere,
+	/// invalid code units are replaced with U+FFFD.
+	/// </summary>
+	/// <param name="str">the wide string</param>
+	/// <returns>UTF-8 encoded string</returns>
+	std::string WideStringToUtf8String(const std::wstring& str);
+}
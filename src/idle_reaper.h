@@ -0,0 +1,156 @@
+#pragma once
+
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace sab
+{
+	/// <summary>
+	/// Watches objects for inactivity on a timer wheel.
+	/// An object is checked when LastActivity() + timeout has passed,
+	/// the callback decides to close it or Watch it again, so recording
+	/// activity costs only a timestamp update on the object.
+	/// </summary>
+	/// <typeparam name="T">
+	/// object type, provides std::chrono::steady_clock::time_point LastActivity()const
+	/// </typeparam>
+	template<typename T>
+	class IdleReaper
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+		using Callback = std::function<void(std::shared_ptr<T>)>;
+
+		static constexpr size_t SLOT_COUNT = 64;
+		static constexpr Clock::duration MIN_TICK = std::chrono::milliseconds(100);
+	private:
+		Clock::duration timeout;
+
+		std::optional<TimerWheel<std::weak_ptr<T>>> wheel;
+
+		Callback callback;
+
+		std::mutex wheelMutex;
+		std::condition_variable wakeCondition;
+		bool stopFlag;
+
+		std::thread timerThread;
+	public:
+		IdleReaper()
+			:timeout(Clock::duration::zero()), stopFlag(false) {}
+
+		IdleReaper(const IdleReaper&) = delete;
+		IdleReaper& operator=(const IdleReaper&) = delete;
+
+		~IdleReaper()
+		{
+			Stop();
+		}
+
+		/// <summary>
+		/// set idle timeout, zero disables the reaper. Call before Start.
+		/// </summary>
+		void SetTimeout(Clock::duration idleTimeout)
+		{
+			timeout = idleTimeout;
+		}
+
+		Clock::duration GetTimeout()const { return timeout; }
+
+		bool Enabled()const { return timeout > Clock::duration::zero(); }
+
+		/// <summary>
+		/// start the timer thread if enabled
+		/// </summary>
+		/// <param name="expired">called on the timer thread for objects due for a check</param>
+		/// <returns>true for success</returns>
+		bool Start(Callback expired)
+		{
+			if (!Enabled())
+				return true;
+			callback = std::move(expired);
+			wheel.emplace(std::max<Clock::duration>(timeout / 16, MIN_TICK), SLOT_COUNT);
+			stopFlag = false;
+			try
+			{
+				timerThread = std::thread([this]()
+					{
+						ThreadProc();
+					});
+			}
+			catch (...)
+			{
+				return false;
+			}
+			return true;
+		}
+
+		void Stop()
+		{
+			{
+				std::lock_guard<std::mutex> lg(wheelMutex);
+				stopFlag = true;
+				wakeCondition.notify_all();
+			}
+			if (timerThread.joinable())
+				timerThread.join();
+		}
+
+		/// <summary>
+		/// check the object once it has been idle for the timeout
+		/// </summary>
+		void Watch(const std::shared_ptr<T>& object)
+		{
+			if (!Enabled())
+				return;
+			std::lock_guard<std::mutex> lg(wheelMutex);
+			if (wheel)
+				wheel->Schedule(object, object->LastActivity() + timeout);
+		}
+
+		/// <summary>
+		/// check if the object has been idle for the timeout
+		/// </summary>
+		bool IsIdle(const T& object, Clock::time_point now = Clock::now())const
+		{
+			return Enabled() && now - object.LastActivity() >= timeout;
+		}
+	private:
+		void ThreadProc()
+		{
+			std::vector<std::shared_ptr<T>> due;
+			std::unique_lock<std::mutex> lk(wheelMutex);
+			while (!stopFlag)
+			{
+				wakeCondition.wait_for(lk, wheel->Tick());
+				if (stopFlag)
+					break;
+				wheel->Advance(Clock::now(), [&](std::weak_ptr<T>&& weakObject)
+					{
+						auto object = weakObject.lock();
+						if (object)
+							due.emplace_back(std::move(object));
+					});
+				if (due.empty())
+					continue;
+				// callbacks may Watch again
+				lk.unlock();
+				for (auto& object : due)
+				{
+					callback(object);
+				}
+				due.clear();
+				lk.lock();
+			}
+		}
+	};
+}
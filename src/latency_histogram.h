@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace sab
+{
+	/// <summary>
+	/// Lock-free latency histogram with log-linear buckets in microseconds,
+	/// like HdrHistogram: every power of two range is split into
+	/// SUB_BUCKET_COUNT buckets, so a reported value is within 1/16 of the
+	/// recorded one. Recording is a few relaxed atomic adds.
+	/// </summary>
+	class LatencyHistogram
+	{
+	public:
+		static constexpr unsigned SUB_BUCKET_BITS = 4;
+		static constexpr uint64_t SUB_BUCKET_COUNT = uint64_t(1) << SUB_BUCKET_BITS;
+		/// <summary>
+		/// values from 2^36 us (19 hours) on land in the last bucket
+		/// </summary>
+		static constexpr unsigned MAX_VALUE_BITS = 36;
+		static constexpr uint64_t MAX_VALUE = (uint64_t(1) << MAX_VALUE_BITS) - 1;
+		static constexpr size_t BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+		/// <summary>
+		/// copy of the counters taken at one point
+		/// </summary>
+		struct Snapshot
+		{
+			uint64_t count = 0;
+			uint64_t sumUs = 0;
+			uint64_t maxUs = 0;
+			std::array<uint64_t, BUCKET_COUNT> buckets{};
+
+			/// <summary>
+			/// the value p of the recorded values are below or equal to
+			/// </summary>
+			/// <param name="p">quantile, 0 to 1</param>
+			/// <returns>0 if nothing was recorded</returns>
+			std::chrono::microseconds Percentile(double p)const
+			{
+				if (count == 0)
+					return std::chrono::microseconds(0);
+				auto rank = static_cast<uint64_t>(p * count + 0.5);
+				rank = std::min(std::max(rank, uint64_t(1)), count);
+				uint64_t seen = 0;
+				for (size_t i = 0; i < BUCKET_COUNT; ++i)
+				{
+					seen += buckets[i];
+					if (seen >= rank)
+						return std::chrono::microseconds(std::min(HighestInBucket(i), maxUs));
+				}
+				return std::chrono::microseconds(maxUs);
+			}
+
+			std::chrono::microseconds Mean()const
+			{
+				return std::chrono::microseconds(count == 0 ? 0 : sumUs / count);
+			}
+		};
+	private:
+		std::array<std::atomic<uint64_t>, BUCKET_COUNT> buckets{};
+		std::atomic<uint64_t> sumUs{ 0 };
+		std::atomic<uint64_t> maxUs{ 0 };
+
+		static unsigned HighestBit(uint64_t value)
+		{
+#if defined(_MSC_VER) && defined(_WIN64)
+			unsigned long index;
+			_BitScanReverse64(&index, value);
+			return static_cast<unsigned>(index);
+#elif defined(_MSC_VER)
+			unsigned long index;
+			if (_BitScanReverse(&index, static_cast<unsigned long>(value >> 32)))
+				return static_cast<unsigned>(index) + 32;
+			_BitScanReverse(&index, static_cast<unsigned long>(value));
+			return static_cast<unsigned>(index);
+#else
+			return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+		}
+
+		static size_t BucketIndex(uint64_t value)
+		{
+			if (value < SUB_BUCKET_COUNT)
+				return static_cast<size_t>(value);
+			unsigned shift = HighestBit(value) - SUB_BUCKET_BITS;
+			return static_cast<size_t>((shift + 1) * SUB_BUCKET_COUNT
+				+ (value >> shift) - SUB_BUCKET_COUNT);
+		}
+
+		static uint64_t HighestInBucket(size_t index)
+		{
+			if (index < 2 * SUB_BUCKET_COUNT)
+				return index;
+			unsigned shift = static_cast<unsigned>(index / SUB_BUCKET_COUNT) - 1;
+			uint64_t lowest = (index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT) << shift;
+			return lowest + (uint64_t(1) << shift) - 1;
+		}
+	public:
+		LatencyHistogram() = default;
+		LatencyHistogram(const LatencyHistogram&) = delete;
+		LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+		/// <summary>
+		/// called by any thread
+		/// </summary>
+		template<typename Rep, typename Period>
+		void Record(std::chrono::duration<Rep, Period> duration)noexcept
+		{
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+			uint64_t value = std::min(static_cast<uint64_t>(std::max<decltype(us)>(us, 0)), MAX_VALUE);
+			buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+			sumUs.fetch_add(value, std::memory_order_relaxed);
+			uint64_t max = maxUs.load(std::memory_order_relaxed);
+			while (value > max && !maxUs.compare_exchange_weak(max, value, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		/// <summary>
+		/// copy the counters, records made meanwhile may be partly included
+		/// </summary>
+		Snapshot Read()const
+		{
+			Snapshot snapshot;
+			for (size_t i = 0; i < BUCKET_COUNT; ++i)
+			{
+				snapshot.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+				snapshot.count += snapshot.buckets[i];
+			}
+			snapshot.sumUs = sumUs.load(std::memory_order_relaxed);
+			snapshot.maxUs = maxUs.load(std::memory_order_relaxed);
+			return snapshot;
+		}
+	};
+}
@@ -1,15 +1,21 @@
 #include "log.h"
-#include "util.h"
+#include "mpsc_ring.h"
 
 #include <ctime>
+#include <cstdlib>
 #include <iomanip>
 #include <thread>
+#include <codecvt>
+#include <condition_variable>
+
+#ifdef _WIN32
+#include "util.h"
 
 #define WIN32_LEAN_AND_MEAN
-#include <codecvt>
 #include <Windows.h>
 #include <io.h>
 #include <fcntl.h>
+#endif
 
 static const wchar_t* TranslateLogLevel(sab::Logger::LogLevel level)noexcept
 {
@@ -27,6 +33,166 @@ static const wchar_t* TranslateLogLevel(sab::Logger::LogLevel level)noexcept
 	return L""; // shut compiler up
 }
 
+/// <summary>
+/// What the logging thread captures, the rest of the line is formatted
+/// by whoever writes it out
+/// </summary>
+struct LogRecord
+{
+	std::time_t time = 0;
+	std::thread::id threadId;
+	sab::Logger::LogLevel level = sab::Logger::LogLevel::Invalid;
+	const wchar_t* file = nullptr;
+	int line = 0;
+	std::wstring message;
+};
+
+static std::wstring FormatTime(std::time_t time)
+{
+	std::tm tm;
+#ifdef _WIN32
+	localtime_s(&tm, &time);
+#else
+	localtime_r(&time, &tm);
+#endif
+	std::wostringstream oss;
+	oss << std::put_time(&tm, L"%F %T");
+	return oss.str();
+}
+
+static void FormatRecord(std::wostringstream& oss, const LogRecord& record,
+	const std::wstring& timeString)
+{
+	oss << L'[' << timeString;
+	oss << L"][" << record.threadId;
+	oss << L"][" << TranslateLogLevel(record.level) << L"] ";
+	oss << record.file << L':' << record.line;
+	oss << L": " << record.message << L'\n';
+}
+
+/// <summary>
+/// Background thread draining records pushed by any number of threads.
+/// A full queue makes producers wait for room, so records are neither
+/// lost nor reordered when logging outpaces the sinks. Stopped writers are
+/// never freed, a producer that loaded the pointer just before the stop
+/// finds it stopped and writes the record itself.
+/// </summary>
+class sab::Logger::AsyncWriter
+{
+public:
+	static constexpr size_t QUEUE_CAPACITY = 4096;
+	// records formatted into one write to the sinks
+	static constexpr size_t MAX_BATCH_RECORDS = 256;
+	// only a safety net, producers wake the thread when it sleeps
+	static constexpr std::chrono::seconds MAX_SLEEP{ 1 };
+private:
+	Logger& logger;
+	MpscRing<LogRecord> queue;
+	std::atomic<bool> sleeping{ false };
+	// producers inside Push, Stop waits for them before the last drain
+	std::atomic<size_t> pushing{ 0 };
+	std::atomic<bool> stopped{ false };
+	bool stopFlag = false;
+	std::mutex wakeMutex;
+	std::condition_variable wakeCondition;
+	std::thread thread;
+public:
+	explicit AsyncWriter(Logger& logger)
+		:logger(logger), queue(QUEUE_CAPACITY)
+	{
+		thread = std::thread([this]() { Run(); });
+	}
+
+	/// <summary>
+	/// write everything pushed so far and end the thread, later pushes fail
+	/// </summary>
+	void Stop()
+	{
+		stopped.store(true);
+		// the thread keeps draining, so producers blocked on a full queue finish
+		while (pushing.load() != 0)
+			std::this_thread::yield();
+		{
+			std::lock_guard<std::mutex> lg(wakeMutex);
+			stopFlag = true;
+		}
+		wakeCondition.notify_one();
+		thread.join();
+	}
+
+	/// <returns>false if stopped, the record is left untouched</returns>
+	bool Push(LogRecord&& record)noexcept
+	{
+		// pairs with Stop, either it waits for this push or this sees the stop
+		pushing.fetch_add(1);
+		if (stopped.load())
+		{
+			pushing.fetch_sub(1);
+			return false;
+		}
+		// the record is only moved from once a slot is claimed
+		while (!queue.TryPush(std::move(record)))
+		{
+			Wake();
+			std::this_thread::yield();
+		}
+		Wake();
+		pushing.fetch_sub(1);
+		return true;
+	}
+private:
+	void Wake()noexcept
+	{
+		// pairs with the fence in Run, either the writer sees the record
+		// before sleeping or this thread sees it sleeping
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false))
+		{
+			std::lock_guard<std::mutex> lg(wakeMutex);
+			wakeCondition.notify_one();
+		}
+	}
+
+	void Run()
+	{
+		std::wostringstream oss;
+		LogRecord record;
+		// records mostly share the second they were made in
+		std::time_t cachedTime = 0;
+		std::wstring cachedTimeString;
+		while (true)
+		{
+			size_t count = 0;
+			while (count < MAX_BATCH_RECORDS && queue.TryPop(record))
+			{
+				if (cachedTimeString.empty() || record.time != cachedTime)
+				{
+					cachedTime = record.time;
+					cachedTimeString = FormatTime(record.time);
+				}
+				FormatRecord(oss, record, cachedTimeString);
+				++count;
+			}
+			if (count != 0)
+			{
+				logger.WriteToSinks(oss.str());
+				oss.str(std::wstring());
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lk(wakeMutex);
+			if (stopFlag)
+				break;
+			sleeping.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (queue.Empty())
+				wakeCondition.wait_for(lk, MAX_SLEEP);
+			sleeping.store(false);
+		}
+	}
+};
+
+#ifdef _WIN32
 static FILE* OpenHandleToFILE(HANDLE handle, const wchar_t* mode)noexcept
 {
 	HANDLE handle2;
@@ -124,32 +290,77 @@ void sab::Logger::FreeFileLog()
 {
 	return fileStream.close();
 }
+#else
+bool sab::Logger::PrepareConsole()
+{
+	// the process always has a console on POSIX, use stderr as log output
+	stdinStream = stdin;
+	stdoutStream = stderr;
+	stderrStream = stderr;
+	return true;
+}
 
+void sab::Logger::FreeConsole()
+{
+	// standard streams are not owned by the logger
+}
+
+bool sab::Logger::PrepareFileLog()
+{
+	const char* home = std::getenv("HOME");
+	if (home == nullptr)
+		return false;
+	std::string path = std::string(home) + "/.ssh-agent-bridge.log";
+	fileStream.imbue(std::locale(std::locale::classic(), new std::codecvt_utf8<wchar_t>));
+	fileStream.open(path, std::ios::app);
+	if (!fileStream.is_open())
+		return false;
+	fileStream.rdbuf()->pubsetbuf(nullptr, 0);
+	fileStream << L"=== NEW LOG SESSION ===\n";
+	return true;
+}
+
+void sab::Logger::FreeFileLog()
+{
+	return fileStream.close();
+}
+#endif
 
 void sab::Logger::WriteLogImpl(LogLevel level, const wchar_t* file, int line,
-	const std::wstring& str)noexcept
+	std::wstring&& str)noexcept
 {
-	std::time_t curTime = std::time(nullptr);
-	std::tm tm;
-	localtime_s(&tm, &curTime);
+	LogRecord record;
+	record.time = std::time(nullptr);
+	record.threadId = std::this_thread::get_id();
+	record.level = level;
+	record.file = file;
+	record.line = line;
+	record.message = std::move(str);
+
+	auto writer = asyncWriter.load(std::memory_order_acquire);
+	if (writer != nullptr && writer->Push(std::move(record)))
+		return;
+
 	std::wostringstream oss;
-	oss << L'[' << std::put_time(&tm, L"%F %T");
-	oss << L"][" << std::this_thread::get_id();
-	oss << L"][" << TranslateLogLevel(level) << L"] ";
-	oss << file << L':' << line;
-	oss << L": " << str << L'\n';
-	auto logStr = oss.str();
+	FormatRecord(oss, record, FormatTime(record.time));
+	WriteToSinks(oss.str());
+}
+
+void sab::Logger::WriteToSinks(const std::wstring& text)noexcept
+{
 	std::lock_guard<std::mutex> lg(ioMutex);
 	if (allocatedConsole)
 	{
-		std::fwprintf(stdoutStream, L"%s", logStr.c_str());
+		std::fwprintf(stdoutStream, L"%ls", text.c_str());
 	}
+#ifdef _WIN32
 	if (debugOutput) {
-		OutputDebugStringW(logStr.c_str());
+		OutputDebugStringW(text.c_str());
 	}
+#endif
 	if (fileStream.is_open())
 	{
-		fileStream << logStr;
+		fileStream << text;
 	}
 }
 
@@ -159,6 +370,16 @@ void sab::Logger::SetLogOutputLevel(LogLevel level)
 		return;
 	outputLevel = level;
 	LogInfo(L"set log level: ", TranslateLogLevel(level));
+	WarnLevelNotCompiled(level);
+}
+
+void sab::Logger::WarnLevelNotCompiled(LogLevel level)
+{
+	if (level < MIN_COMPILED_LEVEL)
+	{
+		LogWarning(L"this build has no log messages below ",
+			TranslateLogLevel(MIN_COMPILED_LEVEL), L" level");
+	}
 }
 
 sab::Logger& sab::Logger::GetInstance()noexcept
@@ -169,13 +390,20 @@ sab::Logger& sab::Logger::GetInstance()noexcept
 
 sab::Logger::Logger()noexcept
 	:stdinStream(nullptr), stdoutStream(nullptr), stderrStream(nullptr),
+	allocatedConsole(false),
 	outputLevel(LogLevel::Info), overrideLevel(LogLevel::Invalid)
 {
+#ifdef _WIN32
 	std::setlocale(LC_ALL, ".utf8");
+#else
+	std::setlocale(LC_ALL, "");
+#endif
 }
 
 sab::Logger::~Logger()noexcept
 {
+	// threads detached at shutdown may still log, they write synchronously
+	StopAsyncOutput();
 	FreeConsole();
 	FreeFileLog();
 }
@@ -195,8 +423,41 @@ void sab::Logger::EnableFileLogOutput()
 	PrepareFileLog();
 }
 
+void sab::Logger::EnableAsyncOutput()
+{
+	if (asyncWriter.load() != nullptr)
+		return;
+	AsyncWriter* writer;
+	try
+	{
+		writer = new AsyncWriter(*this);
+	}
+	catch (const std::exception& e)
+	{
+		LogError(L"cannot start async log writer: ", e.what());
+		return;
+	}
+	AsyncWriter* expected = nullptr;
+	if (!asyncWriter.compare_exchange_strong(expected, writer))
+	{
+		// never published, nothing else can hold it
+		writer->Stop();
+		delete writer;
+	}
+}
+
+void sab::Logger::StopAsyncOutput()
+{
+	AsyncWriter* writer = asyncWriter.exchange(nullptr);
+	if (writer == nullptr)
+		return;
+	// leaked on purpose, a producer may still hold the pointer
+	writer->Stop();
+}
+
 void sab::Logger::SetLevelOverride(LogLevel level)
 {
 	overrideLevel = level;
 	outputLevel = level;
+	WarnLevelNotCompiled(level);
 }
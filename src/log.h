@@ -1,11 +1,18 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstdio>
 #include <sstream>
 #include <mutex>
 #include <fstream>
 
+// lowest level compiled in: 0 debug, 1 info, 2 warning, 3 error
+// calls below it are removed along with the evaluation of their arguments
+#ifndef SAB_LOG_MIN_LEVEL
+#define SAB_LOG_MIN_LEVEL 0
+#endif
+
 namespace sab
 {
 
@@ -20,6 +27,10 @@ namespace sab
 			Error,
 			Invalid
 		};
+
+		static constexpr LogLevel MIN_COMPILED_LEVEL = static_cast<LogLevel>(SAB_LOG_MIN_LEVEL);
+		static_assert(MIN_COMPILED_LEVEL >= LogLevel::Debug && MIN_COMPILED_LEVEL <= LogLevel::Error,
+			"SAB_LOG_MIN_LEVEL must be 0 to 3");
 	private:
 		FILE* stdinStream;
 		FILE* stdoutStream;
@@ -34,34 +45,56 @@ namespace sab
 
 		std::mutex ioMutex;
 
-		LogLevel outputLevel;
+		// read by every log call, before the arguments are evaluated
+		std::atomic<LogLevel> outputLevel;
 		LogLevel overrideLevel;
 
 		bool debugOutput = false;
 
+		// formats records and writes them to the sinks on its own thread
+		class AsyncWriter;
+		std::atomic<AsyncWriter*> asyncWriter{ nullptr };
+
 		void WriteLogImpl(LogLevel level, const wchar_t* file, int line,
-			const std::wstring& str)noexcept;
+			std::wstring&& str)noexcept;
+		void WriteToSinks(const std::wstring& text)noexcept;
+		void WarnLevelNotCompiled(LogLevel level);
 
 		Logger()noexcept;
 		~Logger()noexcept;
 	public:
 		template<typename ...Args>
 		void WriteLog(LogLevel level, const wchar_t* file, int line,
-			Args... args)noexcept
+			const Args&... args)noexcept
 		{
-			if (level >= outputLevel) {
+			if (IsEnabled(level)) {
 				std::wostringstream oss;
-				int helper[] = { 0,(oss << args,0)... };
+				(oss << ... << args);
 				WriteLogImpl(level, file, line, oss.str());
 			}
 		}
 
+		bool IsEnabled(LogLevel level)const noexcept
+		{
+			return level >= outputLevel.load(std::memory_order_relaxed);
+		}
+
 		void SetLogOutputLevel(LogLevel level);
-		LogLevel GetLogOutputLevel()const { return outputLevel; }
+		LogLevel GetLogOutputLevel()const { return outputLevel.load(std::memory_order_relaxed); }
 		
 		void EnableDebugOutput();
 		void EnableConsoleOutput();
 		void EnableFileLogOutput();
+		/// <summary>
+		/// hand records to a background thread instead of writing them
+		/// on the logging thread
+		/// </summary>
+		void EnableAsyncOutput();
+		/// <summary>
+		/// write the queued records and log on the calling thread again,
+		/// call at shutdown while threads that log may still be running
+		/// </summary>
+		void StopAsyncOutput();
 		void SetLevelOverride(LogLevel level);
 
 		static Logger& GetInstance()noexcept;
@@ -71,18 +104,23 @@ namespace sab
 #define WSTR_(x) L ## x
 #define WSTR(x) WSTR_(x)
 
-#define LogDebug(...) \
-	sab::Logger::GetInstance().WriteLog( sab::Logger::LogLevel::Debug , \
-	WSTR( __FILE__ ) , __LINE__ , __VA_ARGS__ )
+/*
+ * Levels below SAB_LOG_MIN_LEVEL compile to nothing, the others check the
+ * runtime level first, arguments are only evaluated for messages written.
+ */
+#define SAB_LOG(level, ...) \
+	do { \
+		if constexpr (level >= sab::Logger::MIN_COMPILED_LEVEL) { \
+			sab::Logger& sabLogger_ = sab::Logger::GetInstance(); \
+			if (sabLogger_.IsEnabled(level)) \
+				sabLogger_.WriteLog( level , WSTR( __FILE__ ) , __LINE__ , __VA_ARGS__ ); \
+		} \
+	} while (0)
+
+#define LogDebug(...) SAB_LOG( sab::Logger::LogLevel::Debug , __VA_ARGS__ )
 
-#define LogInfo(...) \
-	sab::Logger::GetInstance().WriteLog( sab::Logger::LogLevel::Info , \
-	WSTR( __FILE__ ) , __LINE__ , __VA_ARGS__ )
+#define LogInfo(...) SAB_LOG( sab::Logger::LogLevel::Info , __VA_ARGS__ )
 
-#define LogWarning(...) \
-	sab::Logger::GetInstance().WriteLog( sab::Logger::LogLevel::Warning , \
-	WSTR( __FILE__ ) , __LINE__ , __VA_ARGS__ )
+#define LogWarning(...) SAB_LOG( sab::Logger::LogLevel::Warning , __VA_ARGS__ )
 
-#define LogError(...) \
-	sab::Logger::GetInstance().WriteLog( sab::Logger::LogLevel::Error , \
-	WSTR( __FILE__ ) , __LINE__ , __VA_ARGS__ )
+#define LogError(...) SAB_LOG( sab::Logger::LogLevel::Error , __VA_ARGS__ )
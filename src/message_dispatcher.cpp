@@ -1,54 +1,84 @@
 
 
 #include "log.h"
-#include "util.h"
+#include "encoding.h"
 #include "message_dispatcher.h"
 #include "protocol/protocol_ssh_agent.h"
 
+#include <algorithm>
+
 sab::MessageDispatcher::MessageDispatcher()
-	:cancelFlag(false), mangleCommentFlag(true)
+	:messageList(DEFAULT_QUEUE_CAPACITY), cancelFlag(false), workerCount(1),
+	upstreamTimeout(DEFAULT_UPSTREAM_TIMEOUT), identitiesCacheTtl(0), mangleCommentFlag(true)
 {
+	queueStatistics.capacity = DEFAULT_QUEUE_CAPACITY;
 }
 
 void sab::MessageDispatcher::PostRequest(SshMessageEnvelope* message, std::shared_ptr<void> holdKey)
 {
-	std::lock_guard<std::mutex> lg(listMutex);
-	if (cancelFlag)
+	bool cancelled;
+	{
+		std::lock_guard<std::mutex> lg(listMutex);
+		cancelled = cancelFlag;
+		if (!cancelled)
+		{
+			if (messageList.TryPush(Message{ message, std::move(holdKey), Clock::now() }))
+			{
+				++queueStatistics.accepted;
+				if (messageList.Size() > queueStatistics.maxDepth)
+					queueStatistics.maxDepth = messageList.Size();
+				wakeCondition.notify_one();
+				return;
+			}
+			++queueStatistics.rejected;
+		}
+	}
+	requestMetrics[static_cast<size_t>(GetRequestKind(*message))].failed.fetch_add(1, std::memory_order_relaxed);
+	if (cancelled)
 	{
 		message->replyCallback(message, false);
 		return;
 	}
-	messageList.emplace_back(message, holdKey);
-	wakeCondition.notify_one();
+	// queue is full, fail fast rather than letting requests pile up
+	LogDebug(L"request queue full, rejecting request.");
+	SshAgentMessageBufferWriter writer(*message);
+	writer.Init();
+	SshAgentMessageGenericFailure{}.ToBuffer(writer);
+	message->replyCallback(message, true);
 }
 
 void sab::MessageDispatcher::AddClient(std::shared_ptr<ProtocolClientBase> client)
 {
-	clients.emplace_back(std::move(client));
+	Upstream upstream;
+	if (!client->AllowConcurrentRequests())
+		upstream.requestMutex = std::make_shared<std::mutex>();
+	upstream.metrics.reset(new UpstreamMetrics[DISPATCHER_REQUEST_KIND_COUNT]);
+	upstream.querySlot = std::make_shared<QuerySlot>();
+	upstream.client = std::move(client);
+	clients.emplace_back(std::move(upstream));
 }
 
 bool sab::MessageDispatcher::Start()
 {
-	workerThread = std::thread([this]()
+	// broadcasts share queries in flight, at most one per upstream
+	if (clients.size() > 1 && !fanOutPool.Start(clients.size()))
+		return false;
+	try
+	{
+		for (size_t i = 0; i < workerCount; ++i)
 		{
-			std::unique_lock<std::mutex> lk(listMutex);
-			while (!cancelFlag)
-			{
-				while (!messageList.empty())
+			workerThreads.emplace_back([this]()
 				{
-					Message msg = messageList.back();
-					messageList.pop_back();
-					lk.unlock();
-					bool status = ProcessRequest(*msg.first);
-					msg.first->replyCallback(msg.first, status);
-					lk.lock();
-				}
-				wakeCondition.wait(lk, [this]()
-					{
-						return !messageList.empty() || cancelFlag;
-					});
-			}
-		});
+					WorkerProc();
+				});
+		}
+	}
+	catch (...)
+	{
+		Stop();
+		return false;
+	}
+	LogDebug(L"started ", workerThreads.size(), L" dispatcher workers");
 	return true;
 }
 
@@ -57,10 +87,17 @@ void sab::MessageDispatcher::Stop()
 	{
 		std::lock_guard<std::mutex> lg(listMutex);
 		cancelFlag = true;
-		wakeCondition.notify_one();
+		wakeCondition.notify_all();
+	}
+	for (auto& worker : workerThreads)
+	{
+		if (worker.joinable())
+			worker.join();
 	}
-	if (workerThread.joinable())
-		workerThread.join();
+	workerThreads.clear();
+	// nobody waits for fan-out replies anymore, and a task stuck on a
+	// hung upstream would block joining forever
+	fanOutPool.Abandon();
 }
 
 void sab::MessageDispatcher::SetKeyCommentMangling(bool flag)
@@ -68,16 +105,301 @@ void sab::MessageDispatcher::SetKeyCommentMangling(bool flag)
 	mangleCommentFlag = flag;
 }
 
+bool sab::MessageDispatcher::SetQueueCapacity(size_t capacity)
+{
+	if (capacity == 0)
+		return false;
+	std::lock_guard<std::mutex> lg(listMutex);
+	if (!messageList.Reset(capacity))
+		return false;
+	queueStatistics.capacity = capacity;
+	return true;
+}
+
+sab::DispatcherQueueStatistics sab::MessageDispatcher::GetQueueStatistics()
+{
+	std::lock_guard<std::mutex> lg(listMutex);
+	DispatcherQueueStatistics ret = queueStatistics;
+	ret.depth = messageList.Size();
+	return ret;
+}
+
+sab::DispatcherLatencyStatistics sab::MessageDispatcher::GetLatencyStatistics()
+{
+	DispatcherLatencyStatistics ret;
+	for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+	{
+		ret.requests[i].succeeded = requestMetrics[i].succeeded.load(std::memory_order_relaxed);
+		ret.requests[i].failed = requestMetrics[i].failed.load(std::memory_order_relaxed);
+		ret.requests[i].queueWait = requestMetrics[i].queueWait.Read();
+		ret.requests[i].total = requestMetrics[i].total.Read();
+	}
+	ret.upstreams.resize(clients.size());
+	for (size_t c = 0; c < clients.size(); ++c)
+	{
+		ret.upstreams[c].name = clients[c].client->Name();
+		for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+		{
+			const UpstreamMetrics& metrics = clients[c].metrics[i];
+			ret.upstreams[c].requests[i].succeeded = metrics.succeeded.load(std::memory_order_relaxed);
+			ret.upstreams[c].requests[i].failed = metrics.failed.load(std::memory_order_relaxed);
+			ret.upstreams[c].requests[i].roundTrip = metrics.roundTrip.Read();
+		}
+	}
+	return ret;
+}
+
+void sab::MessageDispatcher::LogLatencyStatistics()
+{
+	auto statistics = GetLatencyStatistics();
+	for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+	{
+		const auto& request = statistics.requests[i];
+		if (request.succeeded + request.failed == 0)
+			continue;
+		LogInfo(DispatcherRequestKindToString(static_cast<DispatcherRequestKind>(i)),
+			L" requests: ", request.succeeded, L" succeeded, ", request.failed, L" failed, total p50=",
+			request.total.Percentile(0.5).count(), L"us p99=", request.total.Percentile(0.99).count(),
+			L"us, queue wait p99=", request.queueWait.Percentile(0.99).count(), L"us");
+	}
+	for (const auto& upstream : statistics.upstreams)
+	{
+		for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+		{
+			const auto& request = upstream.requests[i];
+			if (request.succeeded + request.failed == 0)
+				continue;
+			LogInfo(L"upstream \"", upstream.name, L"\" ",
+				DispatcherRequestKindToString(static_cast<DispatcherRequestKind>(i)),
+				L" requests: ", request.succeeded, L" succeeded, ", request.failed, L" failed, round trip p50=",
+				request.roundTrip.Percentile(0.5).count(), L"us p99=",
+				request.roundTrip.Percentile(0.99).count(), L"us");
+		}
+	}
+}
+
+bool sab::MessageDispatcher::SetUpstreamTimeout(std::chrono::milliseconds timeout)
+{
+	if (timeout.count() <= 0)
+		return false;
+	upstreamTimeout = timeout;
+	return true;
+}
+
+bool sab::MessageDispatcher::SetIdentitiesCacheTtl(std::chrono::milliseconds ttl)
+{
+	if (ttl.count() < 0)
+		return false;
+	identitiesCacheTtl = ttl;
+	return true;
+}
+
+bool sab::MessageDispatcher::SetWorkerCount(size_t count)
+{
+	if (count == 0 || count > MAX_WORKER_COUNT)
+		return false;
+	workerCount = count;
+	return true;
+}
+
 sab::MessageDispatcher::~MessageDispatcher()
 {
 	Stop();
 	std::lock_guard<std::mutex> lg(listMutex);
-	while (!messageList.empty())
+	Message msg;
+	while (messageList.TryPop(msg))
+	{
+		msg.envelope->replyCallback(msg.envelope, false);
+	}
+}
+
+void sab::MessageDispatcher::WorkerProc()
+{
+	std::unique_lock<std::mutex> lk(listMutex);
+	while (!cancelFlag)
+	{
+		Message msg;
+		while (messageList.TryPop(msg))
+		{
+			auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				Clock::now() - msg.postTime);
+			queueStatistics.totalWait += wait;
+			if (wait > queueStatistics.maxWait)
+				queueStatistics.maxWait = wait;
+			lk.unlock();
+			// the reply replaces the request, take its kind first
+			RequestMetrics& metrics = requestMetrics[static_cast<size_t>(GetRequestKind(*msg.envelope))];
+			metrics.queueWait.Record(wait);
+			bool status = ProcessRequest(*msg.envelope);
+			metrics.total.Record(Clock::now() - msg.postTime);
+			(status && IsSuccessReply(*msg.envelope) ? metrics.succeeded : metrics.failed)
+				.fetch_add(1, std::memory_order_relaxed);
+			msg.envelope->replyCallback(msg.envelope, status);
+			msg.holdKey.reset();
+			lk.lock();
+		}
+		wakeCondition.wait(lk, [this]()
+			{
+				return !messageList.Empty() || cancelFlag;
+			});
+	}
+}
+
+sab::DispatcherRequestKind sab::MessageDispatcher::GetRequestKind(const SshMessageEnvelope& envelope)
+{
+	if (envelope.length == 0 || envelope.data.empty())
+		return DispatcherRequestKind::Other;
+	switch (envelope.data[0])
+	{
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		return DispatcherRequestKind::Identities;
+	case SSH2_AGENTC_SIGN_REQUEST:
+		return DispatcherRequestKind::Sign;
+	case SSH2_AGENTC_ADD_IDENTITY:
+		return DispatcherRequestKind::AddIdentity;
+	case SSH2_AGENTC_REMOVE_IDENTITY:
+	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		return DispatcherRequestKind::RemoveIdentity;
+	default:
+		return DispatcherRequestKind::Other;
+	}
+}
+
+bool sab::MessageDispatcher::IsSuccessReply(const SshMessageEnvelope& envelope)
+{
+	return envelope.length > 0 && !envelope.data.empty() && envelope.data[0] != SSH_AGENT_FAILURE;
+}
+
+bool sab::MessageDispatcher::SendToUpstream(Upstream& upstream, SshMessageEnvelope* message)
+{
+	UpstreamMetrics& metrics = upstream.metrics[static_cast<size_t>(GetRequestKind(*message))];
+	std::unique_lock<std::mutex> lk;
+	if (upstream.requestMutex)
+		lk = std::unique_lock<std::mutex>(*upstream.requestMutex);
+	// waiting for the upstream's turn is not part of its round trip
+	auto start = Clock::now();
+	bool status = upstream.client->SendSshMessage(message);
+	metrics.roundTrip.Record(Clock::now() - start);
+	(status && IsSuccessReply(*message) ? metrics.succeeded : metrics.failed)
+		.fetch_add(1, std::memory_order_relaxed);
+	return status;
+}
+
+namespace
+{
+	/// <summary>
+	/// one request sent to one upstream, shared by the broadcasts
+	/// waiting for it and the task which may outlive them
+	/// </summary>
+	struct UpstreamQuery
 	{
-		Message& msg = messageList.back();
-		msg.first->replyCallback(msg.first, false);
-		messageList.pop_back();
+		std::mutex mutex;
+		std::condition_variable doneCondition;
+		bool done = false;
+		bool status = false;
+		std::vector<uint8_t> request;
+		sab::SshMessageEnvelope reply;
+	};
+}
+
+struct sab::MessageDispatcher::QuerySlot
+{
+	std::mutex mutex;
+	std::shared_ptr<UpstreamQuery> current;
+};
+
+std::vector<sab::SshMessageEnvelope> sab::MessageDispatcher::QueryAllUpstreams(const SshMessageEnvelope& request)
+{
+	std::vector<SshMessageEnvelope> replies(clients.size());
+	if (clients.size() == 1)
+	{
+		// nothing to overlap with
+		replies[0].length = request.length;
+		replies[0].data = request.data;
+		if (!SendToUpstream(clients[0], &replies[0]))
+			replies[0] = SshMessageEnvelope();
+		return replies;
 	}
+
+	auto deadline = Clock::now() + upstreamTimeout;
+	std::vector<std::shared_ptr<UpstreamQuery>> queries(clients.size());
+	for (size_t i = 0; i < clients.size(); ++i)
+	{
+		Upstream upstream = clients[i];
+		std::shared_ptr<UpstreamQuery> query;
+		{
+			std::lock_guard<std::mutex> lg(upstream.querySlot->mutex);
+			query = upstream.querySlot->current;
+			if (query && query->request.size() == request.length
+				&& std::equal(query->request.begin(), query->request.end(), request.data.begin()))
+			{
+				// join the query in flight, a hung upstream is not asked again
+				queries[i] = std::move(query);
+				continue;
+			}
+			bool slotFree = query == nullptr;
+			query = std::make_shared<UpstreamQuery>();
+			query->request.assign(request.data.begin(), request.data.begin() + request.length);
+			// a different request in flight is rare, it runs without sharing
+			if (slotFree)
+				upstream.querySlot->current = query;
+		}
+		queries[i] = query;
+		bool posted = fanOutPool.Post([upstream, query]() mutable
+			{
+				SshMessageEnvelope reply;
+				reply.length = static_cast<uint32_t>(query->request.size());
+				reply.data = query->request;
+				bool status = SendToUpstream(upstream, &reply);
+				{
+					std::lock_guard<std::mutex> lg(query->mutex);
+					query->status = status;
+					query->reply = std::move(reply);
+					query->done = true;
+					query->doneCondition.notify_all();
+				}
+				std::lock_guard<std::mutex> lg(upstream.querySlot->mutex);
+				if (upstream.querySlot->current == query)
+					upstream.querySlot->current.reset();
+			});
+		if (!posted)
+		{
+			{
+				std::lock_guard<std::mutex> lg(query->mutex);
+				query->done = true;
+			}
+			std::lock_guard<std::mutex> lg(upstream.querySlot->mutex);
+			if (upstream.querySlot->current == query)
+				upstream.querySlot->current.reset();
+		}
+	}
+
+	// the deadline bounds the total wait, not the wait per upstream
+	size_t late = 0;
+	for (size_t i = 0; i < clients.size(); ++i)
+	{
+		UpstreamQuery& query = *queries[i];
+		std::unique_lock<std::mutex> lk(query.mutex);
+		if (!query.doneCondition.wait_until(lk, deadline, [&]()
+			{
+				return query.done;
+			}))
+		{
+			++late;
+			continue;
+		}
+		// other broadcasts may share the reply, copy it
+		if (query.status)
+		{
+			replies[i].length = query.reply.length;
+			replies[i].data = query.reply.data;
+		}
+	}
+	if (late > 0)
+	{
+		LogWarning(late, L" upstream(s) did not reply in time.");
+	}
+	return replies;
 }
 
 bool sab::MessageDispatcher::ProcessRequest(SshMessageEnvelope& envelope)
@@ -87,14 +409,25 @@ bool sab::MessageDispatcher::ProcessRequest(SshMessageEnvelope& envelope)
 
 	char type = envelope.data[0];
 
+	bool status;
 	switch (type)
 	{
 	case SSH2_AGENTC_ADD_IDENTITY:
-		return HandleAddIdentity(envelope);
+		// invalidate around the request, listings overlapping it are not cached
+		InvalidateIdentitiesCache();
+		status = HandleAddIdentity(envelope);
+		InvalidateIdentitiesCache();
+		return status;
 	case SSH2_AGENTC_REMOVE_IDENTITY:
-		return HandleRemoveIdentity(envelope);
+		InvalidateIdentitiesCache();
+		status = HandleRemoveIdentity(envelope);
+		InvalidateIdentitiesCache();
+		return status;
 	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
-		return HandleRemoveAllIdentity(envelope);
+		InvalidateIdentitiesCache();
+		status = HandleRemoveAllIdentity(envelope);
+		InvalidateIdentitiesCache();
+		return status;
 	case SSH2_AGENTC_REQUEST_IDENTITIES:
 		return HandleIdentitiesRequest(envelope);
 	case SSH2_AGENTC_SIGN_REQUEST:
@@ -104,13 +437,85 @@ bool sab::MessageDispatcher::ProcessRequest(SshMessageEnvelope& envelope)
 	}
 }
 
+bool sab::MessageDispatcher::ServeCachedIdentities(SshMessageEnvelope& envelope, uint64_t& generation)
+{
+	std::lock_guard<std::mutex> lg(identitiesCache.mutex);
+	generation = identitiesCache.generation;
+	if (!identitiesCache.valid || Clock::now() >= identitiesCache.expireTime)
+		return false;
+	envelope.data.assign(identitiesCache.answer.begin(), identitiesCache.answer.end());
+	envelope.length = static_cast<uint32_t>(identitiesCache.answer.size());
+	return true;
+}
+
+void sab::MessageDispatcher::StoreCachedIdentities(const SshMessageEnvelope& envelope, uint64_t generation)
+{
+	std::lock_guard<std::mutex> lg(identitiesCache.mutex);
+	if (identitiesCache.generation != generation)
+		return; // identities changed while assembling
+	identitiesCache.answer.assign(envelope.data.begin(), envelope.data.begin() + envelope.length);
+	identitiesCache.expireTime = Clock::now() + identitiesCacheTtl;
+	identitiesCache.valid = true;
+}
+
+void sab::MessageDispatcher::InvalidateIdentitiesCache()
+{
+	if (identitiesCacheTtl.count() == 0)
+		return;
+	std::lock_guard<std::mutex> lg(identitiesCache.mutex);
+	++identitiesCache.generation;
+	identitiesCache.valid = false;
+}
+
+/// <summary>
+/// hash the key blob following the message type, shared by sign and remove requests
+/// </summary>
+static bool GetRequestKeyHash(const sab::SshMessageEnvelope& envelope, size_t& keyHash)
+{
+	sab::SshAgentMessageBufferReader reader(envelope);
+	char type;
+	std::string_view keyBlob;
+	if (!reader.ReadByte(type) || !reader.ReadString(keyBlob))
+		return false;
+	keyHash = std::hash<std::string_view>{}(keyBlob);
+	return true;
+}
+
+bool sab::MessageDispatcher::FindKeyOwner(size_t keyHash, size_t& clientIndex)
+{
+	std::shared_lock<std::shared_mutex> lg(keyOwnerMutex);
+	auto iter = keyOwnerIndex.find(keyHash);
+	if (iter == keyOwnerIndex.end())
+		return false;
+	clientIndex = iter->second;
+	return true;
+}
+
+void sab::MessageDispatcher::RecordKeyOwner(size_t keyHash, size_t clientIndex)
+{
+	std::unique_lock<std::shared_mutex> lg(keyOwnerMutex);
+	keyOwnerIndex[keyHash] = clientIndex;
+}
+
+void sab::MessageDispatcher::ForgetKeyOwner(size_t keyHash)
+{
+	std::unique_lock<std::shared_mutex> lg(keyOwnerMutex);
+	keyOwnerIndex.erase(keyHash);
+}
+
+void sab::MessageDispatcher::ClearKeyOwners()
+{
+	std::unique_lock<std::shared_mutex> lg(keyOwnerMutex);
+	keyOwnerIndex.clear();
+}
+
 bool sab::MessageDispatcher::HandleAddIdentity(SshMessageEnvelope& envelope)
 {
 	// Iterate all upstream until request succeeds
-	for (auto& client : clients)
+	for (auto& upstream : clients)
 	{
 		SshMessageEnvelope tmpMessage{ envelope };
-		bool status = client->SendSshMessage(&tmpMessage);
+		bool status = SendToUpstream(upstream, &tmpMessage);
 		if (status)
 		{
 			if (tmpMessage.length > 0 && tmpMessage.data[0] == SSH_AGENT_SUCCESS)
@@ -129,11 +534,15 @@ bool sab::MessageDispatcher::HandleAddIdentity(SshMessageEnvelope& envelope)
 
 bool sab::MessageDispatcher::HandleRemoveIdentity(SshMessageEnvelope& envelope)
 {
+	size_t keyHash;
+	if (GetRequestKeyHash(envelope, keyHash))
+		ForgetKeyOwner(keyHash);
+
 	// Iterate all upstream until request succeeds
-	for (auto& client : clients)
+	for (auto& upstream : clients)
 	{
 		SshMessageEnvelope tmpMessage{ envelope };
-		bool status = client->SendSshMessage(&tmpMessage);
+		bool status = SendToUpstream(upstream, &tmpMessage);
 		if (status)
 		{
 			if (tmpMessage.length > 0 && tmpMessage.data[0] == SSH_AGENT_SUCCESS)
@@ -152,11 +561,13 @@ bool sab::MessageDispatcher::HandleRemoveIdentity(SshMessageEnvelope& envelope)
 
 bool sab::MessageDispatcher::HandleRemoveAllIdentity(SshMessageEnvelope& envelope)
 {
+	ClearKeyOwners();
+
 	// Broadcast to all upstreams
-	for (auto& client : clients)
+	for (auto& upstream : clients)
 	{
 		SshMessageEnvelope tmpMessage{ envelope };
-		client->SendSshMessage(&tmpMessage);
+		SendToUpstream(upstream, &tmpMessage);
 	}
 	SshAgentMessageBufferWriter writer(envelope);
 	writer.Init();
@@ -166,53 +577,88 @@ bool sab::MessageDispatcher::HandleRemoveAllIdentity(SshMessageEnvelope& envelop
 
 bool sab::MessageDispatcher::HandleIdentitiesRequest(SshMessageEnvelope& envelope)
 {
-	// Iterate all upstream then summarize
-	SshAgentMessageRequestIdentitiesAnswer ans;
-	for (auto& client : clients)
+	uint64_t cacheGeneration = 0;
+	bool cacheEnabled = identitiesCacheTtl.count() > 0;
+	if (cacheEnabled && ServeCachedIdentities(envelope, cacheGeneration))
 	{
-		LogDebug(L"try get indentities...");
-		SshMessageEnvelope tmpMessage{ envelope };
-		bool status = client->SendSshMessage(&tmpMessage);
-		if (status)
+		LogDebug(L"serve identities from cache.");
+		return true;
+	}
+
+	// Query all upstreams concurrently then summarize in client order
+	// replies are kept until the answer is assembled, identities are
+	// copied straight from them without intermediate strings
+	std::vector<SshMessageEnvelope> replies = QueryAllUpstreams(envelope);
+	std::vector<SshAgentMessageRequestIdentitiesAnswerView> answers(clients.size());
+	uint32_t identityCount = 0;
+	// only a listing every upstream contributed to is worth caching
+	bool complete = true;
+	for (size_t i = 0; i < clients.size(); ++i)
+	{
+		SshMessageEnvelope& tmpMessage = replies[i];
+		bool answered = false;
+		if (tmpMessage.length > 0 && tmpMessage.data[0] == SSH2_AGENT_IDENTITIES_ANSWER)
 		{
-			if (tmpMessage.length > 0 && tmpMessage.data[0] == SSH2_AGENT_IDENTITIES_ANSWER)
+			SshAgentMessageBufferReader reader(tmpMessage);
+			if (answers[i].FromBuffer(reader))
 			{
-				SshAgentMessageRequestIdentitiesAnswer partialAns;
-				SshAgentMessageBufferReader reader(tmpMessage);
-				if (partialAns.FromBuffer(reader))
-				{
-					LogDebug(L"get ", partialAns.identities.size(), L" indentities.");
-					if (mangleCommentFlag) {
-						for (auto& identity : partialAns.identities)
-						{
-							identity.comment += " [";
-							identity.comment += WideStringToUtf8String(client->Name());
-							identity.comment += ']';
-						}
-					}
-					ans.identities.insert(
-						ans.identities.end(),
-						std::make_move_iterator(partialAns.identities.begin()),
-						std::make_move_iterator(partialAns.identities.end()));
-				}
+				LogDebug(L"get ", answers[i].Count(), L" indentities.");
+				identityCount += answers[i].Count();
+				answered = true;
 			}
 		}
+		complete = complete && answered;
+	}
+
+	{
+		// walk backwards so the first client listing a key owns it,
+		// the same one a linear scan would pick
+		std::unique_lock<std::shared_mutex> lg(keyOwnerMutex);
+		for (size_t i = clients.size(); i-- > 0;)
+		{
+			answers[i].ForEach([&](const SshAgentIdentityView& identity)
+				{
+					keyOwnerIndex[std::hash<std::string_view>{}(identity.blob)] = i;
+				});
+		}
 	}
-	LogDebug(L"assemble reply message, ", ans.identities.size(), L" identities included.");
+	LogDebug(L"assemble reply message, ", identityCount, L" identities included.");
 	SshAgentMessageBufferWriter writer(envelope);
 	writer.Init();
-	ans.ToBuffer(writer);
+	writer.WriteByte(SshAgentMessageRequestIdentitiesAnswer::ID);
+	writer.WriteUInt32(identityCount);
+	std::string mangledComment;
+	for (size_t i = 0; i < clients.size(); ++i)
+	{
+		if (!mangleCommentFlag)
+		{
+			answers[i].ForEach([&](const SshAgentIdentityView& identity)
+				{
+					identity.ToBuffer(writer);
+				});
+			continue;
+		}
+		std::string suffix = " [" + WideStringToUtf8String(clients[i].client->Name()) + ']';
+		answers[i].ForEach([&](const SshAgentIdentityView& identity)
+			{
+				mangledComment.assign(identity.comment);
+				mangledComment += suffix;
+				writer.WriteString(identity.blob);
+				writer.WriteString(mangledComment);
+			});
+	}
+	if (cacheEnabled && complete)
+		StoreCachedIdentities(envelope, cacheGeneration);
 	return true;
 }
 
 bool sab::MessageDispatcher::HandleSignRequest(SshMessageEnvelope& envelope)
 {
-	// Iterate all upstream until request succeeds
-	for (auto& client : clients)
+	auto trySign = [&](size_t clientIndex)
 	{
 		LogDebug(L"try signing...");
 		SshMessageEnvelope tmpMessage{ envelope };
-		bool status = client->SendSshMessage(&tmpMessage);
+		bool status = SendToUpstream(clients[clientIndex], &tmpMessage);
 		if (status)
 		{
 			if (tmpMessage.length > 0 && tmpMessage.data[0] == SSH2_AGENT_SIGN_RESPONSE)
@@ -223,6 +669,31 @@ bool sab::MessageDispatcher::HandleSignRequest(SshMessageEnvelope& envelope)
 				return true;
 			}
 		}
+		return false;
+	};
+
+	// Route to the client which listed the key
+	size_t keyHash = 0;
+	bool hasKey = GetRequestKeyHash(envelope, keyHash);
+	size_t owner = clients.size();
+	if (hasKey && FindKeyOwner(keyHash, owner))
+	{
+		if (trySign(owner))
+			return true;
+		LogDebug(L"indexed upstream failed to sign, trying others.");
+	}
+
+	// Iterate all upstream until request succeeds
+	for (size_t i = 0; i < clients.size(); ++i)
+	{
+		if (i == owner)
+			continue;
+		if (trySign(i))
+		{
+			if (hasKey)
+				RecordKeyOwner(keyHash, i);
+			return true;
+		}
 	}
 	LogDebug(L"all sign attemption failed!");
 	SshAgentMessageBufferWriter writer(envelope);
@@ -239,3 +710,21 @@ bool sab::MessageDispatcher::HandleUnsupportedRequest(SshMessageEnvelope& envelo
 	SshAgentMessageGenericFailure{}.ToBuffer(writer);
 	return true;
 }
+
+const char* sab::DispatcherRequestKindToString(DispatcherRequestKind kind)
+{
+	switch (kind)
+	{
+	case DispatcherRequestKind::Identities:
+		return "identities";
+	case DispatcherRequestKind::Sign:
+		return "sign";
+	case DispatcherRequestKind::AddIdentity:
+		return "add";
+	case DispatcherRequestKind::RemoveIdentity:
+		return "remove";
+	case DispatcherRequestKind::Other:
+		return "other";
+	}
+	return ""; // shut compiler up
+}
@@ -4,7 +4,16 @@
 #include "protocol/protocol_ssh_helper.h"
 #include "protocol/client_base.h"
 
+#include "ring_buffer.h"
+#include "task_pool.h"
+#include "latency_histogram.h"
+
+#include <atomic>
+#include <string>
 #include <vector>
+#include <chrono>
+#include <shared_mutex>
+#include <unordered_map>
 #include <condition_variable>
 #include <mutex>
 #include <memory>
@@ -12,24 +21,213 @@
 
 namespace sab
 {
+	/// <summary>
+	/// snapshot of the dispatcher request queue counters
+	/// </summary>
+	struct DispatcherQueueStatistics
+	{
+		size_t capacity = 0;
+		size_t depth = 0;
+		size_t maxDepth = 0;
+		uint64_t accepted = 0;
+		uint64_t rejected = 0;
+		std::chrono::nanoseconds totalWait{ 0 };
+		std::chrono::nanoseconds maxWait{ 0 };
+	};
+
+	/// <summary>
+	/// requests the dispatcher keeps latency statistics for
+	/// </summary>
+	enum class DispatcherRequestKind
+	{
+		Identities = 0,
+		Sign,
+		AddIdentity,
+		// both removing one and removing all identities
+		RemoveIdentity,
+		Other,
+	};
+
+	static constexpr size_t DISPATCHER_REQUEST_KIND_COUNT = 5;
+
+	const char* DispatcherRequestKindToString(DispatcherRequestKind kind);
+
+	/// <summary>
+	/// requests of one kind as clients see them. a request failed when
+	/// it was rejected, could not be served or was answered with a failure
+	/// </summary>
+	struct DispatcherRequestStatistics
+	{
+		uint64_t succeeded = 0;
+		uint64_t failed = 0;
+		/// <summary>
+		/// from posting to a worker taking the request
+		/// </summary>
+		LatencyHistogram::Snapshot queueWait;
+		/// <summary>
+		/// from posting to the reply being handed back
+		/// </summary>
+		LatencyHistogram::Snapshot total;
+	};
+
+	/// <summary>
+	/// requests of one kind sent to one upstream. a request failed when
+	/// the upstream could not be reached or answered with a failure
+	/// </summary>
+	struct UpstreamRequestStatistics
+	{
+		uint64_t succeeded = 0;
+		uint64_t failed = 0;
+		LatencyHistogram::Snapshot roundTrip;
+	};
+
+	struct UpstreamStatistics
+	{
+		/// <summary>
+		/// name of the client section
+		/// </summary>
+		std::wstring name;
+		UpstreamRequestStatistics requests[DISPATCHER_REQUEST_KIND_COUNT];
+	};
+
+	/// <summary>
+	/// snapshot of the dispatcher latency histograms and counters
+	/// </summary>
+	struct DispatcherLatencyStatistics
+	{
+		DispatcherRequestStatistics requests[DISPATCHER_REQUEST_KIND_COUNT];
+		/// <summary>
+		/// in client order
+		/// </summary>
+		std::vector<UpstreamStatistics> upstreams;
+	};
+
 	class MessageDispatcher
 	{
 	public:
-		using Message = std::pair<SshMessageEnvelope*, std::shared_ptr<void>>;
+		using Clock = std::chrono::steady_clock;
+
+		struct Message
+		{
+			SshMessageEnvelope* envelope = nullptr;
+			std::shared_ptr<void> holdKey;
+			Clock::time_point postTime;
+		};
+
+		static constexpr size_t DEFAULT_QUEUE_CAPACITY = 1024;
 	private:
-		std::vector<Message> messageList;
+		/// <summary>
+		/// pending requests, served in arrival order
+		/// </summary>
+		RingBuffer<Message> messageList;
+
+		DispatcherQueueStatistics queueStatistics;
 
 		std::mutex listMutex;
 		std::condition_variable wakeCondition;
 
 		bool cancelFlag;
 
-		std::thread workerThread;
+		std::vector<std::thread> workerThreads;
+
+		size_t workerCount;
+
+		/// <summary>
+		/// counters of one request kind, updated lock free
+		/// </summary>
+		struct RequestMetrics
+		{
+			std::atomic<uint64_t> succeeded{ 0 };
+			std::atomic<uint64_t> failed{ 0 };
+			LatencyHistogram queueWait;
+			LatencyHistogram total;
+		};
+
+		RequestMetrics requestMetrics[DISPATCHER_REQUEST_KIND_COUNT];
+
+		struct QuerySlot;
 
-		std::vector<std::shared_ptr<ProtocolClientBase>> clients;
+		struct UpstreamMetrics
+		{
+			std::atomic<uint64_t> succeeded{ 0 };
+			std::atomic<uint64_t> failed{ 0 };
+			LatencyHistogram roundTrip;
+		};
+
+		/// <summary>
+		/// copies share the same client, lock and counters, so fan-out
+		/// tasks hold their own and never touch the dispatcher
+		/// </summary>
+		struct Upstream
+		{
+			std::shared_ptr<ProtocolClientBase> client;
+
+			/// <summary>
+			/// serializes requests to clients which cannot handle concurrent ones
+			/// </summary>
+			std::shared_ptr<std::mutex> requestMutex;
+
+			/// <summary>
+			/// indexed by DispatcherRequestKind
+			/// </summary>
+			std::shared_ptr<UpstreamMetrics[]> metrics;
+
+			/// <summary>
+			/// the fan-out query running on this upstream, later broadcasts
+			/// of the same request wait for it instead of sending another,
+			/// so a hung upstream holds at most one fan-out thread
+			/// </summary>
+			std::shared_ptr<QuerySlot> querySlot;
+		};
+
+		std::vector<Upstream> clients;
+
+		/// <summary>
+		/// runs requests broadcast to all upstreams concurrently
+		/// </summary>
+		TaskPool fanOutPool;
+
+		/// <summary>
+		/// how long a broadcast request waits for each upstream
+		/// </summary>
+		std::chrono::milliseconds upstreamTimeout;
+
+		/// <summary>
+		/// last assembled identities answer, served until it expires
+		/// or a request changing identities passes through
+		/// </summary>
+		struct IdentitiesCache
+		{
+			std::mutex mutex;
+			std::vector<uint8_t> answer;
+			Clock::time_point expireTime;
+			/// <summary>
+			/// bumped on invalidation so answers assembled meanwhile are not stored
+			/// </summary>
+			uint64_t generation = 0;
+			bool valid = false;
+		};
+
+		IdentitiesCache identitiesCache;
+
+		/// <summary>
+		/// lifetime of a cached identities answer, 0 disables the cache
+		/// </summary>
+		std::chrono::milliseconds identitiesCacheTtl;
+
+		/// <summary>
+		/// maps hash of a key blob to index of the client which listed it,
+		/// a stale or colliding entry only costs one failed attempt
+		/// </summary>
+		std::unordered_map<size_t, size_t> keyOwnerIndex;
+
+		std::shared_mutex keyOwnerMutex;
 
 		bool mangleCommentFlag;
 	public:
+		static constexpr size_t MAX_WORKER_COUNT = 64;
+		static constexpr std::chrono::milliseconds DEFAULT_UPSTREAM_TIMEOUT{ 3000 };
+
 		MessageDispatcher();
 
 		void PostRequest(SshMessageEnvelope* message, std::shared_ptr<void> holdKey);
@@ -41,11 +239,78 @@ namespace sab
 		void Stop();
 
 		void SetKeyCommentMangling(bool flag);
+
+		/// <summary>
+		/// set number of worker threads processing requests, must be called before Start
+		/// </summary>
+		/// <param name="count">worker count, 1 to MAX_WORKER_COUNT</param>
+		/// <returns>false if count is out of range</returns>
+		bool SetWorkerCount(size_t count);
+
+		/// <summary>
+		/// set max number of pending requests, must be called before Start.
+		/// requests posted to a full queue are answered with SSH_AGENT_FAILURE
+		/// </summary>
+		/// <param name="capacity">queue capacity, must not be 0</param>
+		/// <returns>false if capacity is invalid or queue is in use</returns>
+		bool SetQueueCapacity(size_t capacity);
+
+		DispatcherQueueStatistics GetQueueStatistics();
+
+		DispatcherLatencyStatistics GetLatencyStatistics();
+
+		/// <summary>
+		/// log request counts and p50/p99 latencies per request kind and upstream
+		/// </summary>
+		void LogLatencyStatistics();
+
+		/// <summary>
+		/// set deadline of upstreams when listing identities,
+		/// upstreams not answering in time are left out of the answer
+		/// </summary>
+		/// <param name="timeout">the deadline, must be positive</param>
+		/// <returns>false if timeout is invalid</returns>
+		bool SetUpstreamTimeout(std::chrono::milliseconds timeout);
+
+		/// <summary>
+		/// set how long an identities answer is reused, 0 disables caching
+		/// </summary>
+		/// <param name="ttl">time to live, must not be negative</param>
+		/// <returns>false if ttl is invalid</returns>
+		bool SetIdentitiesCacheTtl(std::chrono::milliseconds ttl);
 		
 		~MessageDispatcher();
 	private:
+		void WorkerProc();
+
+		static DispatcherRequestKind GetRequestKind(const SshMessageEnvelope& envelope);
+
+		/// <summary>
+		/// a reply which is neither missing nor SSH_AGENT_FAILURE
+		/// </summary>
+		static bool IsSuccessReply(const SshMessageEnvelope& envelope);
+
+		static bool SendToUpstream(Upstream& upstream, SshMessageEnvelope* message);
+
+		/// <summary>
+		/// send a request to all upstreams concurrently, an upstream
+		/// already answering the same request is not asked again
+		/// </summary>
+		/// <param name="request">the request</param>
+		/// <returns>replies in client order, empty for failed or timed out upstreams</returns>
+		std::vector<SshMessageEnvelope> QueryAllUpstreams(const SshMessageEnvelope& request);
+
 		bool ProcessRequest(SshMessageEnvelope& envelope);
 
+		bool ServeCachedIdentities(SshMessageEnvelope& envelope, uint64_t& generation);
+		void StoreCachedIdentities(const SshMessageEnvelope& envelope, uint64_t generation);
+		void InvalidateIdentitiesCache();
+
+		bool FindKeyOwner(size_t keyHash, size_t& clientIndex);
+		void RecordKeyOwner(size_t keyHash, size_t clientIndex);
+		void ForgetKeyOwner(size_t keyHash);
+		void ClearKeyOwners();
+
 		bool HandleAddIdentity(SshMessageEnvelope& envelope);
 		bool HandleRemoveIdentity(SshMessageEnvelope& envelope);
 		bool HandleRemoveAllIdentity(SshMessageEnvelope& envelope);
@@ -0,0 +1,167 @@
+#include "metrics.h"
+#include "encoding.h"
+#include "message_dispatcher.h"
+
+#include <locale>
+#include <type_traits>
+
+// quantiles reported for every latency summary
+static constexpr double SUMMARY_QUANTILES[] = { 0.5, 0.9, 0.99 };
+static constexpr const char* SUMMARY_QUANTILE_LABELS[] = { "0.5", "0.9", "0.99" };
+
+static void WriteLabelValue(std::ostringstream& oss, const std::string& value)
+{
+	for (char c : value)
+	{
+		switch (c)
+		{
+		case '\\':
+			oss << "\\\\";
+			break;
+		case '"':
+			oss << "\\\"";
+			break;
+		case '\n':
+			oss << "\\n";
+			break;
+		default:
+			oss << c;
+		}
+	}
+}
+
+static double ToSeconds(std::chrono::microseconds us)
+{
+	return us.count() / 1e6;
+}
+
+sab::MetricsWriter::MetricsWriter()
+{
+	// the format wants a dot as decimal separator whatever the user locale is
+	oss.imbue(std::locale::classic());
+	oss.precision(9);
+}
+
+void sab::MetricsWriter::WriteSeries(const char* name, const char* suffix, Labels labels,
+	const char* extraName, const char* extraValue)
+{
+	oss << name << suffix;
+	if (labels.size() == 0 && extraName == nullptr)
+	{
+		oss << ' ';
+		return;
+	}
+	char separator = '{';
+	for (const auto& label : labels)
+	{
+		oss << separator << label.first << "=\"";
+		WriteLabelValue(oss, label.second);
+		oss << '"';
+		separator = ',';
+	}
+	if (extraName != nullptr)
+		oss << separator << extraName << "=\"" << extraValue << '"';
+	oss << "} ";
+}
+
+void sab::MetricsWriter::Declare(const char* name, const char* type, const char* help)
+{
+	oss << "# HELP " << name << ' ' << help << '\n';
+	oss << "# TYPE " << name << ' ' << type << '\n';
+}
+
+void sab::MetricsWriter::Write(const char* name, Labels labels, uint64_t value)
+{
+	WriteSeries(name, "", labels);
+	oss << value << '\n';
+}
+
+void sab::MetricsWriter::Write(const char* name, Labels labels, double value)
+{
+	WriteSeries(name, "", labels);
+	oss << value << '\n';
+}
+
+void sab::MetricsWriter::WriteSummary(const char* name, Labels labels,
+	const LatencyHistogram::Snapshot& snapshot)
+{
+	for (size_t i = 0; i < std::extent<decltype(SUMMARY_QUANTILES)>::value; ++i)
+	{
+		WriteSeries(name, "", labels, "quantile", SUMMARY_QUANTILE_LABELS[i]);
+		oss << ToSeconds(snapshot.Percentile(SUMMARY_QUANTILES[i])) << '\n';
+	}
+	WriteSeries(name, "_sum", labels);
+	oss << ToSeconds(std::chrono::microseconds(snapshot.sumUs)) << '\n';
+	WriteSeries(name, "_count", labels);
+	oss << snapshot.count << '\n';
+}
+
+std::string sab::MetricsWriter::Text()const
+{
+	return oss.str();
+}
+
+void sab::WriteDispatcherMetrics(MetricsWriter& writer, MessageDispatcher& dispatcher)
+{
+	auto queue = dispatcher.GetQueueStatistics();
+	writer.Declare("sab_dispatcher_queue_depth", "gauge", "Requests waiting for a dispatcher thread.");
+	writer.Write("sab_dispatcher_queue_depth", {}, static_cast<uint64_t>(queue.depth));
+	writer.Declare("sab_dispatcher_queue_max_depth", "gauge", "Most requests ever waiting at once.");
+	writer.Write("sab_dispatcher_queue_max_depth", {}, static_cast<uint64_t>(queue.maxDepth));
+	writer.Declare("sab_dispatcher_queue_capacity", "gauge", "Requests the queue can hold.");
+	writer.Write("sab_dispatcher_queue_capacity", {}, static_cast<uint64_t>(queue.capacity));
+	writer.Declare("sab_dispatcher_queue_rejected_total", "counter", "Requests failed because the queue was full.");
+	writer.Write("sab_dispatcher_queue_rejected_total", {}, queue.rejected);
+
+	auto latency = dispatcher.GetLatencyStatistics();
+	writer.Declare("sab_dispatcher_requests_total", "counter", "Requests answered by the dispatcher.");
+	for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+	{
+		std::string kind = DispatcherRequestKindToString(static_cast<DispatcherRequestKind>(i));
+		writer.Write("sab_dispatcher_requests_total",
+			{ { "kind", kind }, { "result", "success" } }, latency.requests[i].succeeded);
+		writer.Write("sab_dispatcher_requests_total",
+			{ { "kind", kind }, { "result", "failure" } }, latency.requests[i].failed);
+	}
+	writer.Declare("sab_dispatcher_queue_wait_seconds", "summary", "Time requests waited for a dispatcher thread.");
+	for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+	{
+		writer.WriteSummary("sab_dispatcher_queue_wait_seconds",
+			{ { "kind", DispatcherRequestKindToString(static_cast<DispatcherRequestKind>(i)) } },
+			latency.requests[i].queueWait);
+	}
+	writer.Declare("sab_dispatcher_request_duration_seconds", "summary", "Time from receiving a request to its reply.");
+	for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+	{
+		writer.WriteSummary("sab_dispatcher_request_duration_seconds",
+			{ { "kind", DispatcherRequestKindToString(static_cast<DispatcherRequestKind>(i)) } },
+			latency.requests[i].total);
+	}
+
+	writer.Declare("sab_upstream_requests_total", "counter", "Requests sent to an upstream agent.");
+	for (const auto& upstream : latency.upstreams)
+	{
+		std::string name = WideStringToUtf8String(upstream.name);
+		for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+		{
+			std::string kind = DispatcherRequestKindToString(static_cast<DispatcherRequestKind>(i));
+			writer.Write("sab_upstream_requests_total",
+				{ { "upstream", name }, { "kind", kind }, { "result", "success" } },
+				upstream.requests[i].succeeded);
+			writer.Write("sab_upstream_requests_total",
+				{ { "upstream", name }, { "kind", kind }, { "result", "failure" } },
+				upstream.requests[i].failed);
+		}
+	}
+	writer.Declare("sab_upstream_round_trip_seconds", "summary", "Time an upstream agent took to answer.");
+	for (const auto& upstream : latency.upstreams)
+	{
+		std::string name = WideStringToUtf8String(upstream.name);
+		for (size_t i = 0; i < DISPATCHER_REQUEST_KIND_COUNT; ++i)
+		{
+			writer.WriteSummary("sab_upstream_round_trip_seconds",
+				{ { "upstream", name }, { "kind", DispatcherRequestKindToString(static_cast<DispatcherRequestKind>(i)) } },
+				upstream.requests[i].roundTrip);
+		}
+	}
+}
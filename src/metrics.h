@@ -0,0 +1,55 @@
+#pragma once
+
+#include "latency_histogram.h"
+
+#include <cstdint>
+#include <initializer_list>
+#include <sstream>
+#include <string>
+#include <utility>
+
+namespace sab
+{
+	class MessageDispatcher;
+
+	/// <summary>
+	/// Builds a page in the Prometheus text exposition format
+	/// </summary>
+	class MetricsWriter
+	{
+	public:
+		/// <summary>
+		/// label names and UTF-8 values of one sample
+		/// </summary>
+		using Labels = std::initializer_list<std::pair<const char*, std::string>>;
+	private:
+		std::ostringstream oss;
+
+		void WriteSeries(const char* name, const char* suffix, Labels labels,
+			const char* extraName = nullptr, const char* extraValue = nullptr);
+	public:
+		MetricsWriter();
+
+		/// <summary>
+		/// start a metric family, its samples follow
+		/// </summary>
+		/// <param name="type">counter, gauge or summary</param>
+		void Declare(const char* name, const char* type, const char* help);
+
+		void Write(const char* name, Labels labels, uint64_t value);
+
+		void Write(const char* name, Labels labels, double value);
+
+		/// <summary>
+		/// write a histogram as summary, quantiles and sum in seconds
+		/// </summary>
+		void WriteSummary(const char* name, Labels labels, const LatencyHistogram::Snapshot& snapshot);
+
+		std::string Text()const;
+	};
+
+	/// <summary>
+	/// queue, request and upstream statistics of the dispatcher
+	/// </summary>
+	void WriteDispatcherMetrics(MetricsWriter& writer, MessageDispatcher& dispatcher);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace sab
+{
+	/// <summary>
+	/// Fixed capacity lock-free FIFO queue for any number of producers and
+	/// a single consumer. Every slot carries a sequence number telling
+	/// whether it is free for the producer of a position or filled for
+	/// the consumer, so producers only contend on one counter.
+	/// </summary>
+	/// <typeparam name="T">element type, must be default constructible</typeparam>
+	template<typename T>
+	class MpscRing
+	{
+	private:
+		struct Slot
+		{
+			std::atomic<size_t> sequence;
+			T value;
+		};
+
+		std::unique_ptr<Slot[]> slots;
+		size_t mask;
+
+		// keep the producer counter and the consumer position apart
+		alignas(64) std::atomic<size_t> tail{ 0 };
+		alignas(64) size_t head = 0;
+	public:
+		/// <param name="capacity">rounded up to a power of two</param>
+		explicit MpscRing(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity)
+				size <<= 1;
+			slots.reset(new Slot[size]);
+			mask = size - 1;
+			for (size_t i = 0; i < size; ++i)
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		MpscRing(const MpscRing&) = delete;
+		MpscRing& operator=(const MpscRing&) = delete;
+
+		/// <summary>
+		/// called by any thread
+		/// </summary>
+		/// <returns>false if the queue is full</returns>
+		bool TryPush(T&& value)
+		{
+			size_t position = tail.load(std::memory_order_relaxed);
+			Slot* slot;
+			while (true)
+			{
+				slot = &slots[position & mask];
+				size_t sequence = slot->sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+				if (diff == 0)
+				{
+					if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+				{
+					// the consumer has not freed this slot since the last lap
+					return false;
+				}
+				else
+				{
+					position = tail.load(std::memory_order_relaxed);
+				}
+			}
+			slot->value = std::move(value);
+			slot->sequence.store(position + 1, std::memory_order_release);
+			return true;
+		}
+
+		/// <summary>
+		/// called by the consumer thread only
+		/// </summary>
+		/// <returns>false if the queue is empty</returns>
+		bool TryPop(T& value)
+		{
+			Slot* slot = &slots[head & mask];
+			if (slot->sequence.load(std::memory_order_acquire) != head + 1)
+				return false;
+			value = std::move(slot->value);
+			// release resources held by the slot early
+			slot->value = T();
+			slot->sequence.store(head + mask + 1, std::memory_order_release);
+			++head;
+			return true;
+		}
+
+		/// <summary>
+		/// called by the consumer thread only
+		/// </summary>
+		bool Empty()const
+		{
+			return slots[head & mask].sequence.load(std::memory_order_acquire) != head + 1;
+		}
+
+		size_t Capacity()const { return mask + 1; }
+	};
+}
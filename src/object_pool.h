@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace sab
+{
+	/// <summary>
+	/// Thread safe free list of equally sized memory blocks.
+	/// Released blocks are kept for the next allocation instead of going
+	/// back to the heap, up to MAX_CACHED_BLOCKS.
+	/// </summary>
+	/// <typeparam name="BlockSize">size of each block</typeparam>
+	/// <typeparam name="BlockAlign">alignment of each block</typeparam>
+	template<size_t BlockSize, size_t BlockAlign>
+	class BlockPool
+	{
+	public:
+		static constexpr size_t MAX_CACHED_BLOCKS = 256;
+	private:
+		std::vector<void*> freeBlocks;
+		std::mutex poolMutex;
+
+		BlockPool()
+		{
+			freeBlocks.reserve(MAX_CACHED_BLOCKS);
+		}
+	public:
+		BlockPool(const BlockPool&) = delete;
+		BlockPool& operator=(const BlockPool&) = delete;
+
+		/// <summary>
+		/// the pool shared by all users of this block size,
+		/// never destroyed so blocks can be released during static destruction
+		/// </summary>
+		static BlockPool& GetInstance()
+		{
+			static BlockPool* instance = new BlockPool();
+			return *instance;
+		}
+
+		void* Allocate()
+		{
+			{
+				std::lock_guard<std::mutex> lg(poolMutex);
+				if (!freeBlocks.empty())
+				{
+					void* block = freeBlocks.back();
+					freeBlocks.pop_back();
+					return block;
+				}
+			}
+			return ::operator new(BlockSize, std::align_val_t(BlockAlign));
+		}
+
+		void Deallocate(void* block)
+		{
+			{
+				std::lock_guard<std::mutex> lg(poolMutex);
+				if (freeBlocks.size() < MAX_CACHED_BLOCKS)
+				{
+					freeBlocks.push_back(block);
+					return;
+				}
+			}
+			::operator delete(block, std::align_val_t(BlockAlign));
+		}
+	};
+
+	/// <summary>
+	/// Standard allocator serving single objects from a BlockPool,
+	/// for use with std::allocate_shared and node based containers.
+	/// Array allocations go to the heap directly.
+	/// </summary>
+	template<typename T>
+	class PoolAllocator
+	{
+	public:
+		using value_type = T;
+
+		PoolAllocator() noexcept = default;
+
+		template<typename U>
+		PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+		T* allocate(size_t n)
+		{
+			if (n == 1)
+				return static_cast<T*>(Pool::GetInstance().Allocate());
+			return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+		}
+
+		void deallocate(T* p, size_t n) noexcept
+		{
+			if (n == 1)
+				Pool::GetInstance().Deallocate(p);
+			else
+				::operator delete(p, std::align_val_t(alignof(T)));
+		}
+
+		template<typename U>
+		bool operator==(const PoolAllocator<U>&)const noexcept { return true; }
+
+		template<typename U>
+		bool operator!=(const PoolAllocator<U>&)const noexcept { return false; }
+	private:
+		using Pool = BlockPool<sizeof(T), alignof(T)>;
+	};
+}
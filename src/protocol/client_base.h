@@ -17,6 +17,12 @@ namespace sab
 		/// <returns>indicate whether the operation is successful</returns>
 		virtual bool SendSshMessage(SshMessageEnvelope* message) = 0;
 
+		/// <summary>
+		/// whether SendSshMessage may be called from several threads at once,
+		/// requests are serialized by the dispatcher otherwise
+		/// </summary>
+		virtual bool AllowConcurrentRequests()const { return false; }
+
 		ProtocolClientBase() = default;
 		ProtocolClientBase(ProtocolClientBase&&) = default;
 		ProtocolClientBase(const ProtocolClientBase&) = delete;
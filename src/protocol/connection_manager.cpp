@@ -8,7 +8,8 @@
 
 sab::IoContext::IoContext()
 	:handle(INVALID_HANDLE_VALUE),
-	handleType(HandleType::FileHandle)
+	handleType(HandleType::FileHandle),
+	lastActivity(std::chrono::steady_clock::now().time_since_epoch().count())
 {
 	LogDebug(L"created io context: ", this);
 }
@@ -18,6 +19,18 @@ sab::IoContext::~IoContext()
 	LogDebug(L"destruct io context:", this);
 }
 
+void sab::IoContext::Touch()
+{
+	lastActivity.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+		std::memory_order_relaxed);
+}
+
+std::chrono::steady_clock::time_point sab::IoContext::LastActivity()const
+{
+	return std::chrono::steady_clock::time_point(
+		std::chrono::steady_clock::duration(lastActivity.load(std::memory_order_relaxed)));
+}
+
 void sab::IoContext::CloseIoHandle(HANDLE handle, HandleType type)
 {
 	switch (type)
@@ -2,7 +2,10 @@
 #pragma once
 
 #include "listener_base.h"
+#include "../object_pool.h"
 
+#include <atomic>
+#include <chrono>
 #include <list>
 #include <memory>
 
@@ -14,6 +17,13 @@ namespace sab
 	static constexpr size_t MAX_BUFFER_SIZE = 4 * 1024;
 
 	class IConnectionManager;
+	class IoContext;
+
+	/**
+	 * @brief list of active connections, nodes are recycled across connections
+	*/
+	using IoContextList = std::list<std::shared_ptr<IoContext>,
+		PoolAllocator<std::shared_ptr<IoContext>>>;
 
 	class ListenerConnectionData
 	{
@@ -61,12 +71,17 @@ namespace sab
 		/**
 		 * @brief iterator of the context in context list of connection manager
 		*/
-		std::list<std::shared_ptr<IoContext>>::iterator selfIter;
+		IoContextList::iterator selfIter;
 
 		/**
 		 * @brief the connection manager this context belongs to
 		*/
 		std::shared_ptr<IConnectionManager> owner;
+
+		/**
+		 * @brief time of last completed i/o, in steady clock ticks
+		*/
+		std::atomic<std::chrono::steady_clock::rep> lastActivity;
 	public:
 
 		IoContext();
@@ -83,6 +98,13 @@ namespace sab
 		*/
 		virtual void Dispose() = 0;
 
+		/**
+		 * @brief record i/o activity for idle timeout
+		*/
+		void Touch();
+
+		std::chrono::steady_clock::time_point LastActivity()const;
+
 	public:
 		static void CloseIoHandle(HANDLE handle, HandleType type);
 	};
@@ -134,6 +156,26 @@ namespace sab
 		/// </summary>
 		/// <param name="context"></param>
 		virtual void RemoveContext(IoContext* context) = 0;
+
+		/// <summary>
+		/// close connections without i/o for the timeout, call before Start
+		/// </summary>
+		/// <param name="timeout">idle timeout, 0 disables it</param>
+		virtual void SetIdleTimeout(std::chrono::milliseconds timeout) = 0;
+
+		/// <summary>
+		/// limit concurrent connections of a listener, DelegateConnection
+		/// blocks the listener while it is at the limit
+		/// </summary>
+		/// <param name="listener">listener instance</param>
+		/// <param name="limit">max connections, 0 for unlimited</param>
+		virtual void SetConnectionLimit(const std::shared_ptr<ProtocolListenerBase>& listener,
+			size_t limit) = 0;
+
+		/// <summary>
+		/// number of connections in the context list
+		/// </summary>
+		virtual size_t GetActiveCount() = 0;
 	};
 
 	class IManagedListener
@@ -0,0 +1,368 @@
+#include "../../log.h"
+#include "epoll_proxy.h"
+
+#include <iomanip>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+sab::EpollProxyContext::EpollProxyContext()
+	:fd(-1), pendingIo(0), released(false), owner(nullptr)
+{
+	readOperation.bufferCount = 0;
+	writeOperation.bufferCount = 0;
+}
+
+sab::EpollProxyContext::~EpollProxyContext()
+{
+	if (fd != -1) {
+		close(fd);
+		LogDebug(L"closed socket ", fd);
+	}
+}
+
+void sab::EpollProxyContext::Dispose()
+{
+	if (session.state != State::Destroyed) {
+		session.SetState(State::Destroyed);
+		LogDebug(L"terminating connection: ", fd);
+		// pending operations complete as aborted,
+		// the context leaves the list after the last one
+		owner->completionQueue.Cancel(fd);
+		ReleaseIfIdle();
+	}
+}
+
+void sab::EpollProxyContext::ReleaseIfIdle()
+{
+	if (session.state == State::Destroyed && pendingIo == 0 && !released)
+	{
+		released = true;
+		owner->RemoveContext(this);
+	}
+}
+
+sab::EpollProxyConnectionManager::EpollProxyConnectionManager()
+	:cancelFlag(false), workerCount(DEFAULT_WORKER_COUNT), initialized(false)
+{
+}
+
+sab::EpollProxyConnectionManager::~EpollProxyConnectionManager()
+{
+	if (!cancelFlag) {
+		Stop();
+	}
+}
+
+bool sab::EpollProxyConnectionManager::Initialize()
+{
+	initialized = true;
+	return true;
+}
+
+bool sab::EpollProxyConnectionManager::SetWorkerCount(size_t count)
+{
+	if (count == 0 || count > CompletionWorkerPool::MAX_WORKER_COUNT)
+		return false;
+	workerCount = count;
+	return true;
+}
+
+bool sab::EpollProxyConnectionManager::Start()
+{
+	if (!initialized)return false;
+	if (!completionQueue.Create())
+	{
+		return false;
+	}
+	if (!workerPool.Start(&completionQueue, workerCount,
+		[this](const CompletionPacket& packet)
+		{
+			HandleCompletion(packet);
+		}))
+	{
+		LogError(L"cannot start completion workers!");
+		return false;
+	}
+	LogDebug(L"started ", workerCount, L" completion workers");
+	return true;
+}
+
+void sab::EpollProxyConnectionManager::Stop()
+{
+	if (!initialized)return;
+	cancelFlag = true;
+	workerPool.Stop();
+	completionQueue.Close();
+
+	// no worker left to finish the connections, close them here,
+	// sockets are closed once replies still in flight are dropped
+	std::lock_guard<std::mutex> lg(listMutex);
+	for (auto& context : contextList)
+	{
+		completionQueue.Disassociate(context->fd);
+	}
+	contextList.clear();
+}
+
+bool sab::EpollProxyConnectionManager::DelegateConnection(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		LogDebug(L"cannot make socket non-blocking! ", fd);
+		close(fd);
+		return false;
+	}
+
+	// reuse warm memory of closed connections
+	auto context = std::allocate_shared<EpollProxyContext>(PoolAllocator<EpollProxyContext>());
+	context->fd = fd;
+	context->owner = this;
+	context->session.SetState(EpollProxyContext::State::Ready);
+
+	if (!completionQueue.Associate(fd, reinterpret_cast<uintptr_t>(context.get())))
+	{
+		LogDebug(L"cannot associate socket to completion queue! ", fd);
+		return false;
+	}
+	LogDebug(L"delegated connection to manager: ", fd);
+
+	{
+		std::lock_guard<std::mutex> lg(listMutex);
+		contextList.emplace_front(context);
+		context->selfIter = contextList.begin();
+	}
+	context->executor.Execute([this, context]()
+		{
+			DoIoCompletion(context, 0);
+		});
+	return true;
+}
+
+void sab::EpollProxyConnectionManager::SetEmitMessageCallback(std::function<void(SshMessageEnvelope*, std::shared_ptr<void>)>&& callback)
+{
+	receiveCallback = callback;
+}
+
+void sab::EpollProxyConnectionManager::RemoveContext(EpollProxyContext* context)
+{
+	// called on the context's executor, keep its idle requests for
+	// later connections, pending ones may still be held by the dispatcher
+	std::vector<std::unique_ptr<ProxyRequest>> requests;
+	context->session.ReleaseRequests(requests);
+	requestPool.Recycle(requests);
+
+	completionQueue.Disassociate(context->fd);
+
+	std::lock_guard<std::mutex> lg(listMutex);
+	if (cancelFlag)
+		return; // the list is being cleared by Stop
+	contextList.erase(context->selfIter);
+}
+
+size_t sab::EpollProxyConnectionManager::GetActiveCount()
+{
+	std::lock_guard<std::mutex> lg(listMutex);
+	return contextList.size();
+}
+
+void sab::EpollProxyConnectionManager::HandleCompletion(const CompletionPacket& packet)
+{
+	auto context = reinterpret_cast<EpollProxyContext*>(packet.key)->shared_from_this();
+	context->executor.Execute([this, context, packet]()
+		{
+			ProcessCompletion(context, packet);
+		});
+}
+
+void sab::EpollProxyConnectionManager::ProcessCompletion(const std::shared_ptr<EpollProxyContext>& context,
+	const CompletionPacket& packet)
+{
+	--context->pendingIo;
+	if (context->session.state == EpollProxyContext::State::Destroyed)
+	{
+		context->ReleaseIfIdle();
+		return;
+	}
+	if (packet.status != CompletionStatus::Success)
+	{
+		context->Dispose();
+		return;
+	}
+
+	if (packet.overlapped == &context->writeOperation)
+		DoWriteCompletion(context, packet.transferred);
+	else
+		DoIoCompletion(context, packet.transferred);
+}
+
+void sab::EpollProxyConnectionManager::DoIoCompletion(const std::shared_ptr<EpollProxyContext>& context, size_t transferred)
+{
+	ProxySession& session = context->session;
+
+	if (session.state == EpollProxyContext::State::Ready)
+	{
+		session.BeginRead(AcquireRequest(context));
+		if (!ContinueRead(context.get()))
+		{
+			context->Dispose();
+		}
+		return;
+	}
+
+	switch (session.OnRead(transferred))
+	{
+	case ProxySession::ReadResult::Continue:
+		if (!ContinueRead(context.get()))
+		{
+			context->Dispose();
+		}
+		break;
+	case ProxySession::ReadResult::Dispatch:
+	{
+		ProxyRequest* request = session.pendingRequests.back().get();
+		LogDebug(L"recv message: length=", request->message.length, L", type=0x",
+			std::hex, std::setfill(L'0'), std::setw(2), request->message.data[0]);
+		receiveCallback(&request->message, context);
+		if (session.state == EpollProxyContext::State::Ready)
+		{
+			DoIoCompletion(context, 0);
+		}
+		break;
+	}
+	case ProxySession::ReadResult::Hold:
+	case ProxySession::ReadResult::Closed:
+		break;
+	default:
+		context->Dispose();
+		break;
+	}
+}
+
+void sab::EpollProxyConnectionManager::DoWriteCompletion(const std::shared_ptr<EpollProxyContext>& context, size_t transferred)
+{
+	ProxySession& session = context->session;
+
+	switch (session.OnWrite(transferred))
+	{
+	case ProxySession::WriteResult::Continue:
+		if (!ContinueWrite(context.get()))
+		{
+			context->Dispose();
+		}
+		return;
+	case ProxySession::WriteResult::Finished:
+		break;
+	default:
+		context->Dispose();
+		return;
+	}
+
+	if (session.Drained())
+	{
+		context->Dispose();
+		return;
+	}
+	ProxyRequest* held = session.TakeHeldRequest();
+	if (held)
+	{
+		// earlier replies are written, run the barrier
+		receiveCallback(&held->message, context);
+	}
+	if (session.ResumeRead())
+	{
+		// room for another request, resume reading
+		DoIoCompletion(context, 0);
+		if (session.state == EpollProxyContext::State::Destroyed)
+			return;
+	}
+	WriteNextReply(context);
+}
+
+void sab::EpollProxyConnectionManager::WriteNextReply(const std::shared_ptr<EpollProxyContext>& context)
+{
+	if (!context->session.BeginWrite())
+		return;
+
+	ProxyRequest* request = context->session.pendingRequests.front().get();
+	LogDebug(L"send message: length=", request->message.length, L", type=0x",
+		std::hex, std::setfill(L'0'), std::setw(2), request->message.data[0]);
+	if (!ContinueWrite(context.get()))
+	{
+		context->Dispose();
+	}
+}
+
+std::unique_ptr<sab::ProxyRequest> sab::EpollProxyConnectionManager::AcquireRequest(const std::shared_ptr<EpollProxyContext>& context)
+{
+	auto request = context->session.TakeFreeRequest();
+	if (request)
+		return request;
+
+	request = requestPool.Take();
+	if (!request)
+	{
+		request.reset(new ProxyRequest());
+		ProxyRequest* newRequest = request.get();
+		// small enough to be stored inline by std::function
+		newRequest->message.replyCallback = [this, newRequest](SshMessageEnvelope* message, bool status)
+		{
+			auto strongContext = newRequest->context.lock();
+			if (strongContext == nullptr)
+				return; // context destroyed
+			PostMessageReply(strongContext, message, status);
+		};
+	}
+	request->context = context;
+	return request;
+}
+
+bool sab::EpollProxyConnectionManager::ContinueRead(EpollProxyContext* context)
+{
+	ProxyBuffer target = context->session.ReadTarget();
+	context->readOperation.buffers[0].iov_base = target.data;
+	context->readOperation.buffers[0].iov_len = target.length;
+	context->readOperation.bufferCount = 1;
+
+	if (!completionQueue.Read(context->fd, &context->readOperation))
+		return false;
+	++context->pendingIo;
+	return true;
+}
+
+bool sab::EpollProxyConnectionManager::ContinueWrite(EpollProxyContext* context)
+{
+	ProxyBuffer target[2];
+	size_t count = context->session.WriteTarget(target);
+
+	// gather header and body straight from the envelope
+	for (size_t i = 0; i < count; ++i)
+	{
+		context->writeOperation.buffers[i].iov_base = target[i].data;
+		context->writeOperation.buffers[i].iov_len = target[i].length;
+	}
+	context->writeOperation.bufferCount = static_cast<int>(count);
+
+	if (!completionQueue.Write(context->fd, &context->writeOperation))
+		return false;
+	++context->pendingIo;
+	return true;
+}
+
+void sab::EpollProxyConnectionManager::PostMessageReply(std::shared_ptr<void> genericContext, SshMessageEnvelope* message, bool status)
+{
+	auto context = std::static_pointer_cast<EpollProxyContext>(genericContext);
+	context->executor.Execute([this, context, message, status]()
+		{
+			if (context->session.state == EpollProxyContext::State::Destroyed)
+				return;
+			if (!status)
+			{
+				context->Dispose();
+				return;
+			}
+			context->session.MarkReplied(message);
+			WriteNextReply(context);
+		});
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include "../protocol_ssh_helper.h"
+#include "../proxy_session.h"
+#include "../../object_pool.h"
+#include "../../serial_executor.h"
+#include "epoll_queue.h"
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+
+namespace sab
+{
+	class EpollProxyConnectionManager;
+
+	class EpollProxyContext
+		:public std::enable_shared_from_this<EpollProxyContext>
+	{
+	public:
+		using State = ProxySession::State;
+
+		using List = std::list<std::shared_ptr<EpollProxyContext>,
+			PoolAllocator<std::shared_ptr<EpollProxyContext>>>;
+	public:
+		/**
+		 * @brief connected AF_UNIX stream socket, non-blocking
+		 */
+		int fd;
+
+		/**
+		 * @brief pending read, counterpart of ProxyIoContext::overlapped
+		 */
+		EpollCompletionQueue::Operation readOperation;
+
+		/**
+		 * @brief pending write, counterpart of ProxyIoContext::writeOverlapped
+		 */
+		EpollCompletionQueue::Operation writeOperation;
+
+		/**
+		 * @brief framing and pipelined requests of the connection
+		 */
+		ProxySession session;
+
+		/**
+		 * @brief reads and writes issued and not completed yet, the context
+		 * stays in the context list until all of them complete
+		 */
+		int pendingIo;
+
+		/**
+		 * @brief removed from the context list
+		 */
+		bool released;
+
+		/**
+		 * @brief serializes state transitions of this connection
+		 */
+		SerialExecutor executor;
+
+		/**
+		 * @brief iterator of the context in context list of connection manager
+		 */
+		List::iterator selfIter;
+
+		/**
+		 * @brief the connection manager this context belongs to
+		 */
+		EpollProxyConnectionManager* owner;
+	public:
+		EpollProxyContext();
+
+		EpollProxyContext(const EpollProxyContext&) = delete;
+		EpollProxyContext& operator=(const EpollProxyContext&) = delete;
+
+		~EpollProxyContext();
+
+		/**
+		 * @brief close the connection, runs on executor
+		 */
+		void Dispose();
+
+		/**
+		 * @brief remove a destroyed context from the list once no i/o is pending
+		 */
+		void ReleaseIfIdle();
+	};
+
+	/**
+	 * @brief ProxyConnectionManager for AF_UNIX clients on Linux.
+	 *
+	 * Runs the same ProxySession framing and worker model as the IOCP
+	 * manager, with EpollCompletionQueue in place of the completion port,
+	 * so the proxy engine can serve WSL clients natively and be load
+	 * tested off Windows.
+	 */
+	class EpollProxyConnectionManager
+	{
+		friend class EpollProxyContext;
+	private:
+		std::atomic<bool> cancelFlag;
+
+		EpollCompletionQueue completionQueue;
+
+		/**
+		 * @brief worker threads draining the completion queue
+		 */
+		CompletionWorkerPool workerPool;
+
+		/**
+		 * @brief number of worker threads
+		 */
+		size_t workerCount;
+
+		/**
+		 * @brief list of active connections
+		 */
+		EpollProxyContext::List contextList;
+
+		/**
+		 * @brief initialized flag
+		 */
+		bool initialized;
+
+		/**
+		 * @brief synchronize access to list
+		 */
+		std::mutex listMutex;
+
+		/**
+		 * @brief request objects left by closed connections
+		 */
+		ProxyRequestPool requestPool;
+
+		/**
+		 * @brief callback to process received message
+		 */
+		std::function<void(SshMessageEnvelope*, std::shared_ptr<void>)> receiveCallback;
+	public:
+		static constexpr size_t DEFAULT_WORKER_COUNT = 2;
+
+		EpollProxyConnectionManager();
+
+		EpollProxyConnectionManager(const EpollProxyConnectionManager&) = delete;
+		EpollProxyConnectionManager& operator=(const EpollProxyConnectionManager&) = delete;
+
+		~EpollProxyConnectionManager();
+	public:
+		bool Initialize();
+
+		/**
+		 * @brief set number of completion worker threads, call before Start
+		 * @param count 1 to CompletionWorkerPool::MAX_WORKER_COUNT
+		 * @return false if count is out of range
+		 */
+		bool SetWorkerCount(size_t count);
+
+		bool Start();
+
+		/**
+		 * @brief stop workers and close all connections
+		 */
+		void Stop();
+
+		/**
+		 * @brief delegate a connected stream socket to the manager,
+		 * the manager owns it afterwards, also on failure
+		 * @param fd the socket
+		 * @return operation result, true stands for success
+		 */
+		bool DelegateConnection(int fd);
+
+		/**
+		 * @brief set callback which will be called when a message was received
+		 * @param callback the callback
+		 */
+		void SetEmitMessageCallback(std::function<void(SshMessageEnvelope*, std::shared_ptr<void>)>&& callback);
+
+		/**
+		 * @brief remove a connection from connection list
+		 * @param context the context
+		 */
+		void RemoveContext(EpollProxyContext* context);
+
+		/**
+		 * @brief number of connections in the context list
+		 */
+		size_t GetActiveCount();
+
+	private:
+		void HandleCompletion(const CompletionPacket& packet);
+
+		/**
+		 * @brief route a completion to the reading or writing side, runs on executor
+		 */
+		void ProcessCompletion(const std::shared_ptr<EpollProxyContext>& context,
+			const CompletionPacket& packet);
+
+		/**
+		 * @brief advance the reading side
+		 */
+		void DoIoCompletion(const std::shared_ptr<EpollProxyContext>& context, size_t transferred);
+
+		/**
+		 * @brief advance the writing side
+		 */
+		void DoWriteCompletion(const std::shared_ptr<EpollProxyContext>& context, size_t transferred);
+
+		/**
+		 * @brief start writing the oldest reply if it is ready and no write is pending
+		 */
+		void WriteNextReply(const std::shared_ptr<EpollProxyContext>& context);
+
+		/**
+		 * @brief take a request object for reading
+		 */
+		std::unique_ptr<ProxyRequest> AcquireRequest(const std::shared_ptr<EpollProxyContext>& context);
+
+		bool ContinueRead(EpollProxyContext* context);
+
+		bool ContinueWrite(EpollProxyContext* context);
+
+		void PostMessageReply(std::shared_ptr<void> genericContext,
+			SshMessageEnvelope* message, bool status);
+	};
+}
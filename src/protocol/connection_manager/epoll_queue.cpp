@@ -0,0 +1,271 @@
+#include "../../log.h"
+#include "epoll_queue.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+sab::EpollCompletionQueue::EpollCompletionQueue()
+	:epollFd(-1), wakeFd(-1), closed(false)
+{
+}
+
+sab::EpollCompletionQueue::~EpollCompletionQueue()
+{
+	Close();
+	if (epollFd != -1)
+		close(epollFd);
+	if (wakeFd != -1)
+		close(wakeFd);
+}
+
+bool sab::EpollCompletionQueue::Create()
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd == -1)
+	{
+		LogError(L"cannot create epoll instance! ", strerror(errno));
+		return false;
+	}
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd == -1)
+	{
+		LogError(L"cannot create eventfd! ", strerror(errno));
+		return false;
+	}
+	// level triggered, stays signalled once closed so every worker wakes
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.fd = wakeFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == -1)
+	{
+		LogError(L"cannot watch eventfd! ", strerror(errno));
+		return false;
+	}
+	closed = false;
+	return true;
+}
+
+bool sab::EpollCompletionQueue::Associate(int fd, uintptr_t key)
+{
+	auto channel = std::make_shared<Channel>();
+	channel->fd = fd;
+	channel->key = key;
+	channel->readOperation = nullptr;
+	channel->writeOperation = nullptr;
+	{
+		std::lock_guard<std::mutex> lg(mapMutex);
+		channelMap[fd] = channel;
+	}
+
+	// edge triggered, a pending operation is retried on every edge
+	epoll_event event{};
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.fd = fd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+	{
+		LogDebug(L"cannot add socket to epoll! ", strerror(errno));
+		std::lock_guard<std::mutex> lg(mapMutex);
+		channelMap.erase(fd);
+		return false;
+	}
+	return true;
+}
+
+void sab::EpollCompletionQueue::Disassociate(int fd)
+{
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	// events already taken by epoll_wait may name the fd after this,
+	// or a new socket reusing it, both only cause a harmless retry
+	std::lock_guard<std::mutex> lg(mapMutex);
+	channelMap.erase(fd);
+}
+
+bool sab::EpollCompletionQueue::Read(int fd, Operation* operation)
+{
+	return StartOperation(fd, operation, false);
+}
+
+bool sab::EpollCompletionQueue::Write(int fd, Operation* operation)
+{
+	return StartOperation(fd, operation, true);
+}
+
+void sab::EpollCompletionQueue::Cancel(int fd)
+{
+	auto channel = FindChannel(fd);
+	if (channel == nullptr)
+		return;
+
+	std::lock_guard<std::mutex> lg(channel->channelMutex);
+	for (Operation** pending : { &channel->readOperation, &channel->writeOperation })
+	{
+		if (*pending != nullptr)
+		{
+			PostCompletion({ channel->key, *pending, 0, CompletionStatus::Aborted }, true);
+			*pending = nullptr;
+		}
+	}
+}
+
+bool sab::EpollCompletionQueue::Dequeue(CompletionPacket* packet)
+{
+	epoll_event events[MAX_EVENTS];
+
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> lg(readyMutex);
+			if (closed)
+				return false;
+			if (!readyList.empty())
+			{
+				*packet = readyList.front();
+				readyList.pop_front();
+				if (!readyList.empty())
+					Wake(); // let another worker take the rest
+				return true;
+			}
+		}
+
+		int count = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+		if (count == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			LogDebug(L"epoll_wait failed! ", strerror(errno));
+			return false;
+		}
+		for (int i = 0; i < count; ++i)
+		{
+			if (events[i].data.fd == wakeFd)
+			{
+				uint64_t value;
+				if (!closed && read(wakeFd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+				{
+					LogDebug(L"cannot read eventfd! ", strerror(errno));
+				}
+				continue;
+			}
+			ProcessEvent(events[i].data.fd, events[i].events);
+		}
+	}
+}
+
+void sab::EpollCompletionQueue::Close()
+{
+	if (!closed.exchange(true) && wakeFd != -1)
+	{
+		uint64_t value = 1;
+		if (write(wakeFd, &value, sizeof(value)) == -1)
+		{
+			LogDebug(L"cannot signal eventfd! ", strerror(errno));
+		}
+	}
+}
+
+std::shared_ptr<sab::EpollCompletionQueue::Channel> sab::EpollCompletionQueue::FindChannel(int fd)
+{
+	std::lock_guard<std::mutex> lg(mapMutex);
+	auto it = channelMap.find(fd);
+	if (it == channelMap.end())
+		return nullptr;
+	return it->second;
+}
+
+bool sab::EpollCompletionQueue::StartOperation(int fd, Operation* operation, bool isWrite)
+{
+	auto channel = FindChannel(fd);
+	if (channel == nullptr)
+		return false;
+
+	// the lock orders this attempt against ProcessEvent, an edge
+	// reported meanwhile finds the operation pending and retries it
+	std::lock_guard<std::mutex> lg(channel->channelMutex);
+	Operation*& pending = isWrite ? channel->writeOperation : channel->readOperation;
+	if (pending != nullptr)
+		return false;
+	if (!TryOperation(*channel, operation, isWrite, true))
+		pending = operation;
+	return true;
+}
+
+bool sab::EpollCompletionQueue::TryOperation(Channel& channel, Operation* operation,
+	bool isWrite, bool wake)
+{
+	msghdr message{};
+	message.msg_iov = operation->buffers;
+	message.msg_iovlen = operation->bufferCount;
+
+	ssize_t result;
+	do
+	{
+		result = isWrite
+			? sendmsg(channel.fd, &message, MSG_NOSIGNAL)
+			: recvmsg(channel.fd, &message, 0);
+	} while (result == -1 && errno == EINTR);
+
+	if (result >= 0)
+	{
+		PostCompletion({ channel.key, operation, static_cast<uint32_t>(result), CompletionStatus::Success }, wake);
+		return true;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return false;
+
+	if (errno == ECONNRESET || errno == EPIPE)
+	{
+		LogDebug(L"remote unexpectedly closed socket.");
+		PostCompletion({ channel.key, operation, 0, CompletionStatus::Disconnected }, wake);
+	}
+	else
+	{
+		LogDebug(L"i/o operation failed! ", strerror(errno));
+		PostCompletion({ channel.key, operation, 0, CompletionStatus::Failed }, wake);
+	}
+	return true;
+}
+
+void sab::EpollCompletionQueue::ProcessEvent(int fd, uint32_t events)
+{
+	auto channel = FindChannel(fd);
+	if (channel == nullptr)
+		return;
+
+	// runs on a worker inside Dequeue, which takes the completions
+	// itself and wakes others only for the surplus
+	std::lock_guard<std::mutex> lg(channel->channelMutex);
+	if (channel->readOperation != nullptr
+		&& (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		&& TryOperation(*channel, channel->readOperation, false, false))
+	{
+		channel->readOperation = nullptr;
+	}
+	if (channel->writeOperation != nullptr
+		&& (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+		&& TryOperation(*channel, channel->writeOperation, true, false))
+	{
+		channel->writeOperation = nullptr;
+	}
+}
+
+void sab::EpollCompletionQueue::PostCompletion(const CompletionPacket& packet, bool wake)
+{
+	std::lock_guard<std::mutex> lg(readyMutex);
+	readyList.push_back(packet);
+	if (wake)
+		Wake();
+}
+
+void sab::EpollCompletionQueue::Wake()
+{
+	uint64_t value = 1;
+	if (write(wakeFd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+	{
+		LogDebug(L"cannot signal eventfd! ", strerror(errno));
+	}
+}
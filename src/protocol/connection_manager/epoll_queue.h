@@ -0,0 +1,133 @@
+#pragma once
+
+#include "../../completion_queue.h"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/uio.h>
+
+namespace sab
+{
+	/**
+	 * @brief ICompletionQueue on top of epoll, so code written against the
+	 * completion model of IocpCompletionQueue runs unchanged on Linux.
+	 *
+	 * An operation is tried right away and, if the socket is not ready,
+	 * again each time epoll reports readiness. Like i/o completion ports,
+	 * every operation is reported by Dequeue exactly once, also when it
+	 * finished immediately or was cancelled.
+	 */
+	class EpollCompletionQueue
+		:public ICompletionQueue
+	{
+	public:
+		/**
+		 * @brief pending operation, the OVERLAPPED of this queue.
+		 * owned by the caller and reported as CompletionPacket::overlapped
+		 */
+		struct Operation
+		{
+			iovec buffers[2];
+			int bufferCount;
+		};
+	private:
+		struct Channel
+		{
+			int fd;
+			uintptr_t key;
+			std::mutex channelMutex;
+			Operation* readOperation;
+			Operation* writeOperation;
+		};
+
+		static constexpr int MAX_EVENTS = 16;
+
+		int epollFd;
+
+		/**
+		 * @brief eventfd waking Dequeue for queued completions and Close
+		 */
+		int wakeFd;
+
+		std::atomic<bool> closed;
+
+		std::unordered_map<int, std::shared_ptr<Channel>> channelMap;
+
+		std::mutex mapMutex;
+
+		/**
+		 * @brief finished operations not dequeued yet
+		 */
+		std::deque<CompletionPacket> readyList;
+
+		std::mutex readyMutex;
+	public:
+		EpollCompletionQueue();
+
+		EpollCompletionQueue(const EpollCompletionQueue&) = delete;
+		EpollCompletionQueue& operator=(const EpollCompletionQueue&) = delete;
+
+		~EpollCompletionQueue();
+
+		/**
+		 * @brief create the epoll instance
+		 * @return true for success
+		 */
+		bool Create();
+
+		/**
+		 * @brief associate a non-blocking stream socket with the queue
+		 * @param fd the socket
+		 * @param key completion key reported for operations on the socket
+		 * @return true for success
+		 */
+		bool Associate(int fd, uintptr_t key);
+
+		/**
+		 * @brief remove the socket from the queue, call when no operation is pending
+		 */
+		void Disassociate(int fd);
+
+		/**
+		 * @brief receive into the buffers of operation, at most one read may be pending
+		 * @return false if the read cannot be started
+		 */
+		bool Read(int fd, Operation* operation);
+
+		/**
+		 * @brief send the buffers of operation, at most one write may be pending
+		 * @return false if the write cannot be started
+		 */
+		bool Write(int fd, Operation* operation);
+
+		/**
+		 * @brief complete pending operations of the socket as aborted
+		 */
+		void Cancel(int fd);
+
+		bool Dequeue(CompletionPacket* packet)override;
+
+		void Close()override;
+	private:
+		std::shared_ptr<Channel> FindChannel(int fd);
+
+		bool StartOperation(int fd, Operation* operation, bool isWrite);
+
+		/**
+		 * @brief try the operation once, channel lock held
+		 * @param wake wake a worker for the completion
+		 * @return false if the socket is not ready
+		 */
+		bool TryOperation(Channel& channel, Operation* operation, bool isWrite, bool wake);
+
+		void ProcessEvent(int fd, uint32_t events);
+
+		void PostCompletion(const CompletionPacket& packet, bool wake);
+
+		void Wake();
+	};
+}
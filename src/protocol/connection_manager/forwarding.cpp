@@ -9,6 +9,7 @@
 
 bool sab::Gpg4WinForwardConnectionManager::Initialize()
 {
+	memset(&idleCheckOverlapped, 0, sizeof(idleCheckOverlapped));
 	initialized = true;
 	return true;
 }
@@ -33,6 +34,19 @@ bool sab::Gpg4WinForwardConnectionManager::Start()
 	{
 		return false;
 	}
+	// contexts are only touched on iocp thread, hand them over
+	if (!idleReaper.Start([this](std::shared_ptr<IoContext> context)
+		{
+			{
+				std::lock_guard<std::mutex> lg(idleMutex);
+				idleCandidates.emplace_back(std::move(context));
+			}
+			PostQueuedCompletionStatus(iocpHandle, 0, 0, &idleCheckOverlapped);
+		}))
+	{
+		LogError(L"cannot start idle reaper!");
+		return false;
+	}
 	return true;
 }
 
@@ -40,6 +54,8 @@ void sab::Gpg4WinForwardConnectionManager::Stop()
 {
 	if (!initialized)return;
 	cancelFlag = true;
+	connectionLimiter.Cancel();
+	idleReaper.Stop();
 	if (iocpHandle) {
 		CloseHandle(iocpHandle);
 		iocpHandle = NULL;
@@ -51,12 +67,23 @@ void sab::Gpg4WinForwardConnectionManager::Stop()
 bool sab::Gpg4WinForwardConnectionManager::DelegateConnection(HANDLE connection,
 	std::shared_ptr<ProtocolListenerBase> listener, std::shared_ptr<ListenerConnectionData> data, bool isSocket)
 {
-	auto context = std::make_shared<ForwardIoContext>();
+	// blocks the listener while it is at its limit
+	if (!connectionLimiter.Acquire(listener.get(), [this, &listener]()
+		{
+			return cancelFlag || listener->IsCancelled();
+		}))
+	{
+		return false;
+	}
+
+	// contexts embed their buffers, reuse warm memory of closed connections
+	auto context = std::allocate_shared<ForwardIoContext>(PoolAllocator<ForwardIoContext>());
 
 	if (!CreateIoCompletionPort(connection, iocpHandle,
 		reinterpret_cast<ULONG_PTR>(std::static_pointer_cast<IoContext>(context).get()), 0))
 	{
 		LogDebug(L"cannot associate handle to completion port! ", LogLastError);
+		connectionLimiter.Release(listener.get());
 		return false;
 	}
 	LogDebug(L"delegated connection to manager: ", connection);
@@ -73,6 +100,7 @@ bool sab::Gpg4WinForwardConnectionManager::DelegateConnection(HANDLE connection,
 		contextList.emplace_front(context);
 		context->selfIter = contextList.begin();
 	}
+	idleReaper.Watch(context);
 	DoIoCompletion(context, 0, nullptr);
 	return true;
 }
@@ -85,15 +113,64 @@ void sab::Gpg4WinForwardConnectionManager::SetTarget(std::shared_ptr<ProtocolLis
 
 void sab::Gpg4WinForwardConnectionManager::RemoveContext(IoContext* context)
 {
+	connectionLimiter.Release(context->listener.get());
+
 	std::lock_guard<std::mutex> lg(listMutex);
 	contextList.erase(context->selfIter);
 }
 
+void sab::Gpg4WinForwardConnectionManager::SetIdleTimeout(std::chrono::milliseconds timeout)
+{
+	idleReaper.SetTimeout(timeout);
+}
+
+void sab::Gpg4WinForwardConnectionManager::SetConnectionLimit(
+	const std::shared_ptr<ProtocolListenerBase>& listener, size_t limit)
+{
+	connectionLimiter.SetLimit(listener.get(), limit);
+}
+
+size_t sab::Gpg4WinForwardConnectionManager::GetActiveCount()
+{
+	std::lock_guard<std::mutex> lg(listMutex);
+	return contextList.size();
+}
+
+uint64_t sab::Gpg4WinForwardConnectionManager::GetForwardedBytes()const
+{
+	return forwardedBytes.load(std::memory_order_relaxed);
+}
+
+void sab::Gpg4WinForwardConnectionManager::CheckIdleContexts()
+{
+	std::vector<std::shared_ptr<IoContext>> candidates;
+	{
+		std::lock_guard<std::mutex> lg(idleMutex);
+		candidates.swap(idleCandidates);
+	}
+	for (auto& c : candidates)
+	{
+		auto context = std::static_pointer_cast<ForwardIoContext>(c);
+		if (context->contextState == ForwardIoContext::ContextState::Destroyed)
+			continue;
+		if (idleReaper.IsIdle(*context))
+		{
+			LogInfo(L"closing idle forward connection ", static_cast<IoContext*>(context.get()));
+			context->Dispose();
+		}
+		else
+		{
+			idleReaper.Watch(context);
+		}
+	}
+}
+
 void sab::Gpg4WinForwardConnectionManager::IocpThreadProc()
 {
 	OVERLAPPED* overlapped;
 	DWORD bytes;
 	IoContext* context;
+	BOOL result;
 
 	LogDebug(L"started iocp thread");
 
@@ -102,38 +179,67 @@ void sab::Gpg4WinForwardConnectionManager::IocpThreadProc()
 		overlapped = nullptr;
 		context = nullptr;
 		bytes = 0;
-		if (GetQueuedCompletionStatus(iocpHandle, &bytes,
-			reinterpret_cast<PULONG_PTR>(&context), &overlapped, INFINITE) == FALSE)
+		result = GetQueuedCompletionStatus(iocpHandle, &bytes,
+			reinterpret_cast<PULONG_PTR>(&context), &overlapped, INFINITE);
+		if (overlapped == nullptr)
 		{
-			// error
-			if (GetLastError() == ERROR_OPERATION_ABORTED)
-			{
-				// cancelled operation
-			}
-			else if (GetLastError() == ERROR_BROKEN_PIPE)
-			{
-				LogDebug(L"remote unexpectedly closed pipe.");
-				// dispose context
-				if (context)
-					context->Dispose();
-			}
-			else if (GetLastError() == ERROR_ABANDONED_WAIT_0)
+			// nothing dequeued
+			if (GetLastError() == ERROR_ABANDONED_WAIT_0)
 			{
 				LogDebug(L"completion port closed.");
 				break;
 			}
-			else {
-				LogDebug(L"GetQueuedCompletionStatus failed! ", LogLastError);
-				if (context)
-					context->Dispose();
+			LogDebug(L"GetQueuedCompletionStatus failed! ", LogLastError);
+			continue;
+		}
+		if (overlapped == &idleCheckOverlapped)
+		{
+			CheckIdleContexts();
+			continue;
+		}
+		if (context == nullptr)
+			continue;
+
+		// a context stays in the context list until all its operations
+		// completed, including the cancelled ones
+		auto ctx = std::static_pointer_cast<ForwardIoContext>(context->shared_from_this());
+		bool ownOperation = false;
+		for (size_t i = 0; i < ForwardIoContext::PEER_COUNT; ++i)
+		{
+			if (overlapped == &ctx->overlapped[i])
+			{
+				ctx->ioPending[i] = false;
+				ownOperation = true;
 			}
 		}
-		else
+		if (!ownOperation)
 		{
-			auto ctx = std::static_pointer_cast<ForwardIoContext>(context->shared_from_this());
+			// issued by the listener during handshake
+			ctx->handshakeIoPending = false;
+		}
+		ctx->Touch();
 
-			DoIoCompletion(std::move(ctx), bytes, overlapped);
+		if (ctx->contextState == ForwardIoContext::ContextState::Destroyed)
+		{
+			ctx->ReleaseIfIdle();
+			continue;
+		}
+		if (result == FALSE)
+		{
+			// error
+			if (GetLastError() == ERROR_BROKEN_PIPE)
+			{
+				LogDebug(L"remote unexpectedly closed pipe.");
+			}
+			else
+			{
+				LogDebug(L"i/o operation failed! ", LogLastError);
+			}
+			ctx->Dispose();
+			continue;
 		}
+
+		DoIoCompletion(std::move(ctx), bytes, overlapped);
 	}
 }
 
@@ -150,7 +256,12 @@ void sab::Gpg4WinForwardConnectionManager::DoIoCompletion(
 		LogDebug(L"doing handshake for context ", static_cast<IoContext*>(context.get()));
 		managedListener = dynamic_cast<IManagedListener*>(context->listener.get());
 		if (!managedListener->DoHandshake(context, transferred))
+		{
+			// not finished, the listener issued next operation unless it failed
+			context->handshakeIoPending =
+				context->contextState != ForwardIoContext::ContextState::Destroyed;
 			return;
+		}
 		LogDebug(L"handshake done for context ", static_cast<IoContext*>(context.get()));
 		if (!PreparePeer(*context))
 		{
@@ -207,6 +318,7 @@ void sab::Gpg4WinForwardConnectionManager::DoForward(std::shared_ptr<ForwardIoCo
 			context->Dispose();
 			return;
 		}
+		context->ioPending[peerIdx] = true;
 		context->state[peerIdx] = ForwardIoContext::State::Read;
 		break;
 	case ForwardIoContext::State::Read:
@@ -240,8 +352,10 @@ void sab::Gpg4WinForwardConnectionManager::DoForward(std::shared_ptr<ForwardIoCo
 			context->Dispose();
 			return;
 		}
+		context->ioPending[peerIdx] = true;
 		break;
 	case ForwardIoContext::State::Write:
+		forwardedBytes.fetch_add(transferred, std::memory_order_relaxed);
 		context->needTransfer[peerIdx] -= transferred;
 		if (context->needTransfer[peerIdx] > 0)
 		{
@@ -255,6 +369,7 @@ void sab::Gpg4WinForwardConnectionManager::DoForward(std::shared_ptr<ForwardIoCo
 				context->Dispose();
 				return;
 			}
+			context->ioPending[peerIdx] = true;
 		}
 		else
 		{
@@ -339,7 +454,10 @@ sab::ForwardIoContext::ForwardIoContext()
 		state[i] = State::Initialized;
 		needTransfer[i] = 0;
 		bufferOffset[i] = 0;
+		ioPending[i] = false;
 	}
+	handshakeIoPending = false;
+	released = false;
 }
 
 sab::ForwardIoContext::~ForwardIoContext()
@@ -369,6 +487,25 @@ void sab::ForwardIoContext::Dispose()
 				CancelIoEx(ioHandle[i], nullptr);
 			}
 		}
-		owner->RemoveContext(this);
+		if (handle != INVALID_HANDLE_VALUE) {
+			// still in handshake
+			CancelIoEx(handle, nullptr);
+		}
+		// pending operations complete as aborted,
+		// the context leaves the list after the last one
+		ReleaseIfIdle();
+	}
+}
+
+void sab::ForwardIoContext::ReleaseIfIdle()
+{
+	if (contextState != ContextState::Destroyed || released || handshakeIoPending)
+		return;
+	for (size_t i = 0; i < PEER_COUNT; ++i)
+	{
+		if (ioPending[i])
+			return;
 	}
+	released = true;
+	owner->RemoveContext(this);
 }
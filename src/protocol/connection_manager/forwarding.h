@@ -3,6 +3,8 @@
 
 
 #include "../connection_manager.h"
+#include "../../idle_reaper.h"
+#include "../../connection_limiter.h"
 
 #include <string>
 #include <vector>
@@ -44,11 +46,19 @@ namespace sab
 		char buffer[PEER_COUNT][MAX_BUFFER_SIZE];
 		ptrdiff_t needTransfer[PEER_COUNT];
 		ptrdiff_t bufferOffset[PEER_COUNT];
+		// operation on overlapped[i] not completed yet
+		bool ioPending[PEER_COUNT];
+		// the listener has a handshake operation pending
+		bool handshakeIoPending;
+		bool released;
 
 		ForwardIoContext();
 		~ForwardIoContext();
 
 		void Dispose() override;
+
+		// remove a destroyed context from the list once no i/o is pending
+		void ReleaseIfIdle();
 	};
 
 	class Gpg4WinForwardConnectionManager
@@ -67,11 +77,25 @@ namespace sab
 
 		std::thread iocpThread;
 
-		std::list<std::shared_ptr<IoContext>> contextList;
+		IoContextList contextList;
 
 		bool initialized;
 
 		std::mutex listMutex;
+
+		IdleReaper<IoContext> idleReaper;
+
+		ConnectionLimiter connectionLimiter;
+
+		// posted to the completion port to check idleCandidates on iocp thread
+		OVERLAPPED idleCheckOverlapped;
+
+		std::vector<std::shared_ptr<IoContext>> idleCandidates;
+
+		std::mutex idleMutex;
+
+		// bytes written to either peer
+		std::atomic<uint64_t> forwardedBytes{ 0 };
 	public:
 		bool Initialize() override;
 		bool Start() override;
@@ -86,7 +110,18 @@ namespace sab
 		~Gpg4WinForwardConnectionManager() = default;
 
 		void RemoveContext(IoContext* context) override;
+
+		void SetIdleTimeout(std::chrono::milliseconds timeout) override;
+
+		void SetConnectionLimit(const std::shared_ptr<ProtocolListenerBase>& listener,
+			size_t limit) override;
+
+		size_t GetActiveCount() override;
+
+		uint64_t GetForwardedBytes()const;
 	private:
+		void CheckIdleContexts();
+
 		void IocpThreadProc();
 
 		void DoIoCompletion(std::shared_ptr<ForwardIoContext> context, DWORD transferred, LPOVERLAPPED ioOverlapped);
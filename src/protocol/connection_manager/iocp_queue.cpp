@@ -0,0 +1,92 @@
+#include "../../log.h"
+#include "../../util.h"
+#include "iocp_queue.h"
+
+sab::IocpCompletionQueue::IocpCompletionQueue()
+	:iocpHandle(NULL), closed(false)
+{
+}
+
+sab::IocpCompletionQueue::~IocpCompletionQueue()
+{
+	Close();
+}
+
+bool sab::IocpCompletionQueue::Create()
+{
+	iocpHandle = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	if (iocpHandle == NULL)
+	{
+		LogError(L"cannot create completion port! ", LogLastError);
+		return false;
+	}
+	closed = false;
+	return true;
+}
+
+bool sab::IocpCompletionQueue::Associate(HANDLE handle, uintptr_t key)
+{
+	return CreateIoCompletionPort(handle, iocpHandle, static_cast<ULONG_PTR>(key), 0) != NULL;
+}
+
+bool sab::IocpCompletionQueue::Dequeue(CompletionPacket* packet)
+{
+	OVERLAPPED* overlapped = nullptr;
+	ULONG_PTR key = 0;
+	DWORD bytes = 0;
+
+	if (closed)
+		return false;
+
+	BOOL result = GetQueuedCompletionStatus(iocpHandle, &bytes, &key, &overlapped, INFINITE);
+
+	packet->key = static_cast<uintptr_t>(key);
+	packet->overlapped = overlapped;
+	packet->transferred = bytes;
+	if (result != FALSE)
+	{
+		packet->status = CompletionStatus::Success;
+		return true;
+	}
+
+	DWORD error = GetLastError();
+	if (overlapped == nullptr)
+	{
+		// nothing dequeued, the port itself is unusable
+		if (error == ERROR_ABANDONED_WAIT_0 || closed)
+		{
+			LogDebug(L"completion port closed.");
+		}
+		else
+		{
+			LogDebug(L"GetQueuedCompletionStatus failed! ", LogLastError);
+		}
+		return false;
+	}
+
+	if (error == ERROR_OPERATION_ABORTED)
+	{
+		packet->status = CompletionStatus::Aborted;
+	}
+	else if (error == ERROR_BROKEN_PIPE)
+	{
+		LogDebug(L"remote unexpectedly closed pipe.");
+		packet->status = CompletionStatus::Disconnected;
+	}
+	else
+	{
+		LogDebug(L"i/o operation failed! ", LogLastError);
+		packet->status = CompletionStatus::Failed;
+	}
+	return true;
+}
+
+void sab::IocpCompletionQueue::Close()
+{
+	// closing the port wakes every thread blocked in GetQueuedCompletionStatus,
+	// the handle value is kept so racing callers fail instead of reading NULL
+	if (!closed.exchange(true) && iocpHandle != NULL)
+	{
+		CloseHandle(iocpHandle);
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "../../completion_queue.h"
+
+#include <atomic>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+namespace sab
+{
+	/**
+	 * @brief ICompletionQueue backed by an i/o completion port
+	 */
+	class IocpCompletionQueue
+		:public ICompletionQueue
+	{
+	private:
+		/**
+		 * @brief completion port handle
+		 */
+		HANDLE iocpHandle;
+
+		std::atomic<bool> closed;
+	public:
+		IocpCompletionQueue();
+
+		IocpCompletionQueue(const IocpCompletionQueue&) = delete;
+		IocpCompletionQueue& operator=(const IocpCompletionQueue&) = delete;
+
+		~IocpCompletionQueue();
+
+		/**
+		 * @brief create the completion port
+		 * @return true for success
+		 */
+		bool Create();
+
+		/**
+		 * @brief associate a handle with the port
+		 * @param handle file or socket handle opened for overlapped i/o
+		 * @param key completion key reported for operations on the handle
+		 * @return true for success
+		 */
+		bool Associate(HANDLE handle, uintptr_t key);
+
+		bool Dequeue(CompletionPacket* packet)override;
+
+		void Close()override;
+	};
+}
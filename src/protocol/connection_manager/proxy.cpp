@@ -26,8 +26,6 @@ static constexpr const wchar_t* IoContextStateToString(sab::ProxyIoContext::Stat
 		return L"ReadBody";
 	case State::ReadHeader:
 		return L"ReadHeader";
-	case State::WriteReply:
-		return L"WriteReply";
 	case State::WaitReply:
 		return L"WaitReply";
 	case State::Ready:
@@ -38,10 +36,10 @@ static constexpr const wchar_t* IoContextStateToString(sab::ProxyIoContext::Stat
 }
 
 sab::ProxyIoContext::ProxyIoContext()
-	:state(State::Initialized),
-	ioDataOffset(0), ioBufferOffset(0)
+	:pendingIo(0), handshakeIoPending(false), released(false)
 {
 	memset(&overlapped, 0, sizeof(overlapped));
+	memset(&writeOverlapped, 0, sizeof(writeOverlapped));
 }
 
 sab::ProxyIoContext::~ProxyIoContext()
@@ -54,19 +52,28 @@ sab::ProxyIoContext::~ProxyIoContext()
 
 void sab::ProxyIoContext::Dispose()
 {
-	// potential data race here
-	if (state != State::Destroyed) {
-		state = State::Destroyed;
+	// only called on executor, no concurrent transition possible
+	if (session.state != State::Destroyed) {
+		session.SetState(State::Destroyed);
 		LogDebug(L"terminating connection: ", handle);
-		// any pending io operation will be cancelled after close
-		// we can safely clean the context out of the list
+		// pending io operations complete as aborted,
+		// the context leaves the list after the last one
 		CancelIoEx(handle, nullptr);
+		ReleaseIfIdle();
+	}
+}
+
+void sab::ProxyIoContext::ReleaseIfIdle()
+{
+	if (session.state == State::Destroyed && pendingIo == 0 && !handshakeIoPending && !released)
+	{
+		released = true;
 		owner->RemoveContext(this);
 	}
 }
 
 sab::ProxyConnectionManager::ProxyConnectionManager()
-	:cancelFlag(false), iocpHandle(NULL), initialized(false)
+	:cancelFlag(false), workerCount(DEFAULT_WORKER_COUNT), initialized(false)
 {
 }
 
@@ -83,25 +90,39 @@ bool sab::ProxyConnectionManager::Initialize()
 	return true;
 }
 
+bool sab::ProxyConnectionManager::SetWorkerCount(size_t count)
+{
+	if (count == 0 || count > CompletionWorkerPool::MAX_WORKER_COUNT)
+		return false;
+	workerCount = count;
+	return true;
+}
+
 bool sab::ProxyConnectionManager::Start()
 {
 	if (!initialized)return false;
-	iocpHandle = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-	if (iocpHandle == NULL) {
-		LogError(L"cannot create completion port!");
+	if (!completionQueue.Create())
+	{
 		return false;
 	}
-	try
+	if (!workerPool.Start(&completionQueue, workerCount,
+		[this](const CompletionPacket& packet)
+		{
+			HandleCompletion(packet);
+		}))
 	{
-		iocpThread = std::thread([this]()
-			{
-				IocpThreadProc();
-			});
+		LogError(L"cannot start completion workers!");
+		return false;
 	}
-	catch (...)
+	if (!idleReaper.Start([this](std::shared_ptr<IoContext> context)
+		{
+			CheckIdleContext(std::static_pointer_cast<ProxyIoContext>(context));
+		}))
 	{
+		LogError(L"cannot start idle reaper!");
 		return false;
 	}
+	LogDebug(L"started ", workerCount, L" completion workers");
 	return true;
 }
 
@@ -109,12 +130,11 @@ void sab::ProxyConnectionManager::Stop()
 {
 	if (!initialized)return;
 	cancelFlag = true;
-	if (iocpHandle) {
-		CloseHandle(iocpHandle);
-		iocpHandle = NULL;
-	}
-	if (iocpThread.joinable())
-		iocpThread.join();
+	connectionLimiter.Cancel();
+	idleReaper.Stop();
+	// closes the completion port and joins workers
+	workerPool.Stop();
+	completionQueue.Close();
 }
 
 bool sab::ProxyConnectionManager::DelegateConnection(
@@ -123,12 +143,23 @@ bool sab::ProxyConnectionManager::DelegateConnection(
 	std::shared_ptr<ListenerConnectionData> data,
 	bool isSocket)
 {
-	auto context = std::make_shared<ProxyIoContext>();
+	// blocks the listener while it is at its limit
+	if (!connectionLimiter.Acquire(listener.get(), [this, &listener]()
+		{
+			return cancelFlag || listener->IsCancelled();
+		}))
+	{
+		return false;
+	}
+
+	// reuse warm memory of closed connections
+	auto context = std::allocate_shared<ProxyIoContext>(PoolAllocator<ProxyIoContext>());
 
-	if (!CreateIoCompletionPort(connection, iocpHandle,
-		reinterpret_cast<ULONG_PTR>(std::static_pointer_cast<IoContext>(context).get()), 0))
+	if (!completionQueue.Associate(connection,
+		reinterpret_cast<uintptr_t>(std::static_pointer_cast<IoContext>(context).get())))
 	{
 		LogDebug(L"cannot associate handle to completion port! ", LogLastError);
+		connectionLimiter.Release(listener.get());
 		return false;
 	}
 	LogDebug(L"delegated connection to manager: ", connection);
@@ -136,25 +167,19 @@ bool sab::ProxyConnectionManager::DelegateConnection(
 	context->listener = listener;
 	context->listenerData = data;
 	context->handleType = isSocket ? IoContext::HandleType::SocketHandle : IoContext::HandleType::FileHandle;
-	context->state = ProxyIoContext::State::Handshake;
+	// pipes have no gather write
+	context->session.gatherWrite = isSocket;
+	context->session.SetState(ProxyIoContext::State::Handshake);
 
 	context->owner = shared_from_this();
 
-	std::weak_ptr<IoContext> weakContext(context);
-	context->message.replyCallback = [this, weakContext](SshMessageEnvelope* message, bool status)
-	{
-		auto strongContext = weakContext.lock();
-		if (strongContext == nullptr)
-			return; // context destroyed
-		PostMessageReply(strongContext, message, status);
-	};
-
 	{
 		std::lock_guard<std::mutex> lg(listMutex);
 		contextList.emplace_front(context);
 		context->selfIter = contextList.begin();
 	}
-	DoIoCompletion(context, 0);
+	idleReaper.Watch(context);
+	ScheduleIoCompletion(context, 0);
 	return true;
 }
 
@@ -165,220 +190,307 @@ void sab::ProxyConnectionManager::SetEmitMessageCallback(std::function<void(SshM
 
 void sab::ProxyConnectionManager::RemoveContext(IoContext* context)
 {
+	// called on the context's executor, keep its idle requests for
+	// later connections, pending ones may still be held by the dispatcher
+	std::vector<std::unique_ptr<ProxyRequest>> requests;
+	static_cast<ProxyIoContext*>(context)->session.ReleaseRequests(requests);
+	requestPool.Recycle(requests);
+
+	connectionLimiter.Release(context->listener.get());
+
 	std::lock_guard<std::mutex> lg(listMutex);
 	contextList.erase(context->selfIter);
 }
 
-void sab::ProxyConnectionManager::IocpThreadProc()
+void sab::ProxyConnectionManager::SetIdleTimeout(std::chrono::milliseconds timeout)
 {
-	OVERLAPPED* overlapped;
-	DWORD bytes;
-	IoContext* context;
+	idleReaper.SetTimeout(timeout);
+}
+
+void sab::ProxyConnectionManager::SetConnectionLimit(
+	const std::shared_ptr<ProtocolListenerBase>& listener, size_t limit)
+{
+	connectionLimiter.SetLimit(listener.get(), limit);
+}
 
-	LogDebug(L"started iocp thread");
+size_t sab::ProxyConnectionManager::GetActiveCount()
+{
+	std::lock_guard<std::mutex> lg(listMutex);
+	return contextList.size();
+}
 
-	while (!cancelFlag)
+void sab::ProxyConnectionManager::HandleCompletion(const CompletionPacket& packet)
+{
+	IoContext* context = reinterpret_cast<IoContext*>(packet.key);
+	if (context == nullptr)
 	{
-		overlapped = nullptr;
-		context = nullptr;
-		bytes = 0;
-		if (GetQueuedCompletionStatus(iocpHandle, &bytes,
-			reinterpret_cast<PULONG_PTR>(&context), &overlapped, INFINITE) == FALSE)
+		return;
+	}
+
+	// a context stays in the context list until all its operations
+	// completed, including the cancelled ones
+	auto proxyContext = std::static_pointer_cast<ProxyIoContext>(context->shared_from_this());
+	proxyContext->executor.Execute([this, proxyContext, packet]()
 		{
-			// error
-			if (GetLastError() == ERROR_OPERATION_ABORTED)
-			{
-				// cancelled operation
-			}
-			else if (GetLastError() == ERROR_BROKEN_PIPE) {
-				LogDebug(L"remote unexpectedly closed pipe.");
-				// dispose context
-				if (context)
-					context->Dispose();
-			}
-			else if (GetLastError() == ERROR_ABANDONED_WAIT_0)
+			ProcessCompletion(proxyContext, packet);
+		});
+}
+
+void sab::ProxyConnectionManager::ProcessCompletion(const std::shared_ptr<ProxyIoContext>& context,
+	const CompletionPacket& packet)
+{
+	bool isWrite = packet.overlapped == &context->writeOverlapped;
+	if (isWrite || packet.overlapped == &context->overlapped)
+	{
+		--context->pendingIo;
+	}
+	else
+	{
+		// issued by the listener during handshake
+		context->handshakeIoPending = false;
+	}
+	context->Touch();
+
+	if (context->session.state == ProxyIoContext::State::Destroyed)
+	{
+		context->ReleaseIfIdle();
+		return;
+	}
+	if (packet.status != CompletionStatus::Success)
+	{
+		context->Dispose();
+		return;
+	}
+
+	if (isWrite)
+		DoWriteCompletion(context, packet.transferred);
+	else
+		DoIoCompletion(context, packet.transferred);
+}
+
+void sab::ProxyConnectionManager::ScheduleIoCompletion(const std::shared_ptr<ProxyIoContext>& context, DWORD transferred)
+{
+	context->executor.Execute([this, context, transferred]()
+		{
+			DoIoCompletion(context, transferred);
+		});
+}
+
+void sab::ProxyConnectionManager::CheckIdleContext(const std::shared_ptr<ProxyIoContext>& context)
+{
+	context->executor.Execute([this, context]()
+		{
+			if (context->session.state == ProxyIoContext::State::Destroyed)
+				return;
+			// a connection waiting for upstream replies is busy, not idle
+			if (context->session.pendingRequests.empty() && idleReaper.IsIdle(*context))
 			{
-				LogDebug(L"completion port closed.");
-				break;
-			}
-			else {
-				LogDebug(L"GetQueuedCompletionStatus failed! ", LogLastError);
-				if (context)
-					context->Dispose();
+				LogInfo(L"closing idle connection ", context->handle,
+					L" in state ", IoContextStateToString(context->session.state));
+				context->Dispose();
+				return;
 			}
-		}
-		else
-		{
-			DoIoCompletion(std::static_pointer_cast<ProxyIoContext>(context->shared_from_this()), bytes);
-		}
-	}
+			idleReaper.Watch(context);
+		});
 }
 
 void sab::ProxyConnectionManager::DoIoCompletion(std::shared_ptr<ProxyIoContext> context, DWORD transferred)
 {
-	BOOL result;
-	uint32_t beLength;
-	int writeLength;
-	int readLength;
 	IManagedListener* managedListener;
+	ProxySession& session = context->session;
 
-	LogDebug(L"current state: ", IoContextStateToString(context->state));
-	switch (context->state)
+	LogDebug(L"current state: ", IoContextStateToString(session.state));
+	switch (session.state)
 	{
 	case ProxyIoContext::State::Handshake:
 		managedListener = dynamic_cast<IManagedListener*>(context->listener.get());
 		assert(managedListener != nullptr);
-		if (!managedListener->DoHandshake(context, transferred))return;
+		if (!managedListener->DoHandshake(context, transferred))
+		{
+			// not finished, the listener issued next operation unless it failed
+			context->handshakeIoPending = session.state != ProxyIoContext::State::Destroyed;
+			return;
+		}
 	case ProxyIoContext::State::Ready:
-		context->state = ProxyIoContext::State::ReadHeader;
-		context->ioNeedBytes = HEADER_SIZE;
-		context->message.data.clear();
-
-		result = ReadFile(context->handle, context->ioBuffer,
-			HEADER_SIZE, NULL, &context->overlapped);
-		if (result == FALSE && GetLastError() != ERROR_IO_PENDING)
+		session.BeginRead(AcquireRequest(context));
+		if (!ContinueRead(context.get()))
 		{
 			context->Dispose();
-			return;
 		}
-		break;
+		return;
 	case ProxyIoContext::State::ReadHeader:
-		context->state = ProxyIoContext::State::ReadBody;
-		context->ioNeedBytes -= transferred;
+	case ProxyIoContext::State::ReadBody:
+		break;
+	default:
+		LogDebug(L"illegal status for pipe context!");
+		context->Dispose();
+		return;
+	}
 
-		// Check transferred length
-		if (context->ioNeedBytes != 0)
+	switch (session.OnRead(transferred))
+	{
+	case ProxySession::ReadResult::Continue:
+		if (!ContinueRead(context.get()))
 		{
 			context->Dispose();
-			return;
 		}
-
-		// tweak byte order
-		memcpy(&beLength, context->ioBuffer, HEADER_SIZE);
-		context->message.length = ntohl(beLength);
-
-		if (context->message.length > MAX_MESSAGE_SIZE)
+		break;
+	case ProxySession::ReadResult::Dispatch:
+	{
+		ProxyRequest* request = session.pendingRequests.back().get();
+		LogDebug(L"recv message: length=", request->message.length, L", type=0x",
+			std::hex, std::setfill(L'0'), std::setw(2), request->message.data[0]);
+		receiveCallback(&request->message, context);
+		if (session.state == ProxyIoContext::State::Ready)
 		{
-			LogDebug(L"message too long: ", context->message.length);
-			context->Dispose();
-			return;
+			DoIoCompletion(context, 0);
 		}
+		break;
+	}
+	case ProxySession::ReadResult::Hold:
+	case ProxySession::ReadResult::Closed:
+		break;
+	default:
+		context->Dispose();
+		break;
+	}
+}
 
-		context->ioNeedBytes = context->message.length;
-
-		// Compute read length
-		readLength = min(MAX_BUFFER_SIZE, context->ioNeedBytes);
+void sab::ProxyConnectionManager::DoWriteCompletion(std::shared_ptr<ProxyIoContext> context, DWORD transferred)
+{
+	ProxySession& session = context->session;
 
-		result = ReadFile(context->handle, context->ioBuffer,
-			readLength, NULL, &context->overlapped);
-		if (result == FALSE && GetLastError() != ERROR_IO_PENDING)
+	switch (session.OnWrite(transferred))
+	{
+	case ProxySession::WriteResult::Continue:
+		if (!ContinueWrite(context.get()))
 		{
 			context->Dispose();
-			return;
 		}
+		return;
+	case ProxySession::WriteResult::Finished:
 		break;
-	case ProxyIoContext::State::ReadBody:
-		context->ioNeedBytes -= transferred;
-		if (context->ioNeedBytes < 0)
-		{
-			LogDebug(L"unexpectedly read too many data");
-			context->Dispose();
+	default:
+		context->Dispose();
+		return;
+	}
+
+	if (session.Drained())
+	{
+		context->Dispose();
+		return;
+	}
+	ProxyRequest* held = session.TakeHeldRequest();
+	if (held)
+	{
+		// earlier replies are written, run the barrier
+		receiveCallback(&held->message, context);
+	}
+	if (session.ResumeRead())
+	{
+		// room for another request, resume reading
+		DoIoCompletion(context, 0);
+		if (session.state == ProxyIoContext::State::Destroyed)
 			return;
-		}
+	}
+	WriteNextReply(context);
+}
 
-		// append read data
-		context->message.data.insert(context->message.data.end(), context->ioBuffer,
-			context->ioBuffer + transferred);
+void sab::ProxyConnectionManager::WriteNextReply(const std::shared_ptr<ProxyIoContext>& context)
+{
+	if (!context->session.BeginWrite())
+		return;
 
-		if (context->ioNeedBytes > 0)
-		{
-			// continue reading...
-			readLength = min(MAX_BUFFER_SIZE, context->ioNeedBytes);
+	ProxyRequest* request = context->session.pendingRequests.front().get();
+	LogDebug(L"send message: length=", request->message.length, L", type=0x",
+		std::hex, std::setfill(L'0'), std::setw(2), request->message.data[0]);
+	if (!ContinueWrite(context.get()))
+	{
+		context->Dispose();
+	}
+}
 
-			result = ReadFile(context->handle, context->ioBuffer,
-				readLength, NULL, &context->overlapped);
-			if (result == FALSE && GetLastError() != ERROR_IO_PENDING)
-			{
-				context->Dispose();
-				return;
-			}
-		}
-		else
+std::unique_ptr<sab::ProxyRequest> sab::ProxyConnectionManager::AcquireRequest(const std::shared_ptr<ProxyIoContext>& context)
+{
+	auto request = context->session.TakeFreeRequest();
+	if (request)
+		return request;
+
+	request = requestPool.Take();
+	if (!request)
+	{
+		request.reset(new ProxyRequest());
+		ProxyRequest* newRequest = request.get();
+		// small enough to be stored inline by std::function
+		newRequest->message.replyCallback = [this, newRequest](SshMessageEnvelope* message, bool status)
 		{
-			// finished read
-			context->state = ProxyIoContext::State::WaitReply;
-			LogDebug(L"recv message: length=", context->message.length, L", type=0x",
-				std::hex, std::setfill(L'0'), std::setw(2), context->message.data[0]);
-			receiveCallback(&context->message, context);
-		}
-		break;
-	case ProxyIoContext::State::WaitReply:
-		context->state = ProxyIoContext::State::WriteReply;
-		LogDebug(L"send message: length=", context->message.length, L", type=0x",
-			std::hex, std::setfill(L'0'), std::setw(2), context->message.data[0]);
-		// reply already filled into message member
-		beLength = htonl(context->message.length);
-		context->ioBufferOffset = static_cast<int>(HEADER_SIZE);
-		context->ioNeedBytes = static_cast<int>(context->message.data.size()) + HEADER_SIZE;
+			auto strongContext = newRequest->context.lock();
+			if (strongContext == nullptr)
+				return; // context destroyed
+			PostMessageReply(strongContext, message, status);
+		};
+	}
+	request->context = context;
+	return request;
+}
+
+bool sab::ProxyConnectionManager::ContinueRead(ProxyIoContext* context)
+{
+	ProxyBuffer target = context->session.ReadTarget();
 
-		memcpy(context->ioBuffer, &beLength, HEADER_SIZE);
+	BOOL result = ReadFile(context->handle, target.data,
+		static_cast<DWORD>(target.length), NULL, &context->overlapped);
+	if (result == FALSE && GetLastError() != ERROR_IO_PENDING)
+		return false;
+	++context->pendingIo;
+	return true;
+}
 
-		writeLength = min(MAX_BUFFER_SIZE, context->ioNeedBytes);
+bool sab::ProxyConnectionManager::ContinueWrite(ProxyIoContext* context)
+{
+	ProxyBuffer target[2];
+	WSABUF buffers[2];
+	DWORD bufferCount = static_cast<DWORD>(context->session.WriteTarget(target));
 
-		context->ioDataOffset = writeLength - HEADER_SIZE;
-		memcpy(context->ioBuffer + HEADER_SIZE, context->message.data.data(),
-			context->ioDataOffset);
+	for (DWORD i = 0; i < bufferCount; ++i)
+	{
+		buffers[i].buf = reinterpret_cast<char*>(target[i].data);
+		buffers[i].len = static_cast<ULONG>(target[i].length);
+	}
 
-		result = WriteFile(context->handle, context->ioBuffer,
-			writeLength, NULL, &context->overlapped);
+	if (context->handleType == IoContext::HandleType::SocketHandle)
+	{
+		// gather header and body straight from the envelope
+		int result = WSASend(reinterpret_cast<SOCKET>(context->handle), buffers,
+			bufferCount, NULL, 0, &context->writeOverlapped, NULL);
+		if (result != 0 && WSAGetLastError() != WSA_IO_PENDING)
+			return false;
+	}
+	else
+	{
+		// the session framed header and body into one buffer
+		BOOL result = WriteFile(context->handle, buffers[0].buf,
+			buffers[0].len, NULL, &context->writeOverlapped);
 		if (result == FALSE && GetLastError() != ERROR_IO_PENDING)
-		{
-			context->Dispose();
-			return;
-		}
-		break;
-	case ProxyIoContext::State::WriteReply:
-		context->ioNeedBytes -= transferred;
-		if (context->ioNeedBytes > 0)
-		{
-			// continue write
-			writeLength = min(MAX_BUFFER_SIZE, context->ioNeedBytes);
-			memcpy(context->ioBuffer,
-				context->message.data.data() + context->ioDataOffset,
-				writeLength);
-			context->ioDataOffset += writeLength;
-
-			result = WriteFile(context->handle, context->ioBuffer,
-				writeLength, NULL, &context->overlapped);
-			if (result == FALSE && GetLastError() != ERROR_IO_PENDING)
-			{
-				context->Dispose();
-				return;
-			}
-		}
-		else
-		{
-			// finished writing
-			// prepare for next message
-			context->state = ProxyIoContext::State::Ready;
-			DoIoCompletion(context, 0);
-		}
-		break;
-	default:
-		LogDebug(L"illegal status for pipe context!");
-		context->Dispose();
-		return;
+			return false;
 	}
+	++context->pendingIo;
+	return true;
 }
 
 void sab::ProxyConnectionManager::PostMessageReply(std::shared_ptr<void> genericContext, SshMessageEnvelope* message, bool status)
 {
 	auto context = std::static_pointer_cast<ProxyIoContext>(genericContext);
-	if (status) {
-		DoIoCompletion(context, 0);
-	}
-	else
-	{
-		context->Dispose();
-	}
+	context->executor.Execute([this, context, message, status]()
+		{
+			if (context->session.state == ProxyIoContext::State::Destroyed)
+				return;
+			if (!status)
+			{
+				context->Dispose();
+				return;
+			}
+			context->session.MarkReplied(message);
+			WriteNextReply(context);
+		});
 }
@@ -2,8 +2,13 @@
 #pragma once
 
 #include "../protocol_ssh_helper.h"
+#include "../proxy_session.h"
 #include "../listener_base.h"
 #include "../connection_manager.h"
+#include "../../serial_executor.h"
+#include "../../idle_reaper.h"
+#include "../../connection_limiter.h"
+#include "iocp_queue.h"
 
 #include <atomic>
 #include <memory>
@@ -19,65 +24,57 @@ namespace sab
 		:public IoContext
 	{
 	public:
-		enum class State
-		{
-			Initialized = 0,
-			Handshake,
-			Ready,
-			ReadHeader,
-			ReadBody,
-			WaitReply,
-			WriteReply,
-			Destroyed,
-		};
-		/*
-		 * Normal Message:
-		 * Initialized -> Handshake -> Ready -> ReadHeader -> ReadBody -> WaitReply -> WriteReply
-		 *                               A                                                 |
-		 *                               +-------------------------------------------------+
-		 * Any state can go `Destroyed` when exception occurred/connection closes
-		 */
+		using State = ProxySession::State;
 	public:
 		/**
-		 * @brief OVERLAPPED structure for async i/o
+		 * @brief OVERLAPPED structure for async read
 		 */
 		OVERLAPPED overlapped;
-		
+
 		/**
-		 * @brief current state
+		 * @brief OVERLAPPED structure for async write
 		 */
-		State state;
+		OVERLAPPED writeOverlapped;
 
 		/**
-		 * @brief ssh agent message
- 		 */
-		SshMessageEnvelope message;
+		 * @brief framing and pipelined requests of the connection
+		 */
+		ProxySession session;
 
 		/**
-		 * @brief offset in agent message
-	  	 */
-		int ioDataOffset;
+		 * @brief reads and writes issued and not completed yet, the context
+		 * stays in the context list until all of them complete
+		 */
+		int pendingIo;
 
 		/**
-		 * @brief offset in buffer
+		 * @brief the listener has a handshake operation pending,
+		 * it keeps the context in the list like pendingIo
 		 */
-		int ioBufferOffset;
+		bool handshakeIoPending;
 
 		/**
-		 * @brief remaining bytes to complete the transaction
+		 * @brief removed from the context list
 		 */
-		int ioNeedBytes;
+		bool released;
 
 		/**
-		 * @brief buffer
+		 * @brief serializes state transitions of this connection,
+		 * completions handled by different workers and replies posted
+		 * by the dispatcher never race on the session
 		 */
-		char ioBuffer[MAX_BUFFER_SIZE];
+		SerialExecutor executor;
 	public:
 		ProxyIoContext();
 
 		~ProxyIoContext();
 		
 		void Dispose()override;
+
+		/**
+		 * @brief remove a destroyed context from the list once no i/o is pending
+		 */
+		void ReleaseIfIdle();
 	};
 	
 	class ProxyConnectionManager
@@ -87,19 +84,24 @@ namespace sab
 		std::atomic<bool> cancelFlag;
 
 		/**
-		 * @brief completion port handle
+		 * @brief completion port
+		 */
+		IocpCompletionQueue completionQueue;
+
+		/**
+		 * @brief worker threads draining the completion port
 		 */
-		HANDLE iocpHandle;
+		CompletionWorkerPool workerPool;
 
 		/**
-		 * @brief worker thread
+		 * @brief number of worker threads
 		 */
-		std::thread iocpThread;
+		size_t workerCount;
 
 		/**
 		 * @brief list of active connections
 		 */
-		std::list<std::shared_ptr<IoContext>> contextList;
+		IoContextList contextList;
 
 		/**
 		 * @brief initialized flag
@@ -111,11 +113,28 @@ namespace sab
 		 */
 		std::mutex listMutex;
 
+		/**
+		 * @brief closes connections idle for too long
+		 */
+		IdleReaper<IoContext> idleReaper;
+
+		/**
+		 * @brief per listener connection limits
+		 */
+		ConnectionLimiter connectionLimiter;
+
+		/**
+		 * @brief request objects left by closed connections
+		 */
+		ProxyRequestPool requestPool;
+
 		/**
 		 * @brief callback to process received message
 		 */
 		std::function<void(SshMessageEnvelope*, std::shared_ptr<void>)> receiveCallback;
 	public:
+		static constexpr size_t DEFAULT_WORKER_COUNT = 2;
+
 		ProxyConnectionManager();
 
 		~ProxyConnectionManager();
@@ -123,6 +142,13 @@ namespace sab
 
 		bool Initialize();
 
+		/**
+		 * @brief set number of completion worker threads, call before Start
+		 * @param count 1 to CompletionWorkerPool::MAX_WORKER_COUNT
+		 * @return false if count is out of range
+		 */
+		bool SetWorkerCount(size_t count);
+
 		bool Start()override;
 
 		void Stop()override;
@@ -152,12 +178,70 @@ namespace sab
 		 */
 		void RemoveContext(IoContext* context)override;
 
+		void SetIdleTimeout(std::chrono::milliseconds timeout)override;
+
+		void SetConnectionLimit(const std::shared_ptr<ProtocolListenerBase>& listener,
+			size_t limit)override;
+
+		size_t GetActiveCount()override;
+
 	private:
 		
-		void IocpThreadProc();
+		void HandleCompletion(const CompletionPacket& packet);
 
+		/**
+		 * @brief close the context if it is idle, called by idle reaper
+		 */
+		void CheckIdleContext(const std::shared_ptr<ProxyIoContext>& context);
+
+		/**
+		 * @brief run DoIoCompletion on the context's executor
+		 * @param context the context, kept alive by the caller during the call
+		 * @param transferred bytes transferred
+		 */
+		void ScheduleIoCompletion(const std::shared_ptr<ProxyIoContext>& context, DWORD transferred);
+
+		/**
+		 * @brief route a completion to the reading or writing side, runs on executor
+		 */
+		void ProcessCompletion(const std::shared_ptr<ProxyIoContext>& context,
+			const CompletionPacket& packet);
+
+		/**
+		 * @brief advance the reading side
+		 */
 		void DoIoCompletion(std::shared_ptr<ProxyIoContext> context, DWORD transferred);
 
+		/**
+		 * @brief advance the writing side
+		 */
+		void DoWriteCompletion(std::shared_ptr<ProxyIoContext> context, DWORD transferred);
+
+		/**
+		 * @brief start writing the oldest reply if it is ready and no write is pending
+		 */
+		void WriteNextReply(const std::shared_ptr<ProxyIoContext>& context);
+
+		/**
+		 * @brief take a request object for reading
+		 */
+		std::unique_ptr<ProxyRequest> AcquireRequest(const std::shared_ptr<ProxyIoContext>& context);
+
+		/**
+		 * @brief issue a read for the rest of the header or body
+		 * @param context the context
+		 * @return false if the read cannot be started
+		 */
+		static bool ContinueRead(ProxyIoContext* context);
+
+		/**
+		 * @brief issue a write for the rest of the oldest framed reply,
+		 * header and body are gathered in one call on sockets
+		 * @param context the context
+		 * @return false if the write cannot be started
+		 */
+		static bool ContinueWrite(ProxyIoContext* context);
+
 		/**
 		 * @brief helper function to send reply to connection initiator
 		 * @param genericContext the context
@@ -1,4 +1,3 @@
-
 #include "../../log.h"
 #include "../../util.h"
 #include "client.h"
@@ -9,53 +8,180 @@
 #include <WS2tcpip.h>
 
 sab::LibassuanSocketEmulationClient::LibassuanSocketEmulationClient(const std::wstring& pipePath)
-	:pipePath(pipePath)
+	:pipePath(pipePath), socketInfo(), socketFileTime(0), socketInfoValid(false)
 {
 }
 
 sab::LibassuanSocketEmulationClient::~LibassuanSocketEmulationClient()
 {
+	for (SOCKET s : idleSockets)
+	{
+		LibassuanSocketEmulationConnector::Close(s);
+	}
 }
 
 bool sab::LibassuanSocketEmulationClient::SendSshMessage(SshMessageEnvelope* message)
 {
-	SOCKET connectSocket = LibassuanSocketEmulationConnector::Connect(pipePath);
+	bool reused;
+	SOCKET connectSocket = AcquireSocket(reused);
 	if (connectSocket == LibassuanSocketEmulationConnector::INVALID)
 		return false;
-	auto sockGuard = HandleGuard(connectSocket, LibassuanSocketEmulationConnector::Close);
 
-	// do communication
+	ExchangeStatus status = Exchange(connectSocket, message);
+	if (status != ExchangeStatus::Done)
+	{
+		LibassuanSocketEmulationConnector::Close(connectSocket);
+		// a request the agent may have executed is never sent twice
+		if (!reused || status != ExchangeStatus::SendFailed)
+			return false;
+		// gpg-agent may have dropped the idle connection, retry once
+		LogDebug(L"pooled socket failed, reconnecting.");
+		connectSocket = ConnectNew();
+		if (connectSocket == LibassuanSocketEmulationConnector::INVALID)
+			return false;
+		if (Exchange(connectSocket, message) != ExchangeStatus::Done)
+		{
+			LibassuanSocketEmulationConnector::Close(connectSocket);
+			return false;
+		}
+	}
+
+	ReleaseSocket(connectSocket);
+	return true;
+}
+
+SOCKET sab::LibassuanSocketEmulationClient::AcquireSocket(bool& reused)
+{
+	{
+		std::lock_guard<std::mutex> lg(poolMutex);
+		while (!idleSockets.empty())
+		{
+			SOCKET s = idleSockets.back();
+			idleSockets.pop_back();
+			// an idle socket should never be readable, readable means
+			// either the peer closed it or it has stale data
+			fd_set readSet;
+			FD_ZERO(&readSet);
+			FD_SET(s, &readSet);
+			timeval zeroTimeout = { 0, 0 };
+			if (select(0, &readSet, NULL, NULL, &zeroTimeout) == 0)
+			{
+				reused = true;
+				return s;
+			}
+			LogDebug(L"discard unhealthy pooled socket ", s);
+			LibassuanSocketEmulationConnector::Close(s);
+		}
+	}
+	reused = false;
+	return ConnectNew();
+}
+
+void sab::LibassuanSocketEmulationClient::ReleaseSocket(SOCKET s)
+{
+	{
+		std::lock_guard<std::mutex> lg(poolMutex);
+		if (idleSockets.size() < MAX_IDLE_SOCKETS)
+		{
+			idleSockets.push_back(s);
+			return;
+		}
+	}
+	LibassuanSocketEmulationConnector::Close(s);
+}
+
+SOCKET sab::LibassuanSocketEmulationClient::ConnectNew()
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExW(pipePath.c_str(), GetFileExInfoStandard, &attributes))
+	{
+		LogDebug(L"cannot stat socket file! ", LogLastError);
+		return LibassuanSocketEmulationConnector::INVALID;
+	}
+	uint64_t fileTime = (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32)
+		| attributes.ftLastWriteTime.dwLowDateTime;
+
+	LibassuanSocketEmulationConnector::SocketFileInfo info;
+	{
+		std::lock_guard<std::mutex> lg(poolMutex);
+		if (socketInfoValid && socketFileTime == fileTime)
+		{
+			info = socketInfo;
+		}
+		else
+		{
+			if (!LibassuanSocketEmulationConnector::ReadSocketFile(pipePath, &info))
+			{
+				socketInfoValid = false;
+				return LibassuanSocketEmulationConnector::INVALID;
+			}
+			if (socketInfoValid)
+			{
+				// agent restarted, pooled sockets point to the old instance
+				LogDebug(L"socket file changed, flushing pooled sockets.");
+				for (SOCKET s : idleSockets)
+				{
+					LibassuanSocketEmulationConnector::Close(s);
+				}
+				idleSockets.clear();
+			}
+			socketInfo = info;
+			socketFileTime = fileTime;
+			socketInfoValid = true;
+		}
+	}
+
+	SOCKET connectSocket = LibassuanSocketEmulationConnector::Connect(info);
+	if (connectSocket == LibassuanSocketEmulationConnector::INVALID)
+	{
+		// force reread next time in case the file was rewritten
+		// within the timestamp resolution
+		std::lock_guard<std::mutex> lg(poolMutex);
+		socketInfoValid = false;
+	}
+	return connectSocket;
+}
+
+sab::LibassuanSocketEmulationClient::ExchangeStatus sab::LibassuanSocketEmulationClient::Exchange(
+	SOCKET connectSocket, SshMessageEnvelope* message)
+{
 	uint32_t beLength;
 	beLength = htonl(message->length);
 	if (!SendBuffer(connectSocket, reinterpret_cast<char*>(&beLength),
 		HEADER_SIZE))
 	{
 		LogDebug(L"cannot send length prefix!");
-		return false;
+		return ExchangeStatus::SendFailed;
 	}
 	if (!SendBuffer(connectSocket, reinterpret_cast<char*>(message->data.data()),
 		message->length))
 	{
 		LogDebug(L"cannot send request data!");
-		return false;
+		return ExchangeStatus::SendFailed;
 	}
 
-	message->data.clear();
-
 	if (!ReceiveBuffer(connectSocket, reinterpret_cast<char*>(&beLength),
 		HEADER_SIZE))
 	{
 		LogDebug(L"cannot read length prefix!");
-		return false;
+		return ExchangeStatus::ReceiveFailed;
 	}
-	message->length = ntohl(beLength);
-	message->data.resize(message->length);
-	if (!ReceiveBuffer(connectSocket, reinterpret_cast<char*>(message->data.data()),
-		message->length))
+	uint32_t tmpLength = ntohl(beLength);
+	if (tmpLength > MAX_MESSAGE_SIZE)
+	{
+		LogDebug(L"reply too long: ", tmpLength);
+		return ExchangeStatus::ReceiveFailed;
+	}
+	// keep the request intact until the whole reply arrived
+	std::vector<uint8_t> tmpData(tmpLength);
+	if (!ReceiveBuffer(connectSocket, reinterpret_cast<char*>(tmpData.data()),
+		tmpLength))
 	{
 		LogDebug(L"cannot read reply data!");
-		return false;
+		return ExchangeStatus::ReceiveFailed;
 	}
+	message->length = tmpLength;
+	message->data = std::move(tmpData);
 
-	return true;
+	return ExchangeStatus::Done;
 }
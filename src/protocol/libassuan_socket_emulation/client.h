@@ -2,8 +2,11 @@
 #pragma once
 
 #include "../client_base.h"
+#include "connector.h"
 
 #include <string>
+#include <mutex>
+#include <vector>
 
 namespace sab
 {
@@ -13,13 +16,69 @@ namespace sab
 	 */
 	class LibassuanSocketEmulationClient : public ProtocolClientBase
 	{
+	public:
+		/// <summary>
+		/// max number of authenticated sockets kept for reuse
+		/// </summary>
+		static constexpr size_t MAX_IDLE_SOCKETS = 4;
 	private:
 		std::wstring pipePath;
+
+		/// <summary>
+		/// port and nonce parsed from the socket file,
+		/// valid until the file's last write time changes
+		/// </summary>
+		LibassuanSocketEmulationConnector::SocketFileInfo socketInfo;
+		uint64_t socketFileTime;
+		bool socketInfoValid;
+
+		/// <summary>
+		/// connected sockets which have sent the nonce
+		/// </summary>
+		std::vector<SOCKET> idleSockets;
+
+		std::mutex poolMutex;
 	public:
 
 		LibassuanSocketEmulationClient(const std::wstring& pipePath);
 		~LibassuanSocketEmulationClient();
 
 		bool SendSshMessage(SshMessageEnvelope* message)override;
+
+		// every request owns a connection while in flight
+		bool AllowConcurrentRequests()const override { return true; }
+	private:
+		/// <summary>
+		/// take a healthy idle socket, or connect a new one
+		/// </summary>
+		/// <param name="reused">set to true if the socket comes from the pool</param>
+		/// <returns>socket or INVALID_SOCKET</returns>
+		SOCKET AcquireSocket(bool& reused);
+
+		/// <summary>
+		/// put a socket back to the pool, close it if the pool is full
+		/// </summary>
+		void ReleaseSocket(SOCKET s);
+
+		/// <summary>
+		/// connect with cached port and nonce, reread socket file if it changed
+		/// </summary>
+		SOCKET ConnectNew();
+
+		enum class ExchangeStatus
+		{
+			Done,
+			/// <summary>
+			/// the request was not completely sent, the agent
+			/// cannot have acted on it
+			/// </summary>
+			SendFailed,
+			/// <summary>
+			/// the agent may have executed the request
+			/// </summary>
+			ReceiveFailed,
+		};
+
+		ExchangeStatus Exchange(SOCKET s, SshMessageEnvelope* message);
 	};
-}
\ No newline at end of file
+}
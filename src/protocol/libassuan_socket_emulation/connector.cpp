@@ -43,7 +43,8 @@ bool sab::ReceiveBuffer(SOCKET sock, char* buffer, int len)
 	return true;
 }
 
-SOCKET sab::LibassuanSocketEmulationConnector::Connect(const std::wstring& path)
+bool sab::LibassuanSocketEmulationConnector::ReadSocketFile(const std::wstring& path,
+	SocketFileInfo* info)
 {
 	// open target file
 	std::ifstream sockFile;
@@ -51,7 +52,7 @@ SOCKET sab::LibassuanSocketEmulationConnector::Connect(const std::wstring& path)
 	if (!sockFile.is_open())
 	{
 		LogDebug(L"cannot open socket file!");
-		return INVALID_SOCKET;
+		return false;
 	}
 
 	int portNumber;
@@ -59,20 +60,24 @@ SOCKET sab::LibassuanSocketEmulationConnector::Connect(const std::wstring& path)
 	if ((portNumber < 0) || (portNumber > 65535))
 	{
 		LogDebug(L"invalid port number!");
-		return INVALID_SOCKET;
+		return false;
 	}
+	info->portNumber = portNumber;
 
 	// get nonce
-	char nonce[NONCE_LENGTH];
 	while (!sockFile.eof() && sockFile.peek() == '\n')
 		sockFile.get();
-	sockFile.read(nonce, NONCE_LENGTH);
+	sockFile.read(info->nonce, NONCE_LENGTH);
 	if (sockFile.gcount() != NONCE_LENGTH)
 	{
 		LogDebug("cannot read nonce!");
-		return INVALID_SOCKET;
+		return false;
 	}
+	return true;
+}
 
+SOCKET sab::LibassuanSocketEmulationConnector::Connect(const SocketFileInfo& info)
+{
 	SOCKET connectSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (connectSocket == INVALID_SOCKET)
 	{
@@ -87,20 +92,20 @@ SOCKET sab::LibassuanSocketEmulationConnector::Connect(const std::wstring& path)
 	if (inet_pton(AF_INET, "127.0.0.1", &sockAddress.sin_addr) <= 0)
 	{
 		LogDebug(L"inet_pton failed!");
-		return false;
+		return INVALID_SOCKET;
 	}
-	sockAddress.sin_port = htons(portNumber);
+	sockAddress.sin_port = htons(static_cast<u_short>(info.portNumber));
 
 	// connect
 	if (::connect(connectSocket, reinterpret_cast<sockaddr*>(&sockAddress),
 		sizeof(sockAddress)) != 0)
 	{
 		LogDebug(L"connect failed! ", LogWSALastError);
-		return false;
+		return INVALID_SOCKET;
 	}
 
 	// write nonce
-	if (!SendBuffer(connectSocket, nonce, NONCE_LENGTH))
+	if (!SendBuffer(connectSocket, info.nonce, NONCE_LENGTH))
 	{
 		LogDebug(L"cannot send nonce!");
 		return INVALID_SOCKET;
@@ -109,3 +114,13 @@ SOCKET sab::LibassuanSocketEmulationConnector::Connect(const std::wstring& path)
 	sockGuard.release();
 	return connectSocket;
 }
+
+SOCKET sab::LibassuanSocketEmulationConnector::Connect(const std::wstring& path)
+{
+	SocketFileInfo info;
+	if (!ReadSocketFile(path, &info))
+	{
+		return INVALID_SOCKET;
+	}
+	return Connect(info);
+}
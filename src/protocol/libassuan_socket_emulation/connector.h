@@ -14,6 +14,17 @@ namespace sab
 		static constexpr int NONCE_LENGTH = 16;
 		static constexpr SOCKET INVALID = INVALID_SOCKET;
 
+		/// <summary>
+		/// parsed content of a socket emulation file
+		/// </summary>
+		struct SocketFileInfo
+		{
+			int portNumber;
+			char nonce[NONCE_LENGTH];
+		};
+
+		static bool ReadSocketFile(const std::wstring& path, SocketFileInfo* info);
+		static SOCKET Connect(const SocketFileInfo& info);
 		static SOCKET Connect(const std::wstring& path);
 		static inline void Close(SOCKET s) { ::closesocket(s); }
 	};
@@ -0,0 +1,303 @@
+#include "../../log.h"
+#include "listener.h"
+
+#include <cassert>
+#include <cstring>
+
+#ifdef _WIN32
+#include "../../util.h"
+
+#include <sddl.h>
+#else
+#include "../../encoding.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+bool sab::MetricsListener::Run()
+{
+	bool status = ListenLoop();
+	if (status)
+	{
+		LogInfo(L"MetricsListener stopped gracefully.");
+	}
+	else
+	{
+		LogInfo(L"MetricsListener stopped unexpectedly.");
+	}
+	return status;
+}
+
+bool sab::MetricsListener::IsCancelled()const
+{
+	return cancelFlag.load();
+}
+
+#ifdef _WIN32
+sab::MetricsListener::MetricsListener(const std::wstring& path, Collector collector)
+	:path(path), collector(std::move(collector))
+{
+	cancelEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	assert(cancelEvent != NULL);
+}
+
+bool sab::MetricsListener::ListenLoop()
+{
+	OVERLAPPED overlapped;
+	HANDLE waitHandles[2];
+	SECURITY_ATTRIBUTES sa;
+	std::wostringstream sddlStream;
+	std::wstring sid = GetCurrentUserSidString();
+
+	if (sid.empty())
+	{
+		return false;
+	}
+
+	// deny everyone except current user
+	sddlStream << L"D:P(A;;GA;;;" << sid << ")(D;;GA;;;WD)";
+
+	std::memset(&sa, 0, sizeof(SECURITY_ATTRIBUTES));
+	sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+	sa.bInheritHandle = FALSE;
+
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+		sddlStream.str().c_str(),
+		SDDL_REVISION_1,
+		&sa.lpSecurityDescriptor,
+		NULL))
+	{
+		LogError(L"cannot convert sddl to security descriptor!");
+		return false;
+	}
+	auto sdGuard = HandleGuard(sa.lpSecurityDescriptor, LocalFree);
+
+	HANDLE ioEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (ioEvent == NULL)
+	{
+		LogError(L"cannot create event handle!");
+		return false;
+	}
+	auto eventGuard = HandleGuard(ioEvent, CloseHandle);
+
+	waitHandles[0] = cancelEvent;
+	waitHandles[1] = ioEvent;
+
+	LogInfo(L"serving metrics on ", path);
+
+	while (true)
+	{
+		HANDLE pipeHandle = CreateNamedPipeW(
+			path.c_str(),
+			PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED,
+			PIPE_TYPE_BYTE | PIPE_REJECT_REMOTE_CLIENTS,
+			1,
+			64 * 1024,
+			0,
+			0,
+			&sa);
+		if (pipeHandle == INVALID_HANDLE_VALUE)
+		{
+			LogError(L"cannot create metrics pipe! ", LogLastError);
+			return false;
+		}
+		auto pipeGuard = HandleGuard(pipeHandle, CloseHandle);
+
+		std::memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.hEvent = ioEvent;
+		if (!ConnectNamedPipe(pipeHandle, &overlapped))
+		{
+			switch (GetLastError())
+			{
+			case ERROR_IO_PENDING:
+				if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+				{
+					DWORD transferred;
+					CancelIoEx(pipeHandle, &overlapped);
+					GetOverlappedResult(pipeHandle, &overlapped, &transferred, TRUE);
+					return true;
+				}
+				break;
+			case ERROR_PIPE_CONNECTED:
+				break;
+			default:
+				LogError(L"ConnectNamedPipe failed with error: ", LogLastError);
+				return false;
+			}
+		}
+
+		std::string page = collector();
+		std::memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.hEvent = ioEvent;
+		if (!WriteFile(pipeHandle, page.data(), static_cast<DWORD>(page.size()), NULL, &overlapped)
+			&& GetLastError() == ERROR_IO_PENDING)
+		{
+			DWORD waitResult = WaitForMultipleObjects(2, waitHandles, FALSE,
+				static_cast<DWORD>(WRITE_TIMEOUT.count()));
+			if (waitResult != WAIT_OBJECT_0 + 1)
+			{
+				LogDebug(L"metrics client did not read in time.");
+				CancelIoEx(pipeHandle, &overlapped);
+			}
+			DWORD written;
+			GetOverlappedResult(pipeHandle, &overlapped, &written, TRUE);
+			if (waitResult == WAIT_OBJECT_0)
+				return true;
+		}
+		// closing without disconnecting leaves the page readable for the client
+	}
+}
+
+void sab::MetricsListener::Cancel()
+{
+	cancelFlag.store(true);
+	SetEvent(cancelEvent);
+}
+
+sab::MetricsListener::~MetricsListener()
+{
+	if (cancelEvent)
+		CloseHandle(cancelEvent);
+}
+#else
+sab::MetricsListener::MetricsListener(const std::wstring& path, Collector collector)
+	:path(path), collector(std::move(collector))
+{
+	if (pipe(cancelPipe) == 0)
+	{
+		fcntl(cancelPipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(cancelPipe[1], F_SETFD, FD_CLOEXEC);
+	}
+}
+
+/// <summary>
+/// send the whole page, gives up on a client not reading in time
+/// </summary>
+static void SendPage(int fd, const std::string& page)
+{
+#ifdef MSG_NOSIGNAL
+	constexpr int flags = MSG_NOSIGNAL;
+#else
+	constexpr int flags = 0;
+#endif
+	size_t offset = 0;
+	while (offset < page.size())
+	{
+		ssize_t sent = send(fd, page.data() + offset, page.size() - offset, flags);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+		{
+			LogDebug(L"cannot send metrics: ", std::strerror(errno));
+			return;
+		}
+		offset += static_cast<size_t>(sent);
+	}
+}
+
+bool sab::MetricsListener::ListenLoop()
+{
+	if (cancelPipe[0] < 0)
+	{
+		LogError(L"cannot create cancel pipe!");
+		return false;
+	}
+	std::string socketPath = WideStringToUtf8String(path);
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.empty() || socketPath.size() >= sizeof(addr.sun_path))
+	{
+		LogError(L"invalid metrics socket path ", path);
+		return false;
+	}
+	std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+
+	// a socket left by a previous run blocks bind, anything else is kept
+	struct stat st;
+	if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socketPath.c_str());
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0)
+	{
+		LogError(L"cannot create metrics socket: ", std::strerror(errno));
+		return false;
+	}
+	fcntl(listenFd, F_SETFD, FD_CLOEXEC);
+	if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+		|| chmod(socketPath.c_str(), S_IRUSR | S_IWUSR) != 0
+		|| listen(listenFd, SOMAXCONN) != 0)
+	{
+		LogError(L"cannot listen on ", path, L": ", std::strerror(errno));
+		close(listenFd);
+		return false;
+	}
+
+	LogInfo(L"serving metrics on ", path);
+
+	bool status = true;
+	pollfd fds[2];
+	fds[0].fd = cancelPipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = listenFd;
+	fds[1].events = POLLIN;
+	while (!IsCancelled())
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LogError(L"cannot wait for metrics clients: ", std::strerror(errno));
+			status = false;
+			break;
+		}
+		if (fds[0].revents != 0)
+			break;
+		if (fds[1].revents == 0)
+			continue;
+
+		int clientFd = accept(listenFd, nullptr, nullptr);
+		if (clientFd < 0)
+			continue;
+		fcntl(clientFd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+		int one = 1;
+		setsockopt(clientFd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+		timeval timeout;
+		timeout.tv_sec = static_cast<time_t>(WRITE_TIMEOUT.count() / 1000);
+		timeout.tv_usec = static_cast<suseconds_t>(WRITE_TIMEOUT.count() % 1000 * 1000);
+		setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		SendPage(clientFd, collector());
+		close(clientFd);
+	}
+	close(listenFd);
+	unlink(socketPath.c_str());
+	return status;
+}
+
+void sab::MetricsListener::Cancel()
+{
+	cancelFlag.store(true);
+	if (cancelPipe[1] >= 0)
+	{
+		char byte = 0;
+		(void)!write(cancelPipe[1], &byte, 1);
+	}
+}
+
+sab::MetricsListener::~MetricsListener()
+{
+	if (cancelPipe[0] >= 0)
+		close(cancelPipe[0]);
+	if (cancelPipe[1] >= 0)
+		close(cancelPipe[1]);
+}
+#endif
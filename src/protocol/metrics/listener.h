@@ -0,0 +1,66 @@
+#pragma once
+
+#include "../listener_base.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#endif
+
+namespace sab
+{
+	/// <summary>
+	/// Serves a page of metrics to every connection and closes it, on a
+	/// named pipe on Windows and an AF_UNIX socket elsewhere. Nothing is
+	/// read from clients, e.g. `socat - UNIX-CONNECT:path` prints the page.
+	/// Only the current user can connect.
+	/// </summary>
+	class MetricsListener
+		:public ProtocolListenerBase
+	{
+	public:
+		/// <summary>
+		/// produces the page, called on the listener thread per connection
+		/// </summary>
+		using Collector = std::function<std::string()>;
+
+		/// <summary>
+		/// a client not taking the page within this time is dropped,
+		/// connections are served one at a time
+		/// </summary>
+		static constexpr std::chrono::milliseconds WRITE_TIMEOUT{ 1000 };
+	private:
+		std::wstring path;
+
+		Collector collector;
+
+		std::atomic<bool> cancelFlag{ false };
+
+#ifdef _WIN32
+		HANDLE cancelEvent = NULL;
+#else
+		/// <summary>
+		/// written by Cancel to wake the accept loop
+		/// </summary>
+		int cancelPipe[2] = { -1, -1 };
+#endif
+	public:
+		/// <param name="path">pipe path on Windows, socket path elsewhere</param>
+		MetricsListener(const std::wstring& path, Collector collector);
+
+		bool Run()override;
+
+		void Cancel()override;
+
+		bool IsCancelled()const override;
+
+		~MetricsListener()override;
+	private:
+		bool ListenLoop();
+	};
+}
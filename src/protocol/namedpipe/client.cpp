@@ -1,4 +1,3 @@
-
 #include "../../log.h"
 #include "../../util.h"
 #include "client.h"
@@ -17,13 +16,87 @@ sab::Win32NamedPipeClient::Win32NamedPipeClient(const std::wstring& pipePath)
 
 bool sab::Win32NamedPipeClient::SendSshMessage(SshMessageEnvelope* message)
 {
-	HANDLE pipeHandle = Win32NamedPipeConnector::Connect(pipePath);
+	bool reused;
+	HANDLE pipeHandle = AcquirePipe(reused);
 	if (pipeHandle == Win32NamedPipeConnector::INVALID)
 	{
 		return false;
 	}
-	auto pipeGuard = HandleGuard(pipeHandle, Win32NamedPipeConnector::Close);
 
+	ExchangeStatus status = Exchange(pipeHandle, message);
+	if (status != ExchangeStatus::Done)
+	{
+		Win32NamedPipeConnector::Close(pipeHandle);
+		// a request the agent may have executed is never sent twice
+		if (!reused || status != ExchangeStatus::SendFailed)
+			return false;
+		// the agent may have restarted since the pipe was pooled,
+		// retry once on a fresh connection
+		LogDebug(L"pooled pipe failed, reconnecting.");
+		pipeHandle = Win32NamedPipeConnector::Connect(pipePath);
+		if (pipeHandle == Win32NamedPipeConnector::INVALID)
+		{
+			return false;
+		}
+		if (Exchange(pipeHandle, message) != ExchangeStatus::Done)
+		{
+			Win32NamedPipeConnector::Close(pipeHandle);
+			return false;
+		}
+	}
+
+	ReleasePipe(pipeHandle);
+	return true;
+}
+
+sab::Win32NamedPipeClient::~Win32NamedPipeClient()
+{
+	for (HANDLE pipeHandle : idlePipes)
+	{
+		Win32NamedPipeConnector::Close(pipeHandle);
+	}
+}
+
+HANDLE sab::Win32NamedPipeClient::AcquirePipe(bool& reused)
+{
+	{
+		std::lock_guard<std::mutex> lg(poolMutex);
+		while (!idlePipes.empty())
+		{
+			HANDLE pipeHandle = idlePipes.back();
+			idlePipes.pop_back();
+			// a closed peer makes PeekNamedPipe fail, pending data means
+			// the pipe is out of sync with the protocol
+			DWORD available = 0;
+			if (PeekNamedPipe(pipeHandle, NULL, 0, NULL, &available, NULL) && available == 0)
+			{
+				reused = true;
+				return pipeHandle;
+			}
+			LogDebug(L"discard unhealthy pooled pipe ", pipeHandle);
+			Win32NamedPipeConnector::Close(pipeHandle);
+		}
+	}
+	reused = false;
+	return Win32NamedPipeConnector::Connect(pipePath);
+}
+
+void sab::Win32NamedPipeClient::ReleasePipe(HANDLE pipeHandle)
+{
+	{
+		std::lock_guard<std::mutex> lg(poolMutex);
+		if (idlePipes.size() < MAX_IDLE_PIPES)
+		{
+			idlePipes.push_back(pipeHandle);
+			return;
+		}
+	}
+	Win32NamedPipeConnector::Close(pipeHandle);
+}
+
+sab::Win32NamedPipeClient::ExchangeStatus sab::Win32NamedPipeClient::Exchange(
+	HANDLE pipeHandle, SshMessageEnvelope* message)
+{
 	LogDebug(L"send request: length=", message->length, L", type=0x", std::hex,
 		std::setfill(L'0'), std::setw(2), message->data[0]);
 
@@ -33,7 +106,7 @@ bool sab::Win32NamedPipeClient::SendSshMessage(SshMessageEnvelope* message)
 			static_cast<DWORD>(message->data.size())))
 	{
 		LogDebug(L"send request failed! ", LogLastError);
-		return false;
+		return ExchangeStatus::SendFailed;
 	}
 
 	LogDebug(L"send request successfully, reading reply.");
@@ -41,23 +114,24 @@ bool sab::Win32NamedPipeClient::SendSshMessage(SshMessageEnvelope* message)
 	if (!ReadBufferFromPipe(pipeHandle, &beLength, HEADER_SIZE))
 	{
 		LogDebug(L"recv reply failed! ", LogLastError);
-		return false;
+		return ExchangeStatus::ReceiveFailed;
 	}
 	uint32_t tmpLength = ntohl(beLength);
+	if (tmpLength > MAX_MESSAGE_SIZE)
+	{
+		LogDebug(L"reply too long: ", tmpLength);
+		return ExchangeStatus::ReceiveFailed;
+	}
 	std::vector<uint8_t> tmpData(tmpLength);
 	if (!ReadBufferFromPipe(pipeHandle, tmpData.data(),
 		static_cast<DWORD>(tmpLength)))
 	{
 		LogDebug(L"recv reply failed! ", LogLastError);
-		return false;
+		return ExchangeStatus::ReceiveFailed;
 	}
 	message->length = tmpLength;
 	message->data = std::move(tmpData);
 	LogDebug(L"recv reply: length=", message->length, L", type=0x", std::hex,
 		std::setfill(L'0'), std::setw(2), message->data[0]);
-	return true;
-}
-
-sab::Win32NamedPipeClient::~Win32NamedPipeClient()
-{
+	return ExchangeStatus::Done;
 }
@@ -1,21 +1,68 @@
-
 #pragma once
 
 #include "../client_base.h"
 
 #include <string>
+#include <mutex>
+#include <vector>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
 
 namespace sab
 {
 	class Win32NamedPipeClient:public ProtocolClientBase
 	{
+	public:
+		/// <summary>
+		/// max number of connected pipes kept for reuse
+		/// </summary>
+		static constexpr size_t MAX_IDLE_PIPES = 4;
 	private:
 		std::wstring pipePath;
+
+		/// <summary>
+		/// connected pipes waiting for next request
+		/// </summary>
+		std::vector<HANDLE> idlePipes;
+
+		std::mutex poolMutex;
 	public:
 		Win32NamedPipeClient(const std::wstring& pipePath);
 
 		bool SendSshMessage(SshMessageEnvelope* message)override;
 
+		// every request owns a pipe while in flight
+		bool AllowConcurrentRequests()const override { return true; }
+
 		~Win32NamedPipeClient()override;
+	private:
+		/// <summary>
+		/// take a healthy idle pipe, or connect a new one
+		/// </summary>
+		/// <param name="reused">set to true if the pipe comes from the pool</param>
+		/// <returns>pipe handle or INVALID_HANDLE_VALUE</returns>
+		HANDLE AcquirePipe(bool& reused);
+
+		/// <summary>
+		/// put a pipe back to the pool, close it if the pool is full
+		/// </summary>
+		void ReleasePipe(HANDLE pipeHandle);
+
+		enum class ExchangeStatus
+		{
+			Done,
+			/// <summary>
+			/// the request was not completely written, the server
+			/// cannot have acted on it
+			/// </summary>
+			SendFailed,
+			/// <summary>
+			/// the server may have executed the request
+			/// </summary>
+			ReceiveFailed,
+		};
+
+		ExchangeStatus Exchange(HANDLE pipeHandle, SshMessageEnvelope* message);
 	};
-}
\ No newline at end of file
+}
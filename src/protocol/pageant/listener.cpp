@@ -220,7 +220,12 @@ int sab::PageantListener::ProcessRequest(COPYDATASTRUCT* cds)
 		if (cancelFlag)return false;
 		assert(messageOnAir != true);
 		messageOnAir = true;
-		receiveCallback(message.get(), message);
+	}
+	// the reply may be delivered synchronously (e.g. dispatcher queue is full),
+	// so the lock must not be held here
+	receiveCallback(message.get(), message);
+	{
+		std::unique_lock<mutex_type> lg(msgMutex);
 		msgCondition.wait(lg, [&]()
 			{
 				return messageOnAir == false;
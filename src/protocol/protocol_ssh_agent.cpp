@@ -1,19 +1,22 @@
 
 #include "protocol_ssh_agent.h"
 
-bool sab::SshAgentIdentity::FromBuffer(SshAgentMessageBufferReader& reader)
+template<typename StringType>
+bool sab::BasicSshAgentIdentity<StringType>::FromBuffer(SshAgentMessageBufferReader& reader)
 {
 	return reader.ReadString(blob)
 		&& reader.ReadString(comment);
 }
 
-void sab::SshAgentIdentity::ToBuffer(SshAgentMessageBufferWriter& writer)const
+template<typename StringType>
+void sab::BasicSshAgentIdentity<StringType>::ToBuffer(SshAgentMessageBufferWriter& writer)const
 {
 	writer.WriteString(blob);
 	writer.WriteString(comment);
 }
 
-bool sab::SshAgentDsaKey::FromBuffer(SshAgentMessageBufferReader& reader)
+template<typename StringType>
+bool sab::BasicSshAgentDsaKey<StringType>::FromBuffer(SshAgentMessageBufferReader& reader)
 {
 	return reader.ReadString(p)
 		&& reader.ReadString(q)
@@ -22,7 +25,8 @@ bool sab::SshAgentDsaKey::FromBuffer(SshAgentMessageBufferReader& reader)
 		&& reader.ReadString(x);
 }
 
-void sab::SshAgentDsaKey::ToBuffer(SshAgentMessageBufferWriter& writer)const
+template<typename StringType>
+void sab::BasicSshAgentDsaKey<StringType>::ToBuffer(SshAgentMessageBufferWriter& writer)const
 {
 	writer.WriteString(p);
 	writer.WriteString(q);
@@ -31,33 +35,38 @@ void sab::SshAgentDsaKey::ToBuffer(SshAgentMessageBufferWriter& writer)const
 	writer.WriteString(x);
 }
 
-bool sab::SshAgentEcdsaKey::FromBuffer(SshAgentMessageBufferReader& reader)
+template<typename StringType>
+bool sab::BasicSshAgentEcdsaKey<StringType>::FromBuffer(SshAgentMessageBufferReader& reader)
 {
 	return reader.ReadString(ecdsaCurveName)
 		&& reader.ReadString(Q)
 		&& reader.ReadString(d);
 }
 
-void sab::SshAgentEcdsaKey::ToBuffer(SshAgentMessageBufferWriter& writer)const
+template<typename StringType>
+void sab::BasicSshAgentEcdsaKey<StringType>::ToBuffer(SshAgentMessageBufferWriter& writer)const
 {
 	writer.WriteString(ecdsaCurveName);
 	writer.WriteString(Q);
 	writer.WriteString(d);
 }
 
-bool sab::SshAgentEd25519Key::FromBuffer(SshAgentMessageBufferReader& reader)
+template<typename StringType>
+bool sab::BasicSshAgentEd25519Key<StringType>::FromBuffer(SshAgentMessageBufferReader& reader)
 {
 	return reader.ReadString(encA)
 		&& reader.ReadString(kEncA);
 }
 
-void sab::SshAgentEd25519Key::ToBuffer(SshAgentMessageBufferWriter& writer)const
+template<typename StringType>
+void sab::BasicSshAgentEd25519Key<StringType>::ToBuffer(SshAgentMessageBufferWriter& writer)const
 {
 	writer.WriteString(encA);
 	writer.WriteString(kEncA);
 }
 
-bool sab::SshAgentRsaKey::FromBuffer(SshAgentMessageBufferReader& reader)
+template<typename StringType>
+bool sab::BasicSshAgentRsaKey<StringType>::FromBuffer(SshAgentMessageBufferReader& reader)
 {
 	return reader.ReadString(n)
 		&& reader.ReadString(e)
@@ -67,7 +76,8 @@ bool sab::SshAgentRsaKey::FromBuffer(SshAgentMessageBufferReader& reader)
 		&& reader.ReadString(q);
 }
 
-void sab::SshAgentRsaKey::ToBuffer(SshAgentMessageBufferWriter& writer)const
+template<typename StringType>
+void sab::BasicSshAgentRsaKey<StringType>::ToBuffer(SshAgentMessageBufferWriter& writer)const
 {
 	writer.WriteString(n);
 	writer.WriteString(e);
@@ -77,6 +87,17 @@ void sab::SshAgentRsaKey::ToBuffer(SshAgentMessageBufferWriter& writer)const
 	writer.WriteString(q);
 }
 
+template class sab::BasicSshAgentIdentity<std::string>;
+template class sab::BasicSshAgentIdentity<std::string_view>;
+template class sab::BasicSshAgentDsaKey<std::string>;
+template class sab::BasicSshAgentDsaKey<std::string_view>;
+template class sab::BasicSshAgentEcdsaKey<std::string>;
+template class sab::BasicSshAgentEcdsaKey<std::string_view>;
+template class sab::BasicSshAgentEd25519Key<std::string>;
+template class sab::BasicSshAgentEd25519Key<std::string_view>;
+template class sab::BasicSshAgentRsaKey<std::string>;
+template class sab::BasicSshAgentRsaKey<std::string_view>;
+
 bool sab::SshAgentMessageGenericSuccess::FromBuffer(SshAgentMessageBufferReader& reader)
 {
 	char id;
@@ -144,3 +165,38 @@ void sab::SshAgentMessageRequestIdentitiesAnswer::ToBuffer(SshAgentMessageBuffer
 		identity.ToBuffer(writer);
 	}
 }
+
+bool sab::SshAgentMessageRequestIdentitiesAnswerView::FromBuffer(SshAgentMessageBufferReader& reader)
+{
+	char id;
+	count = 0;
+	identityData = std::string_view();
+	if (reader.ReadByte(id) && id == ID && reader.ReadUInt32(count))
+	{
+		// walk once so ForEach never meets a truncated identity
+		std::string_view begin = reader.Remaining();
+		SshAgentIdentityView identity;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (!identity.FromBuffer(reader))
+			{
+				count = 0;
+				return false;
+			}
+		}
+		identityData = begin.substr(0, begin.size() - reader.Remaining().size());
+		return true;
+	}
+	count = 0;
+	return false;
+}
+
+void sab::SshAgentMessageRequestIdentitiesAnswerView::ToBuffer(SshAgentMessageBufferWriter& writer)const
+{
+	writer.WriteByte(ID);
+	writer.WriteUInt32(count);
+	ForEach([&](const SshAgentIdentityView& identity)
+		{
+			identity.ToBuffer(writer);
+		});
+}
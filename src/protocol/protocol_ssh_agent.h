@@ -4,6 +4,7 @@
 #include "protocol_ssh_helper.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 
@@ -20,68 +21,89 @@ namespace sab
 	static constexpr char SSH2_AGENTC_REMOVE_IDENTITY = 18;
 	static constexpr char SSH2_AGENTC_REMOVE_ALL_IDENTITIES = 19;
 
-	class SshAgentIdentity
+	template<typename StringType>
+	class BasicSshAgentIdentity
 	{
 	public:
 		bool FromBuffer(SshAgentMessageBufferReader& reader);
 		void ToBuffer(SshAgentMessageBufferWriter& writer)const;
 	public:
-		std::string blob;
-		std::string comment;
+		StringType blob;
+		StringType comment;
 	};
 
-	class SshAgentDsaKey
+	template<typename StringType>
+	class BasicSshAgentDsaKey
 	{
 	public:
 		static constexpr auto TYPE_PREFIX = "ssh-dss";
 		bool FromBuffer(SshAgentMessageBufferReader& reader);
 		void ToBuffer(SshAgentMessageBufferWriter& writer)const;
 	public:
-		std::string p;
-		std::string q;
-		std::string g;
-		std::string y;
-		std::string x;
+		StringType p;
+		StringType q;
+		StringType g;
+		StringType y;
+		StringType x;
 	};
 
-	class SshAgentEcdsaKey
+	template<typename StringType>
+	class BasicSshAgentEcdsaKey
 	{
 	public:
 		static constexpr auto TYPE_PREFIX = "ecdsa-sha2-";
 		bool FromBuffer(SshAgentMessageBufferReader& reader);
 		void ToBuffer(SshAgentMessageBufferWriter& writer)const;
 	public:
-		std::string ecdsaCurveName;
-		std::string Q;
-		std::string d;
+		StringType ecdsaCurveName;
+		StringType Q;
+		StringType d;
 	};
 
-	class SshAgentEd25519Key
+	template<typename StringType>
+	class BasicSshAgentEd25519Key
 	{
 	public:
 		static constexpr auto TYPE_PREFIX = "ssh-ed25519";
 		bool FromBuffer(SshAgentMessageBufferReader& reader);
 		void ToBuffer(SshAgentMessageBufferWriter& writer)const;
 	public:
-		std::string encA;
-		std::string kEncA;
+		StringType encA;
+		StringType kEncA;
 	};
 
-	class SshAgentRsaKey
+	template<typename StringType>
+	class BasicSshAgentRsaKey
 	{
 	public:
 		static constexpr auto TYPE_PREFIX = "ssh-rsa";
 		bool FromBuffer(SshAgentMessageBufferReader& reader);
 		void ToBuffer(SshAgentMessageBufferWriter& writer)const;
 	public:
-		std::string n;
-		std::string e;
-		std::string d;
-		std::string iqmp;
-		std::string p;
-		std::string q;
+		StringType n;
+		StringType e;
+		StringType d;
+		StringType iqmp;
+		StringType p;
+		StringType q;
 	};
 
+	/*
+	 * Owning variants copy every field, view variants refer to the buffer
+	 * they were read from and must not outlive it.
+	 */
+	using SshAgentIdentity = BasicSshAgentIdentity<std::string>;
+	using SshAgentDsaKey = BasicSshAgentDsaKey<std::string>;
+	using SshAgentEcdsaKey = BasicSshAgentEcdsaKey<std::string>;
+	using SshAgentEd25519Key = BasicSshAgentEd25519Key<std::string>;
+	using SshAgentRsaKey = BasicSshAgentRsaKey<std::string>;
+
+	using SshAgentIdentityView = BasicSshAgentIdentity<std::string_view>;
+	using SshAgentDsaKeyView = BasicSshAgentDsaKey<std::string_view>;
+	using SshAgentEcdsaKeyView = BasicSshAgentEcdsaKey<std::string_view>;
+	using SshAgentEd25519KeyView = BasicSshAgentEd25519Key<std::string_view>;
+	using SshAgentRsaKeyView = BasicSshAgentRsaKey<std::string_view>;
+
 	class SshAgentMessageGenericSuccess
 	{
 	public:
@@ -117,6 +139,36 @@ namespace sab
 
 	};
 
+	/// <summary>
+	/// Non-owning identities answer, validates the message once and then
+	/// enumerates identities straight from the source buffer without allocating
+	/// </summary>
+	class SshAgentMessageRequestIdentitiesAnswerView
+	{
+	public:
+		static constexpr char ID = SSH2_AGENT_IDENTITIES_ANSWER;
+		bool FromBuffer(SshAgentMessageBufferReader& reader);
+		void ToBuffer(SshAgentMessageBufferWriter& writer)const;
 
+		uint32_t Count()const { return count; }
+
+		/// <summary>
+		/// call func(const SshAgentIdentityView&) for every identity in order
+		/// </summary>
+		template<typename Func>
+		void ForEach(Func&& func)const
+		{
+			SshAgentMessageBufferReader reader(identityData);
+			SshAgentIdentityView identity;
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				identity.FromBuffer(reader);
+				func(static_cast<const SshAgentIdentityView&>(identity));
+			}
+		}
+	private:
+		uint32_t count = 0;
+		std::string_view identityData;
+	};
 
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 
 #include "protocol_ssh_helper.h"
 
+#include <cstring>
+
+#ifdef _MSC_VER
 #include <intrin.h>
 
 static void ByteSwap(uint32_t& value)
@@ -12,10 +15,21 @@ static void ByteSwap(uint64_t& value)
 {
 	value = _byteswap_uint64(value);
 }
+#else
+static void ByteSwap(uint32_t& value)
+{
+	value = __builtin_bswap32(value);
+}
+
+static void ByteSwap(uint64_t& value)
+{
+	value = __builtin_bswap64(value);
+}
+#endif
 
 bool sab::SshAgentMessageBufferReader::CanConsume(size_t bytes) const
 {
-	return next + bytes <= envelope.length;
+	return bytes <= length - next;
 }
 
 void sab::SshAgentMessageBufferReader::Reset()
@@ -27,7 +41,7 @@ bool sab::SshAgentMessageBufferReader::ReadByte(char& data)
 {
 	if (!CanConsume(sizeof(char)))
 		return false;
-	data = envelope.data[next];
+	data = this->data[next];
 	next += sizeof(char);
 	return true;
 }
@@ -36,7 +50,7 @@ bool sab::SshAgentMessageBufferReader::ReadBoolean(bool& data)
 {
 	if (!CanConsume(sizeof(char)))
 		return false;
-	data = envelope.data[next];
+	data = this->data[next];
 	next += sizeof(char);
 	return true;
 }
@@ -45,7 +59,7 @@ bool sab::SshAgentMessageBufferReader::ReadUInt32(uint32_t& data)
 {
 	if (!CanConsume(sizeof(uint32_t)))
 		return false;
-	memcpy(&data, envelope.data.data() + next, sizeof(uint32_t));
+	memcpy(&data, this->data + next, sizeof(uint32_t));
 	ByteSwap(data);
 	next += sizeof(uint32_t);
 	return true;
@@ -55,25 +69,41 @@ bool sab::SshAgentMessageBufferReader::ReadUInt64(uint64_t& data)
 {
 	if (!CanConsume(sizeof(uint64_t)))
 		return false;
-	memcpy(&data, envelope.data.data() + next, sizeof(uint64_t));
+	memcpy(&data, this->data + next, sizeof(uint64_t));
 	ByteSwap(data);
 	next += sizeof(uint64_t);
 	return true;
 }
 
 bool sab::SshAgentMessageBufferReader::ReadString(std::string& data)
+{
+	std::string_view view;
+	if (!ReadString(view))
+		return false;
+	data.assign(view.data(), view.size());
+	return true;
+}
+
+bool sab::SshAgentMessageBufferReader::ReadString(std::string_view& data)
 {
 	uint32_t length;
-	if (!ReadUInt32(length) || !CanConsume(length))
+	if (!ReadUInt32(length))
+		return false;
+	if (!CanConsume(length))
 	{
 		next -= sizeof(uint32_t);
 		return false;
 	}
-	data.assign(envelope.data.data() + next, envelope.data.data() + next + length);
+	data = std::string_view(reinterpret_cast<const char*>(this->data + next), length);
 	next += length;
 	return true;
 }
 
+std::string_view sab::SshAgentMessageBufferReader::Remaining() const
+{
+	return std::string_view(reinterpret_cast<const char*>(data + next), length - next);
+}
+
 void sab::SshAgentMessageBufferWriter::Init()
 {
 	envelope.data.clear();
@@ -108,7 +138,7 @@ void sab::SshAgentMessageBufferWriter::WriteUInt64(uint64_t data)
 	envelope.length += sizeof(uint64_t);
 }
 
-void sab::SshAgentMessageBufferWriter::WriteString(const std::string& data)
+void sab::SshAgentMessageBufferWriter::WriteString(std::string_view data)
 {
 	WriteUInt32(static_cast<uint32_t>(data.size()));
 	envelope.data.insert(envelope.data.end(), data.begin(), data.end());
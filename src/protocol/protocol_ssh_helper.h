@@ -6,6 +6,7 @@
 #include <memory>
 #include <functional>
 #include <string>
+#include <string_view>
 
 namespace sab
 {
@@ -19,7 +20,7 @@ namespace sab
 		/// <summary>
 		/// the length of the message, native byte order
 		/// </summary>
-		uint32_t length;
+		uint32_t length = 0;
 
 		/// <summary>
 		/// data contained
@@ -37,10 +38,15 @@ namespace sab
 	static constexpr size_t MAX_MESSAGE_SIZE = 256 * 1024;
 	static constexpr size_t HEADER_SIZE = sizeof(uint32_t);
 
+	/// <summary>
+	/// Reads ssh agent protocol fields from a byte span.
+	/// The span must outlive the reader and any view read from it.
+	/// </summary>
 	class SshAgentMessageBufferReader
 	{
 	private:
-		const SshMessageEnvelope& envelope;
+		const uint8_t* data;
+		size_t length;
 		size_t next = 0;
 
 		bool CanConsume(size_t bytes)const;
@@ -52,8 +58,23 @@ namespace sab
 		bool ReadUInt64(uint64_t& data);
 		bool ReadString(std::string& data);
 
+		/// <summary>
+		/// read a string field without copying
+		/// </summary>
+		/// <param name="data">receives a view into the underlying buffer</param>
+		/// <returns>true for success</returns>
+		bool ReadString(std::string_view& data);
+
+		/// <summary>
+		/// get the unread part of the buffer
+		/// </summary>
+		std::string_view Remaining()const;
+
 		SshAgentMessageBufferReader(const SshMessageEnvelope& envelope)
-			:envelope(envelope) {}
+			:data(envelope.data.data()), length(envelope.length) {}
+
+		SshAgentMessageBufferReader(std::string_view span)
+			:data(reinterpret_cast<const uint8_t*>(span.data())), length(span.size()) {}
 	};
 
 	class SshAgentMessageBufferWriter
@@ -66,7 +87,7 @@ namespace sab
 		void WriteBool(bool data);
 		void WriteUInt32(uint32_t data);
 		void WriteUInt64(uint64_t data);
-		void WriteString(const std::string& data);
+		void WriteString(std::string_view data);
 
 		SshAgentMessageBufferWriter(SshMessageEnvelope& envelope)
 			:envelope(envelope) {}
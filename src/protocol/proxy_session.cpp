@@ -0,0 +1,312 @@
+#include "../log.h"
+#include "../trace.h"
+#include "proxy_session.h"
+#include "protocol_ssh_agent.h"
+
+#include <cstring>
+
+sab::ProxySession::ProxySession()
+	:state(State::Initialized), traceId(TraceRing::NewContextId()),
+	readOffset(0), readNeedBytes(0),
+	writeOffset(0), writeNeedBytes(0),
+	gatherWrite(true), writing(false), readClosed(false),
+	barrierPending(false), barrierHeld(false)
+{
+}
+
+void sab::ProxySession::SetState(State next)noexcept
+{
+	state = next;
+	TraceRing::GetInstance().Record(TraceEvent::State, traceId,
+		static_cast<uint8_t>(next), 0, 0);
+}
+
+void sab::ProxySession::BeginRead(std::unique_ptr<ProxyRequest> request)
+{
+	request->message.data.clear();
+	request->replied = false;
+	readRequest = std::move(request);
+	SetState(State::ReadHeader);
+	readOffset = 0;
+	readNeedBytes = HEADER_SIZE;
+}
+
+std::unique_ptr<sab::ProxyRequest> sab::ProxySession::TakeFreeRequest()
+{
+	if (freeRequests.empty())
+		return nullptr;
+	auto request = std::move(freeRequests.back());
+	freeRequests.pop_back();
+	return request;
+}
+
+sab::ProxyBuffer sab::ProxySession::ReadTarget()const
+{
+	ProxyRequest* request = readRequest.get();
+	if (state == State::ReadHeader)
+	{
+		return { request->header + readOffset, readNeedBytes };
+	}
+	// body is read in place, no bounce buffer
+	return { request->message.data.data() + (readOffset - HEADER_SIZE), readNeedBytes };
+}
+
+sab::ProxySession::ReadResult sab::ProxySession::OnRead(size_t transferred)
+{
+	ProxyRequest* request = readRequest.get();
+	TraceRing::GetInstance().Record(TraceEvent::Read, traceId,
+		static_cast<uint8_t>(state), 0, static_cast<uint32_t>(transferred));
+
+	switch (state)
+	{
+	case State::ReadHeader:
+		if (transferred == 0 && readOffset == 0 && !pendingRequests.empty())
+		{
+			// remote finished sending, answer what it has sent before closing
+			LogDebug(L"remote closed, ", pendingRequests.size(), L" replies pending");
+			readClosed = true;
+			SetState(State::WaitReply);
+			return ReadResult::Closed;
+		}
+		if (transferred == 0 || transferred > readNeedBytes)
+			return ReadResult::Invalid;
+		readOffset += transferred;
+		readNeedBytes -= transferred;
+		if (readNeedBytes > 0)
+			return ReadResult::Continue; // short read, continue reading header
+
+		request->message.length = (static_cast<uint32_t>(request->header[0]) << 24)
+			| (static_cast<uint32_t>(request->header[1]) << 16)
+			| (static_cast<uint32_t>(request->header[2]) << 8)
+			| static_cast<uint32_t>(request->header[3]);
+		if (request->message.length > MAX_MESSAGE_SIZE)
+		{
+			LogDebug(L"message too long: ", request->message.length);
+			return ReadResult::Invalid;
+		}
+		if (request->message.length == 0)
+		{
+			LogDebug(L"empty message!");
+			return ReadResult::Invalid;
+		}
+
+		SetState(State::ReadBody);
+		request->message.data.resize(request->message.length);
+		readNeedBytes = request->message.length;
+		return ReadResult::Continue;
+	case State::ReadBody:
+		if (transferred == 0 || transferred > readNeedBytes)
+		{
+			LogDebug(L"unexpected read length: ", transferred);
+			return ReadResult::Invalid;
+		}
+		readOffset += transferred;
+		readNeedBytes -= transferred;
+		if (readNeedBytes > 0)
+			return ReadResult::Continue;
+
+		if (!IsReorderable(request->message))
+		{
+			// keep execution order around requests changing agent state
+			pendingRequests.emplace_back(std::move(readRequest));
+			barrierPending = true;
+			SetState(State::WaitReply);
+			if (pendingRequests.size() > 1)
+			{
+				barrierHeld = true;
+				return ReadResult::Hold;
+			}
+			TraceRing::GetInstance().Record(TraceEvent::Dispatch, traceId,
+				static_cast<uint8_t>(state), request->message.data[0], request->message.length);
+			return ReadResult::Dispatch;
+		}
+
+		// finished read, dispatch and go on with next request
+		TraceRing::GetInstance().Record(TraceEvent::Dispatch, traceId,
+			static_cast<uint8_t>(state), request->message.data[0], request->message.length);
+		pendingRequests.emplace_back(std::move(readRequest));
+		SetState(pendingRequests.size() >= MAX_PENDING_REQUESTS ? State::WaitReply : State::Ready);
+		return ReadResult::Dispatch;
+	default:
+		LogDebug(L"illegal state for reading!");
+		return ReadResult::Invalid;
+	}
+}
+
+bool sab::ProxySession::IsReorderable(const SshMessageEnvelope& message)
+{
+	switch (message.data[0])
+	{
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+	case SSH2_AGENTC_SIGN_REQUEST:
+		return true;
+	default:
+		return false;
+	}
+}
+
+sab::ProxyRequest* sab::ProxySession::TakeHeldRequest()
+{
+	// reading stopped at the barrier, it is the only request left
+	if (!barrierHeld || pendingRequests.size() != 1)
+		return nullptr;
+	barrierHeld = false;
+	ProxyRequest* request = pendingRequests.front().get();
+	TraceRing::GetInstance().Record(TraceEvent::Dispatch, traceId,
+		static_cast<uint8_t>(state), request->message.data[0], request->message.length);
+	return request;
+}
+
+bool sab::ProxySession::MarkReplied(const SshMessageEnvelope* message)
+{
+	for (auto& request : pendingRequests)
+	{
+		if (&request->message == message)
+		{
+			request->replied = true;
+			TraceRing::GetInstance().Record(TraceEvent::Reply, traceId,
+				static_cast<uint8_t>(state),
+				message->data.empty() ? 0 : message->data[0],
+				static_cast<uint32_t>(message->data.size()));
+			return true;
+		}
+	}
+	return false;
+}
+
+bool sab::ProxySession::BeginWrite()
+{
+	if (writing || pendingRequests.empty())
+		return false;
+	ProxyRequest* request = pendingRequests.front().get();
+	if (!request->replied)
+		return false; // keep request order
+
+	request->message.length = static_cast<uint32_t>(request->message.data.size());
+	uint32_t length = request->message.length;
+	request->header[0] = static_cast<uint8_t>(length >> 24);
+	request->header[1] = static_cast<uint8_t>(length >> 16);
+	request->header[2] = static_cast<uint8_t>(length >> 8);
+	request->header[3] = static_cast<uint8_t>(length);
+	if (!gatherWrite)
+	{
+		// one write and one completion per reply, the frame keeps its
+		// capacity across requests of the connection
+		request->frame.assign(request->header, request->header + HEADER_SIZE);
+		request->frame.insert(request->frame.end(),
+			request->message.data.begin(), request->message.data.end());
+	}
+	writeOffset = 0;
+	writeNeedBytes = length + HEADER_SIZE;
+	writing = true;
+	return true;
+}
+
+size_t sab::ProxySession::WriteTarget(ProxyBuffer buffers[2])const
+{
+	ProxyRequest* request = pendingRequests.front().get();
+	if (!gatherWrite)
+	{
+		buffers[0] = { request->frame.data() + writeOffset, writeNeedBytes };
+		return 1;
+	}
+
+	size_t count = 0;
+	size_t offset = writeOffset;
+
+	if (offset < HEADER_SIZE)
+	{
+		buffers[count++] = { request->header + offset, HEADER_SIZE - offset };
+		offset = HEADER_SIZE;
+	}
+	if (request->message.length > offset - HEADER_SIZE)
+	{
+		buffers[count++] = { request->message.data.data() + (offset - HEADER_SIZE),
+			request->message.length - (offset - HEADER_SIZE) };
+	}
+	return count;
+}
+
+sab::ProxySession::WriteResult sab::ProxySession::OnWrite(size_t transferred)
+{
+	TraceRing::GetInstance().Record(TraceEvent::Write, traceId,
+		static_cast<uint8_t>(state), 0, static_cast<uint32_t>(transferred));
+	if (transferred == 0 || transferred > writeNeedBytes)
+	{
+		LogDebug(L"unexpected write length: ", transferred);
+		return WriteResult::Invalid;
+	}
+	writeOffset += transferred;
+	writeNeedBytes -= transferred;
+	if (writeNeedBytes > 0)
+		return WriteResult::Continue;
+
+	// finished writing the oldest reply
+	writing = false;
+	auto finished = std::move(pendingRequests.front());
+	pendingRequests.pop_front();
+	if (pendingRequests.empty())
+		barrierPending = false;
+	if (freeRequests.size() < MAX_PENDING_REQUESTS)
+	{
+		freeRequests.emplace_back(std::move(finished));
+	}
+	return WriteResult::Finished;
+}
+
+bool sab::ProxySession::ResumeRead()
+{
+	if (readClosed || barrierPending || state != State::WaitReply
+		|| pendingRequests.size() >= MAX_PENDING_REQUESTS)
+		return false;
+	SetState(State::Ready);
+	return true;
+}
+
+bool sab::ProxySession::Drained()const
+{
+	return readClosed && pendingRequests.empty();
+}
+
+void sab::ProxySession::ReleaseRequests(std::vector<std::unique_ptr<ProxyRequest>>& requests)
+{
+	if (readRequest)
+	{
+		requests.emplace_back(std::move(readRequest));
+	}
+	for (auto& request : freeRequests)
+	{
+		requests.emplace_back(std::move(request));
+	}
+	freeRequests.clear();
+}
+
+std::unique_ptr<sab::ProxyRequest> sab::ProxyRequestPool::Take()
+{
+	std::lock_guard<std::mutex> lg(listMutex);
+	if (requestList.empty())
+		return nullptr;
+	auto request = std::move(requestList.back());
+	requestList.pop_back();
+	return request;
+}
+
+void sab::ProxyRequestPool::Recycle(std::vector<std::unique_ptr<ProxyRequest>>& requests)
+{
+	{
+		std::lock_guard<std::mutex> lg(listMutex);
+		for (auto& request : requests)
+		{
+			if (requestList.size() >= MAX_POOLED_REQUESTS)
+				break;
+			if (request->message.data.capacity() > MAX_POOLED_REQUEST_CAPACITY)
+				std::vector<uint8_t>().swap(request->message.data);
+			if (request->frame.capacity() > MAX_POOLED_REQUEST_CAPACITY)
+				std::vector<uint8_t>().swap(request->frame);
+			request->context.reset();
+			requestList.emplace_back(std::move(request));
+		}
+	}
+	// the rest is freed outside the lock
+	requests.clear();
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include "protocol_ssh_helper.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace sab
+{
+	/// <summary>
+	/// A request read from a proxy connection, kept by the session
+	/// until its reply has been written
+	/// </summary>
+	struct ProxyRequest
+	{
+		/// <summary>
+		/// ssh agent message, the reply replaces the request in place
+		/// </summary>
+		SshMessageEnvelope message;
+
+		/// <summary>
+		/// big endian length prefix being read or written
+		/// </summary>
+		uint8_t header[HEADER_SIZE];
+
+		/// <summary>
+		/// length prefix followed by the reply, built for owners
+		/// which cannot gather header and body in one write
+		/// </summary>
+		std::vector<uint8_t> frame;
+
+		/// <summary>
+		/// reply is filled into message
+		/// </summary>
+		bool replied = false;
+
+		/// <summary>
+		/// connection the request currently belongs to
+		/// </summary>
+		std::weak_ptr<void> context;
+	};
+
+	/// <summary>
+	/// A contiguous part of a framed message to read into or write from
+	/// </summary>
+	struct ProxyBuffer
+	{
+		uint8_t* data;
+		size_t length;
+	};
+
+	/// <summary>
+	/// Framing of one proxy connection, independent of how its i/o is done.
+	/// The owner issues reads and writes on the buffers the session points
+	/// to and reports the transferred bytes back.
+	///
+	/// Not thread safe, the owner serializes all calls of a connection.
+	/// </summary>
+	class ProxySession
+	{
+	public:
+		/// <summary>
+		/// max number of requests read ahead and waiting for reply
+		/// </summary>
+		static constexpr size_t MAX_PENDING_REQUESTS = 8;
+
+		enum class State
+		{
+			Initialized = 0,
+			Handshake,
+			Ready,
+			ReadHeader,
+			ReadBody,
+			WaitReply,
+			Destroyed,
+		};
+		/*
+		 * Reading side:
+		 * Initialized -> Handshake -> Ready -> ReadHeader -> ReadBody -+-> WaitReply
+		 *                               A                             |       |
+		 *                               +-----------------------------+-------+
+		 * A request is dispatched as soon as it has been read, and reading goes on
+		 * with the next one. The session waits in `WaitReply` only when
+		 * MAX_PENDING_REQUESTS requests are in flight, until the oldest is answered.
+		 *
+		 * Dispatcher workers may execute requests of one connection in any order,
+		 * which is only safe for listing and signing. Any other request is a
+		 * barrier: it is held until all earlier replies are written, and nothing
+		 * after it is read until its own reply is written.
+		 *
+		 * Writing side:
+		 * Replies are written one at a time in request order, a reply arriving
+		 * early waits until all earlier ones are written.
+		 *
+		 * Any state can go `Destroyed` when exception occurred/connection closes
+		 */
+
+		enum class ReadResult
+		{
+			// read the rest of the message
+			Continue = 0,
+			// a request is complete and was appended to pendingRequests
+			Dispatch,
+			// a barrier is complete and was appended to pendingRequests,
+			// TakeHeldRequest hands it out once earlier replies are written
+			Hold,
+			// remote finished sending, pending replies are still to be written
+			Closed,
+			// malformed message or unexpected end of stream
+			Invalid,
+		};
+
+		enum class WriteResult
+		{
+			// write the rest of the reply
+			Continue = 0,
+			// the oldest reply is written
+			Finished,
+			// unexpected write length
+			Invalid,
+		};
+	public:
+		/// <summary>
+		/// current state of reading side, changed through SetState
+		/// </summary>
+		State state;
+
+		/// <summary>
+		/// identifies the connection in the trace ring
+		/// </summary>
+		uint64_t traceId;
+
+		/// <summary>
+		/// request being read
+		/// </summary>
+		std::unique_ptr<ProxyRequest> readRequest;
+
+		/// <summary>
+		/// dispatched requests in arrival order
+		/// </summary>
+		std::deque<std::unique_ptr<ProxyRequest>> pendingRequests;
+
+		/// <summary>
+		/// written requests kept for reuse
+		/// </summary>
+		std::vector<std::unique_ptr<ProxyRequest>> freeRequests;
+
+		/// <summary>
+		/// bytes of the request being read already received,
+		/// counted from the first byte of the length prefix
+		/// </summary>
+		size_t readOffset;
+
+		/// <summary>
+		/// remaining bytes to complete the read
+		/// </summary>
+		size_t readNeedBytes;
+
+		/// <summary>
+		/// bytes of the oldest reply already written, counted from
+		/// the first byte of the length prefix
+		/// </summary>
+		size_t writeOffset;
+
+		/// <summary>
+		/// remaining bytes to complete the write
+		/// </summary>
+		size_t writeNeedBytes;
+
+		/// <summary>
+		/// the owner writes header and body with one gather call, otherwise
+		/// each reply is framed into one contiguous buffer first
+		/// </summary>
+		bool gatherWrite;
+
+		/// <summary>
+		/// a write is pending
+		/// </summary>
+		bool writing;
+
+		/// <summary>
+		/// remote closed its sending side, close after pending replies are written
+		/// </summary>
+		bool readClosed;
+
+		/// <summary>
+		/// the newest pending request is a barrier, reading stops until it is written
+		/// </summary>
+		bool barrierPending;
+
+		/// <summary>
+		/// the barrier has not been dispatched yet
+		/// </summary>
+		bool barrierHeld;
+	public:
+		ProxySession();
+
+		ProxySession(const ProxySession&) = delete;
+		ProxySession& operator=(const ProxySession&) = delete;
+
+		/// <summary>
+		/// enter a state and record the transition in the trace ring
+		/// </summary>
+		void SetState(State next)noexcept;
+
+		/// <summary>
+		/// start reading the next request into request
+		/// </summary>
+		void BeginRead(std::unique_ptr<ProxyRequest> request);
+
+		/// <summary>
+		/// take a recycled request of this session
+		/// </summary>
+		/// <returns>nullptr if there is none</returns>
+		std::unique_ptr<ProxyRequest> TakeFreeRequest();
+
+		/// <summary>
+		/// the part of the request the next read should fill
+		/// </summary>
+		ProxyBuffer ReadTarget()const;
+
+		/// <summary>
+		/// account a finished read. on Dispatch the session is `Ready` for the
+		/// next request, or `WaitReply` when too many requests are in flight
+		/// </summary>
+		/// <param name="transferred">bytes read, 0 for end of stream</param>
+		ReadResult OnRead(size_t transferred);
+
+		/// <summary>
+		/// requests which may run concurrently with other requests of the connection
+		/// </summary>
+		static bool IsReorderable(const SshMessageEnvelope& message);
+
+		/// <summary>
+		/// take the held barrier once every earlier reply is written
+		/// </summary>
+		/// <returns>the request to dispatch, nullptr if there is none</returns>
+		ProxyRequest* TakeHeldRequest();
+
+		/// <summary>
+		/// mark the request owning message as answered
+		/// </summary>
+		/// <returns>false if the message is not pending on this session</returns>
+		bool MarkReplied(const SshMessageEnvelope* message);
+
+		/// <summary>
+		/// start writing the oldest reply if it is ready and no write is pending
+		/// </summary>
+		/// <returns>true if a write should be issued</returns>
+		bool BeginWrite();
+
+		/// <summary>
+		/// the unwritten parts of the oldest reply, header and body,
+		/// or a single buffer without gatherWrite
+		/// </summary>
+		/// <param name="buffers">receives up to two buffers</param>
+		/// <returns>number of buffers</returns>
+		size_t WriteTarget(ProxyBuffer buffers[2])const;
+
+		/// <summary>
+		/// account a finished write. on Finished the written request is recycled
+		/// </summary>
+		WriteResult OnWrite(size_t transferred);
+
+		/// <summary>
+		/// leave `WaitReply` if there is room for another request
+		/// </summary>
+		/// <returns>true if the owner should start reading again</returns>
+		bool ResumeRead();
+
+		/// <summary>
+		/// remote closed and every reply has been written
+		/// </summary>
+		bool Drained()const;
+
+		/// <summary>
+		/// move requests not held by the dispatcher out of the session
+		/// </summary>
+		void ReleaseRequests(std::vector<std::unique_ptr<ProxyRequest>>& requests);
+	};
+
+	/// <summary>
+	/// Request objects left by closed sessions, shared by all connections of
+	/// a connection manager. Thread safe.
+	/// </summary>
+	class ProxyRequestPool
+	{
+	public:
+		/// <summary>
+		/// max number of request objects kept for new connections
+		/// </summary>
+		static constexpr size_t MAX_POOLED_REQUESTS = 64;
+
+		/// <summary>
+		/// buffers larger than this are freed before pooling a request
+		/// </summary>
+		static constexpr size_t MAX_POOLED_REQUEST_CAPACITY = 16 * 1024;
+	private:
+		std::vector<std::unique_ptr<ProxyRequest>> requestList;
+
+		std::mutex listMutex;
+	public:
+		/// <summary>
+		/// take a pooled request
+		/// </summary>
+		/// <returns>nullptr if the pool is empty</returns>
+		std::unique_ptr<ProxyRequest> Take();
+
+		/// <summary>
+		/// keep requests of a closed session, requests beyond the pool size are freed
+		/// </summary>
+		void Recycle(std::vector<std::unique_ptr<ProxyRequest>>& requests);
+	};
+}
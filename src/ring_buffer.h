@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace sab
+{
+	/// <summary>
+	/// Fixed capacity FIFO queue, storage is allocated once.
+	/// Not thread safe, callers provide synchronization.
+	/// </summary>
+	/// <typeparam name="T">element type, must be default constructible</typeparam>
+	template<typename T>
+	class RingBuffer
+	{
+	private:
+		std::vector<T> slots;
+		size_t head = 0;
+		size_t count = 0;
+	public:
+		explicit RingBuffer(size_t capacity)
+			:slots(capacity) {}
+
+		bool TryPush(T&& value)
+		{
+			if (count == slots.size())
+				return false;
+			slots[(head + count) % slots.size()] = std::move(value);
+			++count;
+			return true;
+		}
+
+		bool TryPop(T& value)
+		{
+			if (count == 0)
+				return false;
+			value = std::move(slots[head]);
+			// release resources held by the slot early
+			slots[head] = T();
+			head = (head + 1) % slots.size();
+			--count;
+			return true;
+		}
+
+		/// <summary>
+		/// change capacity, only allowed while the queue is empty
+		/// </summary>
+		/// <returns>false if the queue is not empty</returns>
+		bool Reset(size_t capacity)
+		{
+			if (count != 0)
+				return false;
+			slots.clear();
+			slots.resize(capacity);
+			head = 0;
+			return true;
+		}
+
+		bool Empty()const { return count == 0; }
+		bool Full()const { return count == slots.size(); }
+		size_t Size()const { return count; }
+		size_t Capacity()const { return slots.size(); }
+	};
+}
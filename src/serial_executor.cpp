@@ -0,0 +1,33 @@
+#include "serial_executor.h"
+
+sab::SerialExecutor::SerialExecutor()
+	:running(false)
+{
+}
+
+void sab::SerialExecutor::Execute(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lg(taskMutex);
+		taskList.emplace_back(std::move(task));
+		if (running)
+			return; // the running thread will pick it up
+		running = true;
+	}
+
+	while (true)
+	{
+		std::function<void()> current;
+		{
+			std::lock_guard<std::mutex> lg(taskMutex);
+			if (taskList.empty())
+			{
+				running = false;
+				return;
+			}
+			current = std::move(taskList.front());
+			taskList.pop_front();
+		}
+		current();
+	}
+}
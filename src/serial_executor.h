@@ -0,0 +1,37 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace sab
+{
+	/// <summary>
+	/// Runs tasks one at a time in submission order, on whichever thread
+	/// submits while the executor is idle. Tasks submitted while another
+	/// one is running (including from inside a task) are queued and run
+	/// by that thread afterwards, so no task ever runs concurrently with
+	/// or nested inside another one.
+	///
+	/// The owner of the executor must stay alive until Execute returns.
+	/// </summary>
+	class SerialExecutor
+	{
+	private:
+		std::deque<std::function<void()>> taskList;
+
+		std::mutex taskMutex;
+
+		bool running;
+	public:
+		SerialExecutor();
+
+		SerialExecutor(const SerialExecutor&) = delete;
+		SerialExecutor& operator=(const SerialExecutor&) = delete;
+
+		/// <summary>
+		/// run the task now if idle, otherwise queue it
+		/// </summary>
+		void Execute(std::function<void()> task);
+	};
+}
@@ -0,0 +1,96 @@
+#include "task_pool.h"
+
+sab::TaskPool::TaskPool()
+	:state(std::make_shared<State>())
+{
+}
+
+bool sab::TaskPool::Start(size_t threadCount)
+{
+	{
+		std::lock_guard<std::mutex> lg(state->listMutex);
+		state->cancelFlag = false;
+	}
+	try
+	{
+		for (size_t i = 0; i < threadCount; ++i)
+		{
+			threads.emplace_back(ThreadProc, state);
+		}
+	}
+	catch (...)
+	{
+		Stop();
+		return false;
+	}
+	return true;
+}
+
+void sab::TaskPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lg(state->listMutex);
+		state->cancelFlag = true;
+		state->wakeCondition.notify_all();
+	}
+	for (auto& t : threads)
+	{
+		if (t.joinable())
+			t.join();
+	}
+	threads.clear();
+}
+
+void sab::TaskPool::Abandon()
+{
+	std::deque<std::function<void()>> dropped;
+	{
+		std::lock_guard<std::mutex> lg(state->listMutex);
+		state->cancelFlag = true;
+		dropped.swap(state->taskList);
+		state->wakeCondition.notify_all();
+	}
+	for (auto& t : threads)
+	{
+		if (t.joinable())
+			t.detach();
+	}
+	threads.clear();
+	// detached threads keep the old state, a restart gets a fresh one
+	state = std::make_shared<State>();
+}
+
+bool sab::TaskPool::Post(std::function<void()> task)
+{
+	std::lock_guard<std::mutex> lg(state->listMutex);
+	if (state->cancelFlag || threads.empty())
+		return false;
+	state->taskList.emplace_back(std::move(task));
+	state->wakeCondition.notify_one();
+	return true;
+}
+
+sab::TaskPool::~TaskPool()
+{
+	Stop();
+}
+
+void sab::TaskPool::ThreadProc(std::shared_ptr<State> state)
+{
+	std::unique_lock<std::mutex> lk(state->listMutex);
+	while (true)
+	{
+		state->wakeCondition.wait(lk, [&]()
+			{
+				return !state->taskList.empty() || state->cancelFlag;
+			});
+		if (state->taskList.empty())
+			return; // cancelled and drained
+		auto task = std::move(state->taskList.front());
+		state->taskList.pop_front();
+		lk.unlock();
+		task();
+		task = nullptr;
+		lk.lock();
+	}
+}
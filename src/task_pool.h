@@ -0,0 +1,70 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sab
+{
+	/// <summary>
+	/// A fixed set of threads running posted tasks in FIFO order
+	/// </summary>
+	class TaskPool
+	{
+	private:
+		/// <summary>
+		/// shared with the threads, so abandoned ones may outlive the pool
+		/// </summary>
+		struct State
+		{
+			std::deque<std::function<void()>> taskList;
+
+			std::mutex listMutex;
+			std::condition_variable wakeCondition;
+
+			bool cancelFlag = false;
+		};
+
+		std::shared_ptr<State> state;
+
+		std::vector<std::thread> threads;
+	public:
+		TaskPool();
+
+		TaskPool(const TaskPool&) = delete;
+		TaskPool& operator=(const TaskPool&) = delete;
+
+		/// <summary>
+		/// start threads
+		/// </summary>
+		/// <param name="threadCount">number of threads</param>
+		/// <returns>true for success</returns>
+		bool Start(size_t threadCount);
+
+		/// <summary>
+		/// wait for queued tasks to finish then join all threads
+		/// </summary>
+		void Stop();
+
+		/// <summary>
+		/// stop without waiting, queued tasks are dropped and threads are
+		/// detached. a thread blocked in a task exits once the task returns,
+		/// so tasks must not reference anything the caller destroys
+		/// </summary>
+		void Abandon();
+
+		/// <summary>
+		/// queue a task
+		/// </summary>
+		/// <returns>false if the pool is stopped</returns>
+		bool Post(std::function<void()> task);
+
+		~TaskPool();
+	private:
+		static void ThreadProc(std::shared_ptr<State> state);
+	};
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace sab
+{
+	/// <summary>
+	/// Hashed timer wheel, scheduling is O(1) and advancing costs one slot
+	/// per tick. Deadlines are rounded up to the next tick.
+	/// Not thread safe, callers provide synchronization.
+	/// </summary>
+	/// <typeparam name="T">item type</typeparam>
+	template<typename T>
+	class TimerWheel
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+	private:
+		struct Entry
+		{
+			T item;
+			// full turns of the wheel left before expiring
+			size_t rounds;
+		};
+
+		std::vector<std::vector<Entry>> slots;
+		Clock::duration tick;
+		// slot of currentTime
+		size_t current;
+		Clock::time_point currentTime;
+		size_t count;
+	public:
+		TimerWheel(Clock::duration tick, size_t slotCount, Clock::time_point start = Clock::now())
+			:slots(slotCount), tick(tick), current(0), currentTime(start), count(0) {}
+
+		/// <summary>
+		/// add an item expiring at deadline, past deadlines expire on next tick
+		/// </summary>
+		void Schedule(T item, Clock::time_point deadline)
+		{
+			size_t ticks = 1;
+			if (deadline > currentTime)
+			{
+				ticks = static_cast<size_t>((deadline - currentTime + tick - Clock::duration(1)) / tick);
+				if (ticks == 0)
+					ticks = 1;
+			}
+			slots[(current + ticks) % slots.size()].push_back(
+				Entry{ std::move(item), (ticks - 1) / slots.size() });
+			++count;
+		}
+
+		/// <summary>
+		/// move the wheel to now, call expired(item) for every due item.
+		/// expired may schedule items again.
+		/// </summary>
+		template<typename F>
+		void Advance(Clock::time_point now, F&& expired)
+		{
+			std::vector<Entry> due;
+			while (currentTime + tick <= now)
+			{
+				current = (current + 1) % slots.size();
+				currentTime += tick;
+				due.swap(slots[current]);
+				for (auto& entry : due)
+				{
+					if (entry.rounds > 0)
+					{
+						--entry.rounds;
+						slots[current].push_back(std::move(entry));
+					}
+					else
+					{
+						--count;
+						expired(std::move(entry.item));
+					}
+				}
+				due.clear();
+			}
+		}
+
+		Clock::duration Tick()const { return tick; }
+
+		size_t Size()const { return count; }
+
+		bool Empty()const { return count == 0; }
+	};
+}
@@ -0,0 +1,199 @@
+#include "trace.h"
+#include "log.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include "encoding.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static int64_t SteadyNanoseconds()noexcept
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t CurrentThreadId()noexcept
+{
+	// the id the debugger and the log of the OS show
+	thread_local uint32_t id =
+#ifdef _WIN32
+		static_cast<uint32_t>(GetCurrentThreadId());
+#else
+		static_cast<uint32_t>(syscall(SYS_gettid));
+#endif
+	return id;
+}
+
+#ifdef _WIN32
+/// <summary>
+/// map size bytes of a new file at path, the previous one is renamed to path.old
+/// </summary>
+/// <returns>nullptr on failure</returns>
+static void* MapTraceFile(const std::wstring& path, size_t size)
+{
+	MoveFileExW(path.c_str(), (path + L".old").c_str(), MOVEFILE_REPLACE_EXISTING);
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		LogError(L"cannot create trace file ", path, L": ", GetLastError());
+		return nullptr;
+	}
+	// the mapping and the view keep the file open
+	ULARGE_INTEGER mappingSize;
+	mappingSize.QuadPart = size;
+	HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE,
+		mappingSize.HighPart, mappingSize.LowPart, nullptr);
+	CloseHandle(file);
+	if (mapping == NULL)
+	{
+		LogError(L"cannot map trace file ", path, L": ", GetLastError());
+		return nullptr;
+	}
+	void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	CloseHandle(mapping);
+	if (view == nullptr)
+	{
+		LogError(L"cannot map trace file ", path, L": ", GetLastError());
+		return nullptr;
+	}
+	return view;
+}
+#else
+static void* MapTraceFile(const std::wstring& path, size_t size)
+{
+	std::string utf8Path = sab::WideStringToUtf8String(path);
+	std::rename(utf8Path.c_str(), (utf8Path + ".old").c_str());
+	int fd = open(utf8Path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		LogError(L"cannot create trace file ", path, L": ", std::strerror(errno));
+		return nullptr;
+	}
+	void* view = MAP_FAILED;
+	if (ftruncate(fd, static_cast<off_t>(size)) == 0)
+		view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int error = errno;
+	close(fd);
+	if (view == MAP_FAILED)
+	{
+		LogError(L"cannot map trace file ", path, L": ", std::strerror(error));
+		return nullptr;
+	}
+	return view;
+}
+#endif
+
+sab::TraceRing& sab::TraceRing::GetInstance()
+{
+	static TraceRing* instance = new TraceRing();
+	return *instance;
+}
+
+std::wstring sab::TraceRing::GetDefaultPath()
+{
+#ifdef _WIN32
+	const wchar_t* appData = _wgetenv(L"APPDATA");
+	if (appData == nullptr)
+		return std::wstring();
+	return std::wstring(appData) + L"\\ssh-agent-bridge.trace";
+#else
+	const char* home = std::getenv("HOME");
+	if (home == nullptr)
+		return std::wstring();
+	// HOME is ascii in practice, widen it byte by byte
+	std::string narrow = std::string(home) + "/.ssh-agent-bridge.trace";
+	return std::wstring(narrow.begin(), narrow.end());
+#endif
+}
+
+bool sab::TraceRing::Open(const std::wstring& path, size_t capacity)
+{
+	if (IsOpen() || path.empty() || capacity == 0 || capacity > MAX_CAPACITY)
+		return false;
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+
+	void* view = MapTraceFile(path, sizeof(TraceFileHeader) + size * sizeof(TraceRecord));
+	if (view == nullptr)
+		return false;
+
+	// the file starts zeroed, so every slot reads as never completed
+	auto header = static_cast<TraceFileHeader*>(view);
+	std::memcpy(header->magic, TraceFileHeader::MAGIC, sizeof(header->magic));
+	header->version = TraceFileHeader::VERSION;
+	header->recordSize = sizeof(TraceRecord);
+	header->capacity = size;
+	header->timeBase = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	steadyBase = SteadyNanoseconds();
+	mask = size - 1;
+
+	// the mapping is never unmapped, records may be written until the process exits
+	records.store(reinterpret_cast<TraceRecord*>(header + 1), std::memory_order_release);
+	LogInfo(L"tracing ", size, L" records to ", path);
+	return true;
+}
+
+void sab::TraceRing::Record(TraceEvent event, uint64_t contextId,
+	uint8_t state, uint8_t messageType, uint32_t length)noexcept
+{
+	TraceRecord* ring = records.load(std::memory_order_acquire);
+	if (ring == nullptr)
+		return;
+	uint64_t index = nextIndex.fetch_add(1, std::memory_order_relaxed);
+	TraceRecord& record = ring[index & mask];
+
+	// a reader of the file skips the slot while it is rewritten, and a
+	// writer lapping a slow one is caught by the sequence not matching
+	auto sequence = reinterpret_cast<std::atomic<uint64_t>*>(&record.sequence);
+	sequence->store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	record.timestamp = static_cast<uint64_t>(SteadyNanoseconds() - steadyBase);
+	record.contextId = contextId;
+	record.threadId = CurrentThreadId();
+	record.length = length;
+	record.event = static_cast<uint8_t>(event);
+	record.state = state;
+	record.messageType = messageType;
+	sequence->store(index + 1, std::memory_order_release);
+}
+
+uint64_t sab::TraceRing::NewContextId()noexcept
+{
+	static std::atomic<uint64_t> lastId{ 0 };
+	return lastId.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+const char* sab::TraceEventToString(uint8_t event)
+{
+	switch (static_cast<TraceEvent>(event))
+	{
+	case TraceEvent::State:
+		return "state";
+	case TraceEvent::Read:
+		return "read";
+	case TraceEvent::Dispatch:
+		return "dispatch";
+	case TraceEvent::Reply:
+		return "reply";
+	case TraceEvent::Write:
+		return "write";
+	default:
+		return "invalid";
+	}
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sab
+{
+	/// <summary>
+	/// What a trace record reports
+	/// </summary>
+	enum class TraceEvent : uint8_t
+	{
+		Invalid = 0,
+		// the connection entered `state`
+		State,
+		// a read completed with `length` bytes
+		Read,
+		// a request of `messageType` and `length` went to the dispatcher
+		Dispatch,
+		// the reply of `messageType` and `length` came back
+		Reply,
+		// a write completed with `length` bytes
+		Write,
+	};
+
+	/// <summary>
+	/// Start of the trace file, followed by `capacity` records
+	/// </summary>
+	struct TraceFileHeader
+	{
+		static constexpr char MAGIC[8] = { 'S', 'A', 'B', 'T', 'R', 'A', 'C', 'E' };
+		static constexpr uint32_t VERSION = 1;
+
+		char magic[8];
+		uint32_t version;
+		uint32_t recordSize;
+		uint64_t capacity;
+		/// <summary>
+		/// wall clock at open, nanoseconds since unix epoch,
+		/// record timestamps count from here
+		/// </summary>
+		uint64_t timeBase;
+		uint8_t reserved[32];
+	};
+	static_assert(sizeof(TraceFileHeader) == 64, "trace file layout changed");
+
+	/// <summary>
+	/// One fixed size entry of the ring, slot is sequence - 1 modulo capacity
+	/// </summary>
+	struct TraceRecord
+	{
+		/// <summary>
+		/// 1 based write order, written last. 0 for a slot never completed
+		/// </summary>
+		uint64_t sequence;
+		/// <summary>
+		/// nanoseconds since TraceFileHeader::timeBase
+		/// </summary>
+		uint64_t timestamp;
+		uint64_t contextId;
+		uint32_t threadId;
+		uint32_t length;
+		uint8_t event;
+		uint8_t state;
+		uint8_t messageType;
+		uint8_t reserved[5];
+	};
+	static_assert(sizeof(TraceRecord) == 40, "trace file layout changed");
+
+	/// <summary>
+	/// Always-on binary trace of proxy connections, fixed size records in a
+	/// memory mapped ring file. Writing one costs a counter increment and a
+	/// few stores, the OS writes the pages back, so the trace survives a
+	/// crash of the process. Decode it with trace-decode.
+	/// </summary>
+	class TraceRing
+	{
+	public:
+		static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+		static constexpr size_t MAX_CAPACITY = 16 * 1024 * 1024;
+	private:
+		// null until a file is mapped, records are dropped meanwhile
+		std::atomic<TraceRecord*> records{ nullptr };
+		size_t mask = 0;
+		std::atomic<uint64_t> nextIndex{ 0 };
+		int64_t steadyBase = 0;
+
+		TraceRing() = default;
+	public:
+		TraceRing(const TraceRing&) = delete;
+		TraceRing& operator=(const TraceRing&) = delete;
+
+		/// <summary>
+		/// never destroyed, so records written during static destruction stay safe
+		/// </summary>
+		static TraceRing& GetInstance();
+
+		/// <summary>
+		/// %APPDATA%\ssh-agent-bridge.trace on Windows,
+		/// $HOME/.ssh-agent-bridge.trace elsewhere
+		/// </summary>
+		/// <returns>empty if it cannot be determined</returns>
+		static std::wstring GetDefaultPath();
+
+		/// <summary>
+		/// create the ring file and start recording, only once per process.
+		/// An existing file is kept as path.old for the previous run.
+		/// </summary>
+		/// <param name="capacity">records, rounded up to a power of two</param>
+		bool Open(const std::wstring& path, size_t capacity);
+
+		bool IsOpen()const
+		{
+			return records.load(std::memory_order_relaxed) != nullptr;
+		}
+
+		/// <summary>
+		/// append a record, called from any thread, lock free
+		/// </summary>
+		void Record(TraceEvent event, uint64_t contextId,
+			uint8_t state, uint8_t messageType, uint32_t length)noexcept;
+
+		/// <summary>
+		/// a process wide unique id for a traced object
+		/// </summary>
+		static uint64_t NewContextId()noexcept;
+	};
+
+	/// <summary>
+	/// name of a trace event, for decoding
+	/// </summary>
+	const char* TraceEventToString(uint8_t event);
+}
@@ -7,6 +7,8 @@
 #include <string>
 #include <vector>
 
+#include "encoding.h"
+
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
@@ -60,8 +62,6 @@ namespace sab
 	std::wstring GetHandleOwnerSid(HANDLE handle);
 	bool CompareStringSid(const std::wstring& sid1, const std::wstring& sid2);
 
-	std::string WideStringToUtf8String(const std::wstring& str);
-
 	std::wstring ReplaceEnvironmentVariables(const std::wstring& str);
 
 	std::wstring GetExecutablePath();
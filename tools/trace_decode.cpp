@@ -0,0 +1,199 @@
+/*
+ * Print the connection trace ring written by ssh-agent-bridge.
+ *
+ * Works on the file of a running, exited or crashed process. Slots
+ * never written or caught in the middle of a rewrite are skipped, the
+ * rest is printed oldest first.
+ */
+
+#include "trace.h"
+#include "protocol/protocol_ssh_agent.h"
+#include "protocol/proxy_session.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using State = sab::ProxySession::State;
+
+static const char* StateToString(uint8_t state)
+{
+	switch (static_cast<State>(state))
+	{
+	case State::Initialized:
+		return "Initialized";
+	case State::Handshake:
+		return "Handshake";
+	case State::Ready:
+		return "Ready";
+	case State::ReadHeader:
+		return "ReadHeader";
+	case State::ReadBody:
+		return "ReadBody";
+	case State::WaitReply:
+		return "WaitReply";
+	case State::Destroyed:
+		return "Destroyed";
+	}
+	return "?";
+}
+
+static const char* MessageTypeToString(uint8_t type)
+{
+	switch (static_cast<char>(type))
+	{
+	case sab::SSH_AGENT_FAILURE:
+		return "FAILURE";
+	case sab::SSH_AGENT_SUCCESS:
+		return "SUCCESS";
+	case sab::SSH2_AGENTC_REQUEST_IDENTITIES:
+		return "REQUEST_IDENTITIES";
+	case sab::SSH2_AGENT_IDENTITIES_ANSWER:
+		return "IDENTITIES_ANSWER";
+	case sab::SSH2_AGENTC_SIGN_REQUEST:
+		return "SIGN_REQUEST";
+	case sab::SSH2_AGENT_SIGN_RESPONSE:
+		return "SIGN_RESPONSE";
+	case sab::SSH2_AGENTC_ADD_IDENTITY:
+		return "ADD_IDENTITY";
+	case sab::SSH2_AGENTC_REMOVE_IDENTITY:
+		return "REMOVE_IDENTITY";
+	case sab::SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		return "REMOVE_ALL_IDENTITIES";
+	}
+	return nullptr;
+}
+
+/// <summary>
+/// local wall clock time of a record with microseconds
+/// </summary>
+static std::string FormatTime(uint64_t nanoseconds)
+{
+	std::time_t seconds = static_cast<std::time_t>(nanoseconds / 1000000000);
+	std::tm tm;
+#ifdef _WIN32
+	localtime_s(&tm, &seconds);
+#else
+	localtime_r(&seconds, &tm);
+#endif
+	char buffer[64];
+	size_t length = std::strftime(buffer, sizeof(buffer), "%F %T", &tm);
+	std::snprintf(buffer + length, sizeof(buffer) - length, ".%06u",
+		static_cast<unsigned>(nanoseconds % 1000000000 / 1000));
+	return buffer;
+}
+
+/// <summary>
+/// what the event is about: the state entered or the message type
+/// </summary>
+static std::string Detail(const sab::TraceRecord& record)
+{
+	switch (static_cast<sab::TraceEvent>(record.event))
+	{
+	case sab::TraceEvent::State:
+		return StateToString(record.state);
+	case sab::TraceEvent::Dispatch:
+	case sab::TraceEvent::Reply:
+	{
+		const char* name = MessageTypeToString(record.messageType);
+		return name != nullptr ? name : "type " + std::to_string(record.messageType);
+	}
+	default:
+		return std::string("in ") + StateToString(record.state);
+	}
+}
+
+static bool ReadTrace(const char* path, sab::TraceFileHeader& header,
+	std::vector<sab::TraceRecord>& records)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+	{
+		std::fprintf(stderr, "cannot open %s\n", path);
+		return false;
+	}
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		|| std::memcmp(header.magic, sab::TraceFileHeader::MAGIC, sizeof(header.magic)) != 0)
+	{
+		std::fprintf(stderr, "%s is not a trace file\n", path);
+		return false;
+	}
+	if (header.version != sab::TraceFileHeader::VERSION
+		|| header.recordSize != sizeof(sab::TraceRecord)
+		|| header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0
+		|| header.capacity > sab::TraceRing::MAX_CAPACITY)
+	{
+		std::fprintf(stderr, "%s has an unsupported layout, version %u\n", path, header.version);
+		return false;
+	}
+
+	std::vector<sab::TraceRecord> slots(static_cast<size_t>(header.capacity));
+	file.read(reinterpret_cast<char*>(slots.data()),
+		static_cast<std::streamsize>(slots.size() * sizeof(sab::TraceRecord)));
+	size_t slotCount = static_cast<size_t>(file.gcount()) / sizeof(sab::TraceRecord);
+
+	uint64_t mask = header.capacity - 1;
+	for (size_t i = 0; i < slotCount; ++i)
+	{
+		// a sequence not belonging to the slot was torn by a writer lapping another
+		const auto& record = slots[i];
+		if (record.sequence != 0 && ((record.sequence - 1) & mask) == i)
+			records.push_back(record);
+	}
+	std::sort(records.begin(), records.end(),
+		[](const sab::TraceRecord& a, const sab::TraceRecord& b)
+		{
+			return a.sequence < b.sequence;
+		});
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	bool csv = argc == 3 && std::strcmp(argv[1], "-c") == 0;
+	const char* path = argc == (csv ? 3 : 2) ? argv[argc - 1] : nullptr;
+	if (path == nullptr || path[0] == '-')
+	{
+		std::fprintf(stderr, "Usage: %s [-c] <trace file>\n"
+			"  -c  print CSV instead of aligned text\n", argv[0]);
+		return 1;
+	}
+
+	sab::TraceFileHeader header;
+	std::vector<sab::TraceRecord> records;
+	if (!ReadTrace(path, header, records))
+		return 1;
+
+	if (csv)
+		std::printf("sequence,time,elapsed_us,thread,connection,event,state,message_type,length\n");
+	uint64_t previous = records.empty() ? 0 : records.front().timestamp;
+	for (const auto& record : records)
+	{
+		std::string time = FormatTime(header.timeBase + record.timestamp);
+		if (csv)
+		{
+			std::printf("%" PRIu64 ",%s,%.3f,%u,%" PRIu64 ",%s,%s,%u,%u\n",
+				record.sequence, time.c_str(), record.timestamp / 1000.0,
+				record.threadId, record.contextId, sab::TraceEventToString(record.event),
+				StateToString(record.state), record.messageType, record.length);
+			continue;
+		}
+		// the gap to the previous event shows where a connection stalled
+		double gap = record.timestamp >= previous ? (record.timestamp - previous) / 1000.0 : 0.0;
+		previous = record.timestamp;
+		std::printf("%10" PRIu64 " %s %+12.3fus [%6u] conn %-6" PRIu64 " %-8s %-22s %u\n",
+			record.sequence, time.c_str(), gap, record.threadId, record.contextId,
+			sab::TraceEventToString(record.event), Detail(record).c_str(), record.length);
+	}
+	if (!records.empty() && records.front().sequence > 1)
+	{
+		std::fprintf(stderr, "%" PRIu64 " older records were overwritten\n",
+			records.front().sequence - 1);
+	}
+	return 0;
+}
@@ -0,0 +1,588 @@
+
+#include "event_server.h"
+#include "remote_socket.h"
+#include "splice_relay.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+	constexpr size_t RELAY_BUFFER_SIZE = 8 * 1024;
+	constexpr int MAX_EVENTS = 64;
+	// a pooled connection dropped sooner than this is replaced by the next
+	// client rather than right away, which would spin against the listener
+	constexpr std::chrono::seconds MIN_POOLED_LIFETIME{ 1 };
+	// accept again after running out of descriptors, unless a session
+	// closes earlier
+	constexpr int ACCEPT_RETRY_MS = 1000;
+
+	/*
+	 * Bytes on their way from one socket to the other, through a pipe
+	 * with splice if possible, through the buffer otherwise
+	 */
+	struct Relay
+	{
+		char buffer[RELAY_BUFFER_SIZE];
+		size_t begin = 0;
+		size_t end = 0;
+		// source finished sending
+		bool eof = false;
+		// sending side of destination shut down
+		bool shut = false;
+		// null once splice turned out unsupported or no pipe was available
+		std::unique_ptr<SplicePipe> pipe;
+		// data went through the pipe, too late to fall back to the buffer
+		bool spliced = false;
+
+		bool Empty() const
+		{
+			return begin == end && (!pipe || pipe->Pending() == 0);
+		}
+	};
+
+	struct Session;
+
+	/*
+	 * epoll user data, tells which socket of the session is ready
+	 */
+	struct Endpoint
+	{
+		Session* session;
+		bool isRemote;
+	};
+
+	struct Session
+	{
+		enum class State
+		{
+			Connecting = 0,
+			SendingNonce,
+			// authenticated and pooled, waiting for a client, what the
+			// listener sends meanwhile (the libassuan greeting) is buffered
+			Idle,
+			Relaying,
+		};
+
+		// -1 while pooled
+		int clientFd = -1;
+		int remoteFd = -1;
+		State state = State::Connecting;
+		RemoteSocketInfo info;
+		size_t nonceSent = 0;
+		// client to remote
+		Relay upstream;
+		// remote to client
+		Relay downstream;
+		Endpoint clientEndpoint{ this, false };
+		Endpoint remoteEndpoint{ this, true };
+		bool closed = false;
+		std::chrono::steady_clock::time_point idleSince;
+
+		~Session()
+		{
+			if (clientFd >= 0)
+				close(clientFd);
+			if (remoteFd >= 0)
+				close(remoteFd);
+		}
+	};
+
+	class Server
+	{
+	private:
+		int epollFd = -1;
+		int listenFd;
+		RemoteSocketCache socketCache;
+		const std::string& remoteAddress;
+		// connected ahead of clients, oldest first
+		std::deque<Session*> pool;
+		size_t poolSize;
+		// closed in the current batch, freed after it
+		std::vector<Session*> closedList;
+		// out of descriptors, the listener is not watched until a session
+		// closes, its level triggered readiness would spin the loop
+		bool acceptPaused = false;
+	public:
+		Server(int listenFd, const std::string& remoteSocketPath, const std::string& remoteAddress, size_t poolSize)
+			:listenFd(listenFd), socketCache(remoteSocketPath), remoteAddress(remoteAddress), poolSize(poolSize)
+		{
+		}
+
+		~Server()
+		{
+			if (epollFd >= 0)
+				close(epollFd);
+		}
+
+		bool Create()
+		{
+			epollFd = epoll_create1(EPOLL_CLOEXEC);
+			if (epollFd < 0)
+			{
+				std::cerr << "epoll_create1() failed with " << errno << ' ' << strerror(errno) << '\n';
+				return false;
+			}
+			int flags = fcntl(listenFd, F_GETFL);
+			if (flags < 0 || fcntl(listenFd, F_SETFL, flags | O_NONBLOCK) < 0)
+			{
+				std::cerr << "fcntl() failed with " << errno << ' ' << strerror(errno) << '\n';
+				return false;
+			}
+			epoll_event event;
+			std::memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN;
+			event.data.ptr = nullptr;
+			if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) != 0)
+			{
+				std::cerr << "epoll_ctl() failed with " << errno << ' ' << strerror(errno) << '\n';
+				return false;
+			}
+			return true;
+		}
+
+		int Run()
+		{
+			epoll_event events[MAX_EVENTS];
+			Refill();
+			while (true)
+			{
+				int count = epoll_wait(epollFd, events, MAX_EVENTS, acceptPaused ? ACCEPT_RETRY_MS : -1);
+				if (count < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					std::cerr << "epoll_wait() failed with " << errno << ' ' << strerror(errno) << '\n';
+					return 1;
+				}
+				for (int i = 0; i < count; ++i)
+				{
+					auto endpoint = static_cast<Endpoint*>(events[i].data.ptr);
+					if (endpoint == nullptr)
+					{
+						if (!AcceptAll())
+							return 0;
+						continue;
+					}
+					// an earlier event of this batch may have closed it
+					if (!endpoint->session->closed)
+						Progress(endpoint->session, endpoint->isRemote, events[i].events);
+				}
+				// freed descriptors may be enough for the clients in the backlog
+				if (acceptPaused && (count == 0 || !closedList.empty()) && !WatchListener(true))
+					return 1;
+				for (auto session : closedList)
+					delete session;
+				closedList.clear();
+			}
+		}
+	private:
+		bool AcceptAll()
+		{
+			while (true)
+			{
+				int incoming = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (incoming < 0)
+				{
+					switch (errno)
+					{
+					case EAGAIN:
+					case EINTR:
+					case ECONNABORTED:
+						return true;
+					case EMFILE:
+					case ENFILE:
+					case ENOBUFS:
+					case ENOMEM:
+						// the backlog keeps the client until a session closes
+						std::cerr << "accept() failed with " << errno << ' ' << strerror(errno) << '\n';
+						return WatchListener(false);
+					default:
+						std::cerr << "accept() failed with " << errno << ' ' << strerror(errno) << '\n';
+						return false;
+					}
+				}
+				StartSession(incoming);
+			}
+		}
+
+		void StartSession(int clientFd)
+		{
+			auto session = TakePooled();
+			if (session == nullptr)
+			{
+				session = Connect();
+				if (session == nullptr)
+				{
+					close(clientFd);
+					return;
+				}
+			}
+			session->clientFd = clientFd;
+			if (session->state == Session::State::Idle)
+				session->state = Session::State::Relaying;
+
+			// edge triggered, reports the data already waiting right after adding
+			if (!Watch(session->clientFd, &session->clientEndpoint))
+				Close(session);
+
+			Refill();
+		}
+
+		/*
+		 * start connecting to the listener, the session has no client yet
+		 */
+		Session* Connect()
+		{
+			std::unique_ptr<Session> session(new Session());
+			for (auto relay : { &session->upstream, &session->downstream })
+			{
+				// out of descriptors for pipes, copy through the buffer instead
+				relay->pipe.reset(new SplicePipe());
+				if (!relay->pipe->Open(true))
+					relay->pipe.reset();
+			}
+
+			sockaddr_in socketAddress;
+			if (!socketCache.Get(session->info)
+				|| !MakeRemoteAddress(remoteAddress, session->info, socketAddress))
+				return nullptr;
+
+			session->remoteFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (session->remoteFd < 0)
+			{
+				std::cerr << "socket() failed with " << errno << ' ' << strerror(errno) << '\n';
+				return nullptr;
+			}
+			if (connect(session->remoteFd, reinterpret_cast<sockaddr*>(&socketAddress), sizeof(socketAddress)) != 0
+				&& errno != EINPROGRESS)
+			{
+				std::cerr << "connect() failed with " << errno << ' ' << strerror(errno) << '\n';
+				// the listener may have moved to another port
+				socketCache.Invalidate();
+				return nullptr;
+			}
+			if (!Watch(session->remoteFd, &session->remoteEndpoint))
+				return nullptr;
+			return session.release();
+		}
+
+		/*
+		 * hand out the oldest pooled connection that is still alive
+		 */
+		Session* TakePooled()
+		{
+			while (!pool.empty())
+			{
+				auto session = pool.front();
+				pool.pop_front();
+				if (session->state != Session::State::Idle || IsAlive(session))
+					return session;
+				Close(session);
+			}
+			return nullptr;
+		}
+
+		/*
+		 * top the pool up, failures wait for the next client to retry
+		 */
+		void Refill()
+		{
+			while (pool.size() < poolSize)
+			{
+				auto session = Connect();
+				if (session == nullptr)
+					return;
+				pool.push_back(session);
+			}
+		}
+
+		/*
+		 * data waiting on an idle connection is part of the stream,
+		 * only an end of stream or an error means it is gone
+		 */
+		static bool IsAlive(Session* session)
+		{
+			if (session->downstream.eof)
+				return false;
+			char c;
+			ssize_t r = recv(session->remoteFd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+			return r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+		}
+
+		/*
+		 * pause or resume accepting
+		 */
+		bool WatchListener(bool enable)
+		{
+			epoll_event event;
+			std::memset(&event, 0, sizeof(event));
+			event.events = enable ? EPOLLIN : 0;
+			event.data.ptr = nullptr;
+			if (epoll_ctl(epollFd, EPOLL_CTL_MOD, listenFd, &event) != 0)
+			{
+				std::cerr << "epoll_ctl() failed with " << errno << ' ' << strerror(errno) << '\n';
+				return false;
+			}
+			acceptPaused = !enable;
+			return true;
+		}
+
+		bool Watch(int fd, Endpoint* endpoint)
+		{
+			epoll_event event;
+			std::memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			event.data.ptr = endpoint;
+			if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+			{
+				std::cerr << "epoll_ctl() failed with " << errno << ' ' << strerror(errno) << '\n';
+				return false;
+			}
+			return true;
+		}
+
+		void Close(Session* session)
+		{
+			// closing the sockets removes them from epoll
+			session->closed = true;
+			closedList.push_back(session);
+			if (session->clientFd < 0)
+			{
+				auto iter = std::find(pool.begin(), pool.end(), session);
+				if (iter != pool.end())
+					pool.erase(iter);
+			}
+		}
+
+		void Progress(Session* session, bool isRemote, uint32_t events)
+		{
+			if (session->state == Session::State::Connecting)
+			{
+				if (!isRemote || !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+				{
+					// buffer what the client sends meanwhile
+					bool received = false;
+					if (session->clientFd >= 0 && !Receive(session->clientFd, session->upstream, received))
+						Close(session);
+					return;
+				}
+				int error = 0;
+				socklen_t length = sizeof(error);
+				if (getsockopt(session->remoteFd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+				{
+					std::cerr << "connect() failed with " << error << ' ' << strerror(error) << '\n';
+					socketCache.Invalidate();
+					Close(session);
+					return;
+				}
+				session->state = Session::State::SendingNonce;
+			}
+
+			if (session->state == Session::State::SendingNonce)
+			{
+				while (session->nonceSent < NONCE_LENGTH)
+				{
+					ssize_t r = send(session->remoteFd, session->info.nonce + session->nonceSent,
+						NONCE_LENGTH - session->nonceSent, MSG_NOSIGNAL);
+					if (r < 0)
+					{
+						if (errno == EINTR)
+							continue;
+						if (errno == EAGAIN || errno == EWOULDBLOCK)
+							return;
+						std::cerr << "cannot send nonce!\n";
+						Close(session);
+						return;
+					}
+					session->nonceSent += r;
+				}
+				if (session->clientFd >= 0)
+				{
+					session->state = Session::State::Relaying;
+				}
+				else
+				{
+					session->state = Session::State::Idle;
+					session->idleSince = std::chrono::steady_clock::now();
+				}
+			}
+
+			if (session->state == Session::State::Idle)
+			{
+				// edge triggered, the greeting may have come with this event
+				bool received = false;
+				if (!Receive(session->remoteFd, session->downstream, received)
+					|| session->downstream.eof || (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+				{
+					// the nonce went through, the cached port and nonce are
+					// still right, the socket file tells when they change
+					bool recent = std::chrono::steady_clock::now() - session->idleSince < MIN_POOLED_LIFETIME;
+					Close(session);
+					if (!recent)
+						Refill();
+				}
+				return;
+			}
+
+			bool progress = true;
+			while (progress)
+			{
+				progress = false;
+				if (!Pump(session->clientFd, session->remoteFd, session->upstream, progress)
+					|| !Pump(session->remoteFd, session->clientFd, session->downstream, progress))
+				{
+					Close(session);
+					return;
+				}
+			}
+			if (session->upstream.shut && session->downstream.shut)
+				Close(session);
+		}
+
+		/*
+		 * read into the free space of relay, falls back to the buffer
+		 * if the socket cannot be spliced
+		 * returns false on error
+		 */
+		static bool Receive(int from, Relay& relay, bool& received)
+		{
+			while (relay.pipe && !relay.eof)
+			{
+				ssize_t r = relay.pipe->Fill(from);
+				if (r > 0)
+				{
+					received = true;
+					relay.spliced = true;
+				}
+				else if (r == 0)
+				{
+					relay.eof = true;
+				}
+				else if (errno == EAGAIN)
+				{
+					return true;
+				}
+				else if (!relay.spliced && (errno == EINVAL || errno == ENOSYS))
+				{
+					relay.pipe.reset();
+				}
+				else if (errno != EINTR)
+				{
+					std::cerr << "splice() failed with " << errno << ' ' << strerror(errno) << '\n';
+					return false;
+				}
+			}
+
+			while (!relay.eof && relay.end < RELAY_BUFFER_SIZE)
+			{
+				ssize_t r = recv(from, relay.buffer + relay.end, RELAY_BUFFER_SIZE - relay.end, 0);
+				if (r > 0)
+				{
+					received = true;
+					relay.end += r;
+				}
+				else if (r == 0)
+				{
+					relay.eof = true;
+				}
+				else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					break;
+				}
+				else if (errno != EINTR)
+				{
+					std::cerr << "recv() failed with " << errno << ' ' << strerror(errno) << '\n';
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/*
+		 * write what relay holds until the socket would block
+		 * returns false on error
+		 */
+		static bool Send(int to, Relay& relay, bool& sent)
+		{
+			while (relay.pipe && relay.pipe->Pending() != 0)
+			{
+				ssize_t r = relay.pipe->Drain(to);
+				if (r > 0)
+					sent = true;
+				else if (errno == EAGAIN)
+					return true;
+				else if (errno != EINTR)
+				{
+					std::cerr << "splice() failed with " << errno << ' ' << strerror(errno) << '\n';
+					return false;
+				}
+			}
+
+			while (relay.begin < relay.end)
+			{
+				ssize_t r = send(to, relay.buffer + relay.begin, relay.end - relay.begin, MSG_NOSIGNAL);
+				if (r > 0)
+				{
+					sent = true;
+					relay.begin += r;
+				}
+				else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					return true;
+				}
+				else if (errno != EINTR)
+				{
+					std::cerr << "send() failed with " << errno << ' ' << strerror(errno) << '\n';
+					return false;
+				}
+			}
+			relay.begin = relay.end = 0;
+			return true;
+		}
+
+		/*
+		 * move data from one socket to another until either would block,
+		 * shut down the destination after the source finished
+		 * returns false on error
+		 */
+		static bool Pump(int from, int to, Relay& relay, bool& progress)
+		{
+			bool moved = false;
+			if (!Receive(from, relay, moved) || !Send(to, relay, moved))
+				return false;
+
+			// reading may have stopped at a full buffer or pipe rather than an
+			// empty source (splice cannot tell them apart), read again now that
+			// it drained since no new edge is coming for the data left behind
+			if (moved && relay.Empty() && !relay.eof)
+				progress = true;
+
+			if (relay.eof && relay.Empty() && !relay.shut)
+			{
+				shutdown(to, SHUT_WR);
+				relay.shut = true;
+			}
+			return true;
+		}
+	};
+}
+
+int EventLoop(int listenFd, const std::string& remoteSocketPath, const std::string& remoteAddress, size_t poolSize)
+{
+	Server server(listenFd, remoteSocketPath, remoteAddress, poolSize);
+	if (!server.Create())
+		return -1;
+	return server.Run();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+ * Serve all local connections from a single process with epoll,
+ * instead of forking a child for every connection.
+ */
+
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief accept and forward connections until the listener fails
+ * @param listenFd listening unix domain socket
+ * @param remoteSocketPath socket file under windows (wsl path style)
+ * @param remoteAddress windows host ip
+ * @param poolSize connections kept connected and authenticated ahead of clients
+ * @return exit code, or -1 if epoll is unavailable and the caller should
+ * fall back to forking
+ */
+int EventLoop(int listenFd, const std::string& remoteSocketPath, const std::string& remoteAddress, size_t poolSize);
@@ -0,0 +1,357 @@
+
+#include "io_uring_forward.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+	constexpr unsigned RING_ENTRIES = 8;
+
+	// one buffer per direction, both together stay below the 64 KiB
+	// RLIMIT_MEMLOCK older kernels charge registered buffers to
+	constexpr size_t URING_BUFFER_SIZE = 16 * 1024;
+
+	/*
+	 * Minimal io_uring instance, one submitter thread.
+	 */
+	class Ring
+	{
+	private:
+		int ringFd = -1;
+
+		void* sqRing = MAP_FAILED;
+		size_t sqRingSize = 0;
+		void* cqRing = MAP_FAILED;
+		size_t cqRingSize = 0;
+		io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+		size_t sqesSize = 0;
+
+		unsigned* sqHead = nullptr;
+		unsigned* sqTail = nullptr;
+		unsigned* sqArray = nullptr;
+		unsigned sqMask = 0;
+		unsigned sqEntries = 0;
+
+		unsigned* cqHead = nullptr;
+		unsigned* cqTail = nullptr;
+		io_uring_cqe* cqes = nullptr;
+		unsigned cqMask = 0;
+
+		// local tail, published to the kernel on Submit
+		unsigned sqeTail = 0;
+		unsigned submittedTail = 0;
+	public:
+		Ring() = default;
+		Ring(const Ring&) = delete;
+		Ring& operator=(const Ring&) = delete;
+
+		~Ring()
+		{
+			if (sqes != MAP_FAILED)
+				munmap(sqes, sqesSize);
+			if (cqRing != MAP_FAILED && cqRing != sqRing)
+				munmap(cqRing, cqRingSize);
+			if (sqRing != MAP_FAILED)
+				munmap(sqRing, sqRingSize);
+			if (ringFd >= 0)
+				close(ringFd);
+		}
+
+		bool Setup(unsigned entries)
+		{
+			io_uring_params params;
+			std::memset(&params, 0, sizeof(params));
+			ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+			if (ringFd < 0)
+				return false;
+
+			sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+			if (singleMmap)
+			{
+				if (cqRingSize > sqRingSize)
+					sqRingSize = cqRingSize;
+				cqRingSize = sqRingSize;
+			}
+
+			sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+			if (sqRing == MAP_FAILED)
+				return false;
+			if (singleMmap)
+			{
+				cqRing = sqRing;
+			}
+			else
+			{
+				cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+				if (cqRing == MAP_FAILED)
+					return false;
+			}
+			sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+			sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+			if (sqes == MAP_FAILED)
+				return false;
+
+			char* sq = static_cast<char*>(sqRing);
+			sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+			sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+			sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+			sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+			sqEntries = params.sq_entries;
+
+			char* cq = static_cast<char*>(cqRing);
+			cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+			cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+			cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+			cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+
+			sqeTail = submittedTail = *sqTail;
+			return true;
+		}
+
+		bool RegisterBuffers(const iovec* buffers, unsigned count)
+		{
+			return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+		}
+
+		/**
+		 * @brief check if the kernel implements an operation
+		 */
+		bool SupportsOp(unsigned op)
+		{
+			constexpr unsigned PROBE_OPS = 64;
+			std::unique_ptr<char[]> storage(new char[sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op)]());
+			auto probe = reinterpret_cast<io_uring_probe*>(storage.get());
+			// probing needs 5.6, older kernels fail here and are treated as unsupported
+			if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, PROBE_OPS) != 0)
+				return false;
+			return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+		}
+
+		/**
+		 * @brief get a cleared entry to fill
+		 * @return nullptr if the submission queue is full
+		 */
+		io_uring_sqe* GetSqe()
+		{
+			unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+			if (sqeTail - head >= sqEntries)
+				return nullptr;
+			unsigned index = sqeTail & sqMask;
+			io_uring_sqe* sqe = &sqes[index];
+			std::memset(sqe, 0, sizeof(*sqe));
+			sqArray[index] = index;
+			++sqeTail;
+			return sqe;
+		}
+
+		/**
+		 * @brief submit queued entries and wait for completions in one syscall
+		 * @return false on failure, errno is set
+		 */
+		bool SubmitAndWait(unsigned waitCount)
+		{
+			__atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+			unsigned toSubmit = sqeTail - submittedTail;
+			while (true)
+			{
+				int r = static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, waitCount,
+					waitCount ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+				if (r >= 0)
+				{
+					submittedTail += static_cast<unsigned>(r);
+					return true;
+				}
+				if (errno != EINTR)
+					return false;
+				// retry waiting only, entries taken before the signal stay taken
+				toSubmit = sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+				submittedTail = sqeTail - toSubmit;
+			}
+		}
+
+		/**
+		 * @brief take one completion
+		 * @return false if there is none
+		 */
+		bool PopCqe(io_uring_cqe* cqe)
+		{
+			unsigned head = *cqHead;
+			if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+				return false;
+			*cqe = cqes[head & cqMask];
+			__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+	};
+
+	struct Direction
+	{
+		int from;
+		int to;
+		uint8_t* buffer;
+		// registered buffer index
+		unsigned bufferIndex;
+		// bytes received into buffer
+		size_t length;
+		// bytes of buffer already sent
+		size_t written;
+	};
+
+	// user_data of a request: direction index and operation
+	constexpr uint64_t OP_READ = 0;
+	constexpr uint64_t OP_WRITE = 1;
+
+	bool QueueRead(Ring& ring, Direction& dir, uint64_t index)
+	{
+		io_uring_sqe* sqe = ring.GetSqe();
+		if (sqe == nullptr)
+			return false;
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->fd = dir.from;
+		sqe->addr = reinterpret_cast<uint64_t>(dir.buffer);
+		sqe->len = static_cast<uint32_t>(URING_BUFFER_SIZE);
+		sqe->buf_index = static_cast<uint16_t>(dir.bufferIndex);
+		sqe->user_data = (index << 1) | OP_READ;
+		return true;
+	}
+
+	/*
+	 * Send the rest of the buffer, linked with the next read into the same
+	 * buffer: the read starts only after the whole write succeeded, so both
+	 * go to the kernel with one io_uring_enter. A short write breaks the
+	 * link and the read completes as -ECANCELED.
+	 */
+	bool QueueWriteThenRead(Ring& ring, Direction& dir, uint64_t index)
+	{
+		io_uring_sqe* sqe = ring.GetSqe();
+		if (sqe == nullptr)
+			return false;
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->fd = dir.to;
+		sqe->addr = reinterpret_cast<uint64_t>(dir.buffer + dir.written);
+		sqe->len = static_cast<uint32_t>(dir.length - dir.written);
+		sqe->buf_index = static_cast<uint16_t>(dir.bufferIndex);
+		sqe->user_data = (index << 1) | OP_WRITE;
+		return QueueRead(ring, dir, index);
+	}
+}
+
+bool UringForward(int fd1, int fd2)
+{
+	// outlives the ring, requests cancelled at close may still point into it
+	std::unique_ptr<uint8_t[]> storage(new uint8_t[2 * URING_BUFFER_SIZE]);
+
+	Ring ring;
+	if (!ring.Setup(RING_ENTRIES)
+		|| !ring.SupportsOp(IORING_OP_READ_FIXED)
+		|| !ring.SupportsOp(IORING_OP_WRITE_FIXED))
+		return false;
+
+	iovec buffers[2];
+	buffers[0].iov_base = storage.get();
+	buffers[0].iov_len = URING_BUFFER_SIZE;
+	buffers[1].iov_base = storage.get() + URING_BUFFER_SIZE;
+	buffers[1].iov_len = URING_BUFFER_SIZE;
+	if (!ring.RegisterBuffers(buffers, 2))
+		return false;
+
+	Direction dirs[2] = {
+		{ fd1, fd2, storage.get(), 0, 0, 0 },
+		{ fd2, fd1, storage.get() + URING_BUFFER_SIZE, 1, 0, 0 },
+	};
+
+	QueueRead(ring, dirs[0], 0);
+	QueueRead(ring, dirs[1], 1);
+	int inFlight = 2;
+	bool failed = false;
+
+	auto fail = [&]()
+	{
+		if (failed)
+			return;
+		failed = true;
+		// completes the outstanding requests, they still point into storage
+		shutdown(fd1, SHUT_RDWR);
+		shutdown(fd2, SHUT_RDWR);
+	};
+
+	while (inFlight > 0)
+	{
+		if (!ring.SubmitAndWait(1))
+		{
+			std::cerr << "io_uring_enter() failed with " << errno << ' ' << strerror(errno) << '\n';
+			// the kernel cancels whatever is left when the ring closes
+			shutdown(fd1, SHUT_RDWR);
+			shutdown(fd2, SHUT_RDWR);
+			return true;
+		}
+
+		io_uring_cqe cqe;
+		while (ring.PopCqe(&cqe))
+		{
+			--inFlight;
+			uint64_t index = cqe.user_data >> 1;
+			Direction& dir = dirs[index];
+			bool isWrite = (cqe.user_data & 1) == OP_WRITE;
+
+			if (cqe.res == -ECANCELED)
+				continue; // read behind a short write, queued again with the rest
+			if (failed)
+				continue;
+			if (cqe.res < 0)
+			{
+				std::cerr << (isWrite ? "write" : "read") << " failed with " << -cqe.res
+					<< ' ' << strerror(-cqe.res) << '\n';
+				fail();
+				continue;
+			}
+
+			if (isWrite)
+			{
+				dir.written += static_cast<size_t>(cqe.res);
+				if (dir.written < dir.length)
+				{
+					QueueWriteThenRead(ring, dir, index);
+					inFlight += 2;
+				}
+				continue;
+			}
+
+			if (dir.written < dir.length)
+			{
+				// the read must not have run before the write finished
+				std::cerr << "io_uring request order violated!\n";
+				fail();
+				continue;
+			}
+			if (cqe.res == 0)
+			{
+				// half close, keep forwarding the other direction
+				shutdown(dir.from, SHUT_RD);
+				shutdown(dir.to, SHUT_WR);
+				continue;
+			}
+			dir.length = static_cast<size_t>(cqe.res);
+			dir.written = 0;
+			QueueWriteThenRead(ring, dir, index);
+			inFlight += 2;
+		}
+	}
+	return true;
+}
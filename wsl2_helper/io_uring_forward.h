@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * Forwarding between two connected sockets with io_uring.
+ * Talks to the kernel through raw syscalls, no liburing needed.
+ */
+
+/**
+ * @brief forward data in both directions until both sides finished sending
+ * @param fd1 one socket
+ * @param fd2 another socket
+ * @return false if io_uring is unavailable and nothing has been forwarded,
+ * the caller should fall back to another method then
+ */
+bool UringForward(int fd1, int fd2);
@@ -20,16 +20,22 @@
 #include <sys/signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <poll.h>
 #include <pthread.h>
 
+#include "event_server.h"
+#include "io_uring_forward.h"
+#include "remote_socket.h"
+#include "splice_relay.h"
+
 
 
 int PrepareListener();
 int ListenLoop(int fd);
-void HandleConnection(int fd);
+void HandleConnection(int fd, const RemoteSocketInfo& info);
 void DoForward(int fd1, int fd2);
 void GracefullyHup(pollfd(&fdList)[2], int i);
 
@@ -46,6 +52,7 @@ bool ParseCommandLine(int argc, char** argv);
 bool ValidateAddress(const std::string& addr);
 
 void SetThreadName(const std::string& name);
+void RaiseFileLimit();
 
 void MonitorLoop();
 pid_t GetPid();
@@ -57,7 +64,7 @@ void ReleaseHandler(int signal);
 
 
 static constexpr size_t MAX_BUFFER_SIZE = 8 * 1024;
-static constexpr size_t NONCE_LENGTH = 16;
+static constexpr size_t MAX_POOL_SIZE = 64;
 
 char ioBuffer[MAX_BUFFER_SIZE];
 
@@ -69,6 +76,9 @@ bool backgroundRunning = false;
 bool refcountFlag = false;
 bool shouldDeleteSocket = false;
 bool deleteExistSocket = false;
+bool useIoUring = false;
+bool forkMode = false;
+size_t poolSize = 2;
 
 pid_t waitingPid;
 
@@ -79,7 +89,7 @@ int main(int argc, char** argv)
 	// check arguments
 	if (argc <= 1 || !ParseCommandLine(argc, argv))
 	{
-		std::cerr << "Usage: " << argv[0] << " -r <remote> [-l local] [-a remoteAddress] [-b] [-p pidFile] [-c] [-h]\n" <<
+		std::cerr << "Usage: " << argv[0] << " -r <remote> [-l local] [-a remoteAddress] [-b] [-p pidFile] [-c] [-f] [-k poolSize] [-u] [-h]\n" <<
 			"Option:\n" <<
 			"\t-l local\n\t\tsocket path in wsl environment. generated randomly if not specified, path written to stdout\n" <<
 			"\t-r remote\n\t\tsocket file under windows(wsl path style)\n" <<
@@ -88,6 +98,9 @@ int main(int argc, char** argv)
 			"\t-b\n\t\tfork to background\n" <<
 			"\t-p pidFile\n\t\twrite main process pid to file, if process in the file is alive, this process will not do listening\n" <<
 			"\t-c\n\t\tenable refcount, increase refcount when started, decrease refcount when parent process exit\n"
+			"\t-f\n\t\tfork a process for every connection instead of serving all connections from one event loop\n"
+			"\t-k poolSize\n\t\tconnections to windows kept connected and authenticated ahead of clients, default 2, ignored with -f\n"
+			"\t-u\n\t\tforward with io_uring, falls back to poll if the kernel does not support it, implies -f\n"
 			"\t-h\n\t\tdisplay this help message\n" <<
 			"Note: most messages are written to stderr\n" <<
 			"Example: " << argv[0] << " -l /tmp/ssh-agent.sock -r /mnt/c/Users/John/ssh-bridge.sock\n";
@@ -108,6 +121,10 @@ int main(int argc, char** argv)
 	sigaction(SIGINT, &action, NULL);
 	sigaction(SIGHUP, &action, NULL);
 	sigaction(SIGTERM, &action, NULL);
+	// splice cannot ask for MSG_NOSIGNAL, a closed peer must not kill the event loop
+	std::memset(&action, 0, sizeof(action));
+	action.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &action, NULL);
 	std::memset(&action, 0, sizeof(action));
 	action.sa_handler = AddRefHandler;
 	sigaction(SIGUSR1, &action, NULL);
@@ -256,6 +273,9 @@ int main(int argc, char** argv)
 
 	SetThreadName("Main");
 
+	// one event loop serves every connection, each taking about 6 descriptors
+	RaiseFileLimit();
+
 	std::atexit(DeleteSocket);
 
 	// prepare listen socket
@@ -263,6 +283,13 @@ int main(int argc, char** argv)
 	if (listenSocket < 0)
 		return 1;
 
+	if (!forkMode)
+	{
+		int r = EventLoop(listenSocket, remoteSocketPath, remoteAddress, poolSize);
+		if (r >= 0)
+			return r;
+		std::cerr << "falling back to fork mode\n";
+	}
 	return ListenLoop(listenSocket);
 }
 
@@ -314,6 +341,9 @@ int PrepareListener()
 
 int ListenLoop(int fd)
 {
+	// parsed in the parent, children inherit it instead of each reading the file
+	RemoteSocketCache socketCache(remoteSocketPath);
+	RemoteSocketInfo info;
 	bool continueFlag = true;
 	while (continueFlag)
 	{
@@ -330,12 +360,17 @@ int ListenLoop(int fd)
 				break;
 			}
 		}
+		if (!socketCache.Get(info))
+		{
+			close(incoming);
+			continue;
+		}
 		pid_t childPid = fork();
 		if (childPid == 0)
 		{
 			shouldDeleteSocket = false;
 			close(fd);
-			HandleConnection(incoming);
+			HandleConnection(incoming, info);
 			return 0;
 		}
 		else
@@ -347,39 +382,11 @@ int ListenLoop(int fd)
 	return 0;
 }
 
-void HandleConnection(int fd)
+void HandleConnection(int fd, const RemoteSocketInfo& info)
 {
-	std::ifstream socketFile;
-	socketFile.open(remoteSocketPath, std::ios::in | std::ios::binary);
-	if (!socketFile.is_open())
-	{
-		std::cerr << "cannot open remote socket file!\n";
-		return;
-	}
-
-	int portNumber;
-	socketFile >> portNumber;
-	assert((portNumber >= 0) && (portNumber <= 65535));
-	while (!socketFile.eof() && socketFile.peek() == '\n')
-		socketFile.get();
-
-	char nonce[NONCE_LENGTH];
-	socketFile.read(nonce, NONCE_LENGTH);
-	if (socketFile.gcount() != NONCE_LENGTH)
-	{
-		std::cerr << "cannot read nonce!\n";
-		return;
-	}
-
 	sockaddr_in socketAddress;
-	std::memset(&socketAddress, 0, sizeof(socketAddress));
-	socketAddress.sin_family = AF_INET;
-	socketAddress.sin_port = htons(static_cast<in_port_t>(portNumber));
-	if (inet_pton(AF_INET, remoteAddress.c_str(), &socketAddress.sin_addr) <= 0)
-	{
-		std::cerr << "inet_pton failed!\n";
+	if (!MakeRemoteAddress(remoteAddress, info, socketAddress))
 		return;
-	}
 
 	int remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
 	if (remoteSocket < 0)
@@ -394,13 +401,14 @@ void HandleConnection(int fd)
 		return;
 	}
 
-	if (!SendBuffer(remoteSocket, nonce, NONCE_LENGTH))
+	if (!SendBuffer(remoteSocket, info.nonce, NONCE_LENGTH))
 	{
 		std::cerr << "cannot send nonce!\n";
 		return;
 	}
 
-	DoForward(fd, remoteSocket);
+	if ((!useIoUring || !UringForward(fd, remoteSocket)) && !SpliceForward(fd, remoteSocket))
+		DoForward(fd, remoteSocket);
 
 	close(remoteSocket);
 	close(fd);
@@ -600,6 +608,37 @@ bool ParseCommandLine(int argc, char** argv)
 			refcountFlag = true;
 			continue;;
 		}
+		else if (option == "-f")
+		{
+			forkMode = true;
+			continue;
+		}
+		else if (option == "-k")
+		{
+			if (i + 1 >= argc)
+			{
+				std::cerr << "option expect a argument\n";
+				return false;
+			}
+			char* end = nullptr;
+			errno = 0;
+			unsigned long value = std::strtoul(argv[i + 1], &end, 10);
+			if (errno != 0 || end == argv[i + 1] || *end != '\0' || value > MAX_POOL_SIZE)
+			{
+				std::cerr << "invalid pool size \"" << argv[i + 1] << "\"\n";
+				return false;
+			}
+			poolSize = value;
+			++i;
+			continue;
+		}
+		else if (option == "-u")
+		{
+			// io_uring forwarding runs in the per connection process
+			useIoUring = true;
+			forkMode = true;
+			continue;
+		}
 		else if (option == "-h")
 		{
 			return false;
@@ -689,4 +728,18 @@ void ReleaseHandler(int signal)
 void SetThreadName(const std::string& name)
 {
 	pthread_setname_np(pthread_self(), name.c_str());
-}
\ No newline at end of file
+}
+void RaiseFileLimit()
+{
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+	{
+		std::cerr << "getrlimit() failed with " << errno << ' ' << strerror(errno) << '\n';
+		return;
+	}
+	if (limit.rlim_cur == limit.rlim_max)
+		return;
+	limit.rlim_cur = limit.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+		std::cerr << "setrlimit() failed with " << errno << ' ' << strerror(errno) << '\n';
+}
@@ -0,0 +1,208 @@
+
+#include "remote_socket.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+namespace
+{
+	// file systems whose changes may come from elsewhere without inotify events
+	constexpr long V9FS_MAGIC = 0x01021997;
+	constexpr long FUSE_SUPER_MAGIC = 0x65735546;
+	constexpr long NFS_SUPER_MAGIC = 0x6969;
+	constexpr long SMB_SUPER_MAGIC = 0x517b;
+	constexpr long CIFS_SUPER_MAGIC = 0xff534d42;
+	constexpr long SMB2_SUPER_MAGIC = 0xfe534d42;
+
+	bool IsRemoteFileSystem(long type)
+	{
+		switch (type)
+		{
+		case V9FS_MAGIC:
+		case FUSE_SUPER_MAGIC:
+		case NFS_SUPER_MAGIC:
+		case SMB_SUPER_MAGIC:
+		case CIFS_SUPER_MAGIC:
+		case SMB2_SUPER_MAGIC:
+			return true;
+		default:
+			return false;
+		}
+	}
+}
+
+bool ReadRemoteSocketFile(const std::string& path, RemoteSocketInfo& info)
+{
+	std::ifstream socketFile;
+	socketFile.open(path, std::ios::in | std::ios::binary);
+	if (!socketFile.is_open())
+	{
+		std::cerr << "cannot open remote socket file!\n";
+		return false;
+	}
+
+	int portNumber = -1;
+	socketFile >> portNumber;
+	if ((portNumber < 0) || (portNumber > 65535))
+	{
+		std::cerr << "invalid port number in remote socket file!\n";
+		return false;
+	}
+	while (!socketFile.eof() && socketFile.peek() == '\n')
+		socketFile.get();
+
+	socketFile.read(info.nonce, NONCE_LENGTH);
+	if (socketFile.gcount() != NONCE_LENGTH)
+	{
+		std::cerr << "cannot read nonce!\n";
+		return false;
+	}
+	info.portNumber = portNumber;
+	return true;
+}
+
+bool MakeRemoteAddress(const std::string& address, const RemoteSocketInfo& info, sockaddr_in& socketAddress)
+{
+	std::memset(&socketAddress, 0, sizeof(socketAddress));
+	socketAddress.sin_family = AF_INET;
+	socketAddress.sin_port = htons(static_cast<in_port_t>(info.portNumber));
+	if (inet_pton(AF_INET, address.c_str(), &socketAddress.sin_addr) <= 0)
+	{
+		std::cerr << "inet_pton failed!\n";
+		return false;
+	}
+	return true;
+}
+
+RemoteSocketCache::RemoteSocketCache(const std::string& path)
+	:path(path)
+{
+	std::memset(&modifyTime, 0, sizeof(modifyTime));
+
+	// watch the directory, the file may be deleted and created again
+	std::string directory = ".";
+	auto separator = path.rfind('/');
+	if (separator == std::string::npos)
+	{
+		filename = path;
+	}
+	else
+	{
+		directory = separator == 0 ? "/" : path.substr(0, separator);
+		filename = path.substr(separator + 1);
+	}
+
+	struct statfs fsInfo;
+	if (statfs(directory.c_str(), &fsInfo) != 0 || IsRemoteFileSystem(static_cast<long>(fsInfo.f_type)))
+		return;
+
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0)
+		return;
+	if (inotify_add_watch(inotifyFd, directory.c_str(),
+		IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0)
+	{
+		close(inotifyFd);
+		inotifyFd = -1;
+		return;
+	}
+	pollStat = false;
+}
+
+RemoteSocketCache::~RemoteSocketCache()
+{
+	if (inotifyFd >= 0)
+		close(inotifyFd);
+}
+
+bool RemoteSocketCache::Get(RemoteSocketInfo& info)
+{
+	if (valid && !Changed())
+	{
+		info = this->info;
+		return true;
+	}
+
+	// stat before reading, a write racing with the read changes it again
+	// and the next lookup reads once more
+	valid = false;
+	if (pollStat && !StatFile(modifyTime, fileSize, inode))
+		return false;
+	if (!ReadRemoteSocketFile(path, this->info))
+		return false;
+	valid = true;
+	info = this->info;
+	return true;
+}
+
+bool RemoteSocketCache::Changed()
+{
+	bool changed = false;
+	bool watchLost = false;
+	if (inotifyFd >= 0)
+	{
+		alignas(inotify_event) char buffer[4096];
+		while (true)
+		{
+			ssize_t r = read(inotifyFd, buffer, sizeof(buffer));
+			if (r <= 0)
+			{
+				if (r < 0 && errno == EINTR)
+					continue;
+				break;
+			}
+			for (ssize_t offset = 0; offset < r;)
+			{
+				auto event = reinterpret_cast<const inotify_event*>(buffer + offset);
+				if (event->mask & IN_IGNORED)
+					watchLost = true;
+				if ((event->mask & IN_Q_OVERFLOW) || (event->len != 0 && filename == event->name))
+					changed = true;
+				offset += sizeof(inotify_event) + event->len;
+			}
+		}
+	}
+	if (watchLost)
+	{
+		// the directory itself went away, nothing to watch any more
+		close(inotifyFd);
+		inotifyFd = -1;
+		pollStat = true;
+		return true;
+	}
+	if (pollStat)
+	{
+		timespec currentModifyTime;
+		off_t currentSize;
+		ino_t currentInode;
+		if (!StatFile(currentModifyTime, currentSize, currentInode)
+			|| currentModifyTime.tv_sec != modifyTime.tv_sec
+			|| currentModifyTime.tv_nsec != modifyTime.tv_nsec
+			|| currentSize != fileSize
+			|| currentInode != inode)
+			changed = true;
+	}
+	return changed;
+}
+
+bool RemoteSocketCache::StatFile(timespec& modifyTime, off_t& fileSize, ino_t& inode)
+{
+	struct stat fileStatus;
+	if (stat(path.c_str(), &fileStatus) != 0)
+	{
+		std::cerr << "cannot stat remote socket file!\n";
+		return false;
+	}
+	modifyTime = fileStatus.st_mtim;
+	fileSize = fileStatus.st_size;
+	inode = fileStatus.st_ino;
+	return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+/*
+ * The Windows side of a libassuan emulated socket: a file holding the
+ * tcp port of the listener followed by the nonce a client must send.
+ */
+
+#include <string>
+
+#include <netinet/in.h>
+#include <time.h>
+#include <sys/types.h>
+
+static constexpr size_t NONCE_LENGTH = 16;
+
+struct RemoteSocketInfo
+{
+	int portNumber;
+	char nonce[NONCE_LENGTH];
+};
+
+/**
+ * @brief parse the socket file
+ * @param path socket file under windows (wsl path style)
+ * @param info receives port and nonce
+ * @return true for success
+ */
+bool ReadRemoteSocketFile(const std::string& path, RemoteSocketInfo& info);
+
+/**
+ * @brief build the address of the windows listener
+ * @param address windows host ip
+ * @param info port of the listener
+ * @param socketAddress receives the address
+ * @return true for success
+ */
+bool MakeRemoteAddress(const std::string& address, const RemoteSocketInfo& info, sockaddr_in& socketAddress);
+
+/*
+ * Parsed socket file kept in memory, read again only after the file
+ * changed. Changes are noticed with inotify, except on network and 9p
+ * file systems (/mnt/c under WSL2) where writes from Windows raise no
+ * events, there the modification time is compared on every lookup.
+ */
+class RemoteSocketCache
+{
+private:
+	std::string path;
+	std::string filename;
+	int inotifyFd = -1;
+	bool pollStat = true;
+	bool valid = false;
+	RemoteSocketInfo info;
+	timespec modifyTime;
+	off_t fileSize = 0;
+	ino_t inode = 0;
+public:
+	explicit RemoteSocketCache(const std::string& path);
+	~RemoteSocketCache();
+
+	RemoteSocketCache(const RemoteSocketCache&) = delete;
+	RemoteSocketCache& operator=(const RemoteSocketCache&) = delete;
+
+	/**
+	 * @brief get port and nonce, reading the file only if it changed
+	 * @param info receives port and nonce
+	 * @return true for success
+	 */
+	bool Get(RemoteSocketInfo& info);
+
+	/**
+	 * @brief forget the cached content, for when the listener rejected it
+	 */
+	void Invalidate()
+	{
+		valid = false;
+	}
+private:
+	bool Changed();
+	bool StatFile(timespec& modifyTime, off_t& fileSize, ino_t& inode);
+};
@@ -0,0 +1,138 @@
+
+#include "splice_relay.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+	// used when F_GETPIPE_SZ fails, the default size since linux 2.6.11
+	constexpr size_t DEFAULT_PIPE_CAPACITY = 64 * 1024;
+}
+
+SplicePipe::~SplicePipe()
+{
+	if (readFd >= 0)
+		close(readFd);
+	if (writeFd >= 0)
+		close(writeFd);
+}
+
+bool SplicePipe::Open(bool nonblocking)
+{
+	int fds[2];
+	// the pipe itself never blocks, SPLICE_F_NONBLOCK extends that to the sockets
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+		return false;
+	readFd = fds[0];
+	writeFd = fds[1];
+	int size = fcntl(writeFd, F_GETPIPE_SZ);
+	capacity = size > 0 ? static_cast<size_t>(size) : DEFAULT_PIPE_CAPACITY;
+	flags = SPLICE_F_MOVE | (nonblocking ? SPLICE_F_NONBLOCK : 0);
+	return true;
+}
+
+ssize_t SplicePipe::Fill(int from)
+{
+	if (pending == capacity)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	ssize_t r = splice(from, nullptr, writeFd, nullptr, capacity - pending, flags);
+	if (r > 0)
+		pending += r;
+	return r;
+}
+
+ssize_t SplicePipe::Drain(int to)
+{
+	ssize_t r = splice(readFd, nullptr, to, nullptr, pending, flags | SPLICE_F_MORE);
+	if (r > 0)
+		pending -= r;
+	return r;
+}
+
+bool SpliceForward(int fd1, int fd2)
+{
+	SplicePipe pipes[2];
+	if (!pipes[0].Open(false) || !pipes[1].Open(false))
+		return false;
+
+	int fds[2] = { fd1, fd2 };
+	bool eof[2] = { false, false };
+	bool moved = false;
+
+	while (!eof[0] || !eof[1])
+	{
+		pollfd fdList[2];
+		size_t indexList[2];
+		nfds_t count = 0;
+		for (size_t i = 0; i < 2; ++i)
+		{
+			if (eof[i])
+				continue;
+			fdList[count].fd = fds[i];
+			fdList[count].events = POLLIN;
+			fdList[count].revents = 0;
+			indexList[count] = i;
+			++count;
+		}
+
+		int r = poll(fdList, count, -1);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			std::cerr << "poll() failed with " << errno << ' ' << strerror(errno) << '\n';
+			return true;
+		}
+
+		for (nfds_t j = 0; j < count; ++j)
+		{
+			size_t i = indexList[j];
+			if (fdList[j].revents & POLLERR)
+			{
+				std::cerr << "fd " << fds[i] << " encountered an error!\n";
+				return true;
+			}
+			if (!(fdList[j].revents & (POLLIN | POLLHUP)))
+				continue;
+
+			// the pipe is always empty here, one fill never exceeds what one drain loop takes
+			ssize_t rr = pipes[i].Fill(fds[i]);
+			if (rr < 0)
+			{
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				// sockets of this kind cannot be spliced
+				if (!moved && (errno == EINVAL || errno == ENOSYS))
+					return false;
+				std::cerr << "splice() failed with " << errno << ' ' << strerror(errno) << '\n';
+				return true;
+			}
+			if (rr == 0)
+			{
+				eof[i] = true;
+				shutdown(fds[1 - i], SHUT_WR);
+				continue;
+			}
+			moved = true;
+			while (pipes[i].Pending() != 0)
+			{
+				if (pipes[i].Drain(fds[1 - i]) < 0 && errno != EINTR)
+				{
+					std::cerr << "splice() failed with " << errno << ' ' << strerror(errno) << '\n';
+					return true;
+				}
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+/*
+ * Relaying between two sockets through a pipe with splice(2),
+ * the payload never gets copied into user space buffers.
+ */
+
+#include <cstddef>
+
+#include <sys/types.h>
+
+/*
+ * A pipe holding bytes spliced out of one socket until they are
+ * spliced into another.
+ */
+class SplicePipe
+{
+private:
+	int readFd = -1;
+	int writeFd = -1;
+	size_t capacity = 0;
+	size_t pending = 0;
+	unsigned flags = 0;
+public:
+	SplicePipe() = default;
+	~SplicePipe();
+
+	SplicePipe(const SplicePipe&) = delete;
+	SplicePipe& operator=(const SplicePipe&) = delete;
+
+	/**
+	 * @brief create the pipe
+	 * @param nonblocking never block on the sockets either
+	 * @return true for success
+	 */
+	bool Open(bool nonblocking);
+
+	/**
+	 * @brief splice from a socket into the free space of the pipe
+	 * @param from source socket
+	 * @return bytes moved, 0 on end of stream, -1 with errno on failure,
+	 * EAGAIN when the pipe is full
+	 */
+	ssize_t Fill(int from);
+
+	/**
+	 * @brief splice pending bytes into a socket
+	 * @param to destination socket
+	 * @return bytes moved, -1 with errno on failure
+	 */
+	ssize_t Drain(int to);
+
+	size_t Pending() const
+	{
+		return pending;
+	}
+};
+
+/**
+ * @brief forward data in both directions until both sides finished sending
+ * @param fd1 one socket
+ * @param fd2 another socket
+ * @return false if splice is unavailable and nothing has been forwarded,
+ * the caller should fall back to another method then
+ */
+bool SpliceForward(int fd1, int fd2);